@@ -1,48 +1,37 @@
 #include "events.h"
 
-#include <string.h>
-
-#define _MAX_HANDLERS (16)
-
-// private things
-
-typedef struct {
-    uint8_t in_use;
-    event_type_t event_type;
-    EVENT_HANDLER handler;
-    void *context;
-} _event_registration_t;
-
-
-static _event_registration_t _registered_handlers[_MAX_HANDLERS];
+#include "kbcomm.h"
+#include "kbglue.h"
+#include "mouseglue.h"
+#include "telemetry.h"
+#include "power.h"
+
+// Subscribers, by event type.
+
+void event_key_transition(event_key_transition_t transition) {
+#ifdef KB_ISR_INQUIRY_LOOP
+    kg_key_transition(transition);
+#endif
+}
 
+void event_mouse_motion(event_mouse_motion_t motion) {
+    mg_mouse_motion(motion);
+}
 
-// functions
+void event_mouse_button(void) {
+    mg_mouse_button();
+}
 
-event_handle_t event_register_handler(event_type_t event_type, EVENT_HANDLER handler, void *context) {
-    for(uint8_t i = 0; i < _MAX_HANDLERS; i++) {
-        _event_registration_t *reg = &(_registered_handlers[i]);
-        if (!reg->in_use) {
-            reg->in_use = 1;
-            reg->event_type = event_type;
-            reg->handler = handler;
-            reg->context = context;
-            return i;
-        }
-    }
-    return 255;
+void event_usb_state(event_usb_state_t state) {
+    kg_usb_state(state);
+    tm_usb_state(state);
+    pw_usb_state(state);
 }
 
-void event_unregister_handler(event_handle_t handle) {
-    _event_registration_t *reg = &(_registered_handlers[handle]);
-    memset(reg, 0, sizeof(*reg));
+void event_suspended_poll(void) {
+    kg_suspended_poll();
 }
 
-void event_dispatch(event_type_t event_type, void *event_args) {
-    for(uint8_t i = 0; i < _MAX_HANDLERS; i++) {
-        _event_registration_t *reg = &(_registered_handlers[i]);
-        if (reg->in_use && reg->event_type == event_type) {
-            reg->handler(reg->context, event_type, event_args);
-        }
-    }
+void event_host_leds(event_host_leds_t leds) {
+    tm_host_leds(leds);
 }
@@ -3,18 +3,61 @@
 
 #include <stdint.h>
 
-typedef enum {
-    EVENT_TYPE_TICK = 0, // event_args is NULL
+// Events are published by calling the function for the event type, and
+// are delivered straight away by direct calls to each subscriber, in
+// order.  The subscribers are listed in events.c, so adding one means
+// adding a call there; nothing is registered at run time.  Payloads are
+// passed by value.  Publish only from the main loop, never from an ISR.
 
-    EVENT_TYPE_COUNT
-} event_type_t;
+// A key changed on the M0110 (with KB_ISR_INQUIRY_LOOP).
+typedef struct {
+    uint8_t keypad;     // non-zero if the keyboard sent the keypad prefix first
+    uint8_t data;       // the transition, as sent by the keyboard
+} event_key_transition_t;
+void event_key_transition(event_key_transition_t transition);
 
-typedef uint8_t event_handle_t;
-typedef void (*EVENT_HANDLER)(void *context, event_type_t event_type, void *event_args);
+// The quadrature ISRs counted some motion.
+typedef struct {
+    int16_t counts_x;
+    int16_t counts_y;
+} event_mouse_motion_t;
+void event_mouse_motion(event_mouse_motion_t motion);
 
-event_handle_t event_register_handler(event_type_t event_type, EVENT_HANDLER handler, void *context);
-void event_unregister_handler(event_handle_t handle);
+// The mouse button line changed (and may still be bouncing).
+void event_mouse_button(void);
 
-void event_dispatch(event_type_t event_type, void *event_args);
+// The host configured the device, or it was reset or disconnected, or
+// it suspended or resumed the bus.  Subscribers get the whole state and
+// should compare it with the last one they saw.
+typedef struct {
+    uint8_t configured;
+    uint8_t suspended;
+} event_usb_state_t;
+void event_usb_state(event_usb_state_t state);
+
+// While the bus is suspended, sent every 120 ms from the watchdog, so that
+// inputs that can't wake us by themselves can be checked.
+void event_suspended_poll(void);
+
+// The host changed the keyboard LEDs.
+typedef struct {
+    uint8_t leds;       // as keyboard_leds
+} event_host_leds_t;
+void event_host_leds(event_host_leds_t leds);
+
+// Notifications from ISRs to the main loop, one bit each in GPIOR0.  It's
+// in the low I/O space, so an ISR sets its bit with a single sbi and
+// doesn't need to save any registers to do it; the main loop takes and
+// clears them all at once with interrupts disabled.
+#define EVENT_PENDING GPIOR0
+
+#define EVENT_PENDING_WATCHDOG 0      // the watchdog interrupt fired (while suspended)
+#define EVENT_PENDING_MOUSE_MOVED 1   // quadrature counts are waiting
+#define EVENT_PENDING_MOUSE_BUTTON 2  // the mouse button changed
+#define EVENT_PENDING_KEYBOARD 3      // kbcomm has something for kb_postisr
+#define EVENT_PENDING_USB 4           // configuration, suspend or keyboard LEDs may have changed
+#define EVENT_PENDING_TIMERS 5        // software timers expired; see st_dispatch
+
+#define event_set_pending(bit) (EVENT_PENDING |= _BV(bit))
 
 #endif
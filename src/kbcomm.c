@@ -2,7 +2,9 @@
 #include "events.h"
 #include "timevalues.h"
 #include "usb_keyboard.h"
-
+#include "trace.h"
+#include "telemetry.h"
+#include "softtimer.h"
 
 #include <stdint.h>
 #include <string.h>
@@ -14,22 +16,84 @@
 #include <avr/wdt.h>
 #include <util/delay.h>
 
-#define HOLD_FOR_RECEIVE_TICK_COUNT 2
+// Minimum gap between the end of a command byte and re-arming INT7 to
+// receive the keyboard's reply.  We have problems if we expect a
+// received byte too soon, so this used to be a wait for two whole
+// timer0 ticks (4-8 ms); timer1 lets us wait only as long as the
+// keyboard actually needs.
+#ifndef KB_RECEIVE_TURNAROUND_US
+#define KB_RECEIVE_TURNAROUND_US 500
+#endif
+
+#define RECEIVE_TURNAROUND_COUNTS TV_MICROS_TO_TIMER1_COUNTS(KB_RECEIVE_TURNAROUND_US)
+
+// Give up on a byte if the keyboard hasn't clocked it by now.  Inquiry
+// replies come within 250 ms.
+#define TIMEOUT_COUNTS TV_MILLIS_TO_TIMER1_COUNTS(500)
+
+// The keyboard clocks a bit every 330 us when it sends and every 400 us
+// when we do.  Falling edges much closer together than that are noise
+// on the clock line: the byte is garbled, so it's given up on as if it
+// had timed out.  The gap is timed on timer3 to the cycle, so a keyboard
+// that runs fast, or an edge that waited on another ISR, is still well
+// clear of the limit.  An edge followed by nothing for longer than a
+// bit ever takes was noise too, and the byte starts again from the next
+// one.
+//
+// A glitch can also fall far enough from the real edges to pass for a
+// bit, most often on the idle line just before the keyboard replies.
+// The byte then ends one edge early, and the keyboard's last edge comes
+// after it: so a reply is only taken once the clock has been quiet for
+// KB_MAX_BIT_US after its last edge.
+#ifndef KB_MIN_BIT_US
+#define KB_MIN_BIT_US 200
+#endif
+#ifndef KB_MAX_BIT_US
+#define KB_MAX_BIT_US 1000
+#endif
+
+#define MIN_BIT_CYCLES TV_MICROS_TO_TIMER3_CYCLES(KB_MIN_BIT_US)
+#define MAX_BIT_COUNTS TV_MICROS_TO_TIMER1_COUNTS(KB_MAX_BIT_US)
 
 
 static volatile uint8_t _xfer_byte;
 static volatile uint8_t _reading; // 0 = reading from keyboard into _xfer_byte; 1 = writing from _xfer_byte to keyboard
 static volatile uint8_t _count; // number of bits read or written so far
-static volatile uint8_t _completed, _active, _hold_for_receive;
+static volatile uint8_t _completed, _active;
+static uint8_t _write_data; // the byte being written, for starting it again
+static uint16_t _edge_at; // timer1 count at the last falling edge of this byte
+static uint16_t _edge_cycles; // and timer3's
+
+static volatile uint16_t _write_completed_at; // timer1 count at the end of the last byte written
+static volatile uint16_t _turnaround, _max_turnaround; // timer1 counts from end of write to receive armed
 
 
 static void (*_read_completion)(uint8_t result, uint8_t data);
 static void (*_write_completion)(uint8_t result);
 
-static uint16_t _ticks_until_reset;
-static uint16_t _ticks_since_last_comm;
+#ifdef KB_ISR_INQUIRY_LOOP
+#define SCANCODE_QUEUE_SIZE 16 // must be a power of two
+
+typedef struct {
+    uint8_t keypad; // non-zero if the keyboard sent a keypad prefix first
+    uint8_t data;
+} _scancode_t;
+
+static volatile uint8_t _loop_running, _loop_stalled, _loop_park;
+static uint8_t _loop_keypad; // only touched by the ISR
+
+// written only by the ISR at the head, read only by kb_postisr at the tail
+static _scancode_t _scancodes[SCANCODE_QUEUE_SIZE];
+static volatile uint8_t _scancodes_head, _scancodes_tail;
+static volatile uint8_t _scancode_stalls;
 
-static void _tick_handler(void *context, event_type_t event_type, void *event_args);
+static void (*_loop_failed)(void);
+#endif
+
+static void _timed_out(void);
+
+// restarted at the start of every byte
+static st_timer_t _timeout_timer = ST_TIMER(_timed_out, 0);
 
 void kb_setup(void) {
     // Clock always input, pull-up enabled
@@ -44,54 +108,53 @@ void kb_setup(void) {
     EICRB = (EICRB | 0x80) & ~0x40; // int7: trigger on falling edge
 
     EIMSK &= ~0x80; // disable int7 until required
-
-    _ticks_until_reset = (uint8_t)((uint16_t)500 / TVMillisPerTickTimer0);
-
-    event_register_handler(EVENT_TYPE_TICK, _tick_handler, NULL);
 }
 
 #define ISR_CALLS_PER_BYTE 8
-
-static void _tick_handler(void *context, event_type_t event_type, void *event_args) {
-    if (_hold_for_receive) {
-        _hold_for_receive--;
-        if (_hold_for_receive == 0) {
-            // data line to input high
-            KB_DATA_PORT |= _BV(KB_DATA_BIT);
-            KB_DATA_DDR &= ~_BV(KB_DATA_BIT);
-
-            EIFR &= ~0x80; // clear int7 flags
-            EICRB = (EICRB | 0x80) & ~0x40; // int7: trigger on falling edge
-            EIMSK |= 0x80; // enable int7
-        }
+#define QUIET_AFTER_BYTE (ISR_CALLS_PER_BYTE + 1) // _count while a reply waits out KB_MAX_BIT_US
+
+// Called with interrupts disabled, either directly or from the
+// timer1 compare interrupt once the turnaround has elapsed.
+static void _arm_receive(void) {
+    _turnaround = timer1_read() - _write_completed_at;
+    if (_turnaround > _max_turnaround) {
+        _max_turnaround = _turnaround;
     }
 
-    if (!_completed) {
-        _ticks_since_last_comm++;
-        if (_ticks_since_last_comm > _ticks_until_reset) {
-            _completed = 1;
-            _active = 0;
+    // data line to input high
+    KB_DATA_PORT |= _BV(KB_DATA_BIT);
+    KB_DATA_DDR &= ~_BV(KB_DATA_BIT);
 
-            void (*read_completion)(uint8_t result, uint8_t data) = _read_completion;
-            void (*write_completion)(uint8_t result) = _write_completion;
-            _read_completion = NULL;
-            _write_completion = NULL;
+    EIFR &= ~0x80; // clear int7 flags
+    EICRB = (EICRB | 0x80) & ~0x40; // int7: trigger on falling edge
+    EIMSK |= 0x80; // enable int7
+}
 
-            if (_reading && read_completion) {
-                read_completion(1, 0);
-            } else if (!_reading && write_completion) {
-                write_completion(1);
-            }
-        }
+static void _schedule_receive(void) {
+    uint8_t intr_state = SREG;
+    cli();
+
+    uint16_t elapsed = timer1_read() - _write_completed_at;
+    if (elapsed + 1 >= RECEIVE_TURNAROUND_COUNTS) {
+        // already waited long enough (or too close to call)
+        _arm_receive();
+    } else {
+        // one-shot on compare B; see ISR(TIMER1_COMPB_vect)
+        OCR1B = _write_completed_at + RECEIVE_TURNAROUND_COUNTS;
+        TIFR1 = _BV(OCF1B);
+        TIMSK1 |= _BV(OCIE1B);
     }
+
+    SREG = intr_state;
 }
 
+static void _cancel_receive(void) {
+    TIMSK1 &= ~_BV(OCIE1B);
+}
 
-void kb_readbyte(void (*read_completed)(uint8_t result, uint8_t data)) {
+static void _begin_read(void) {
     EIMSK &= ~0x80; // disable int7
-    _ticks_since_last_comm = 0;
-
-    _read_completion = read_completed;
+    st_start(&_timeout_timer, TIMEOUT_COUNTS);
 
     _xfer_byte = 0x00;
     _count = 0;
@@ -99,18 +162,17 @@ void kb_readbyte(void (*read_completed)(uint8_t result, uint8_t data)) {
     _completed = 0;
     _active = 1;
 
-    // we have problems if we expect a received byte too soon, so we wait for the next tick before advising the keyboard of our desire to receive another byte
-    _hold_for_receive = HOLD_FOR_RECEIVE_TICK_COUNT;
+    // we have problems if we expect a received byte too soon, so we wait out the keyboard's turnaround before advising it of our desire to receive another byte
+    _schedule_receive();
 }
 
-void kb_writebyte(uint8_t data, void (*write_completed)(uint8_t result)) {
-
+static void _begin_write(uint8_t data) {
     EIMSK &= ~0x80; // disable int7
-    _ticks_since_last_comm = 0;
-
-    _write_completion = write_completed;
+    _cancel_receive();
+    st_start(&_timeout_timer, TIMEOUT_COUNTS);
 
     _xfer_byte = data;
+    _write_data = data;
     _count = 0;
     _reading = 0;
     _completed = 0;
@@ -125,8 +187,167 @@ void kb_writebyte(uint8_t data, void (*write_completed)(uint8_t result)) {
     EIMSK |= 0x80; // enable int7
 }
 
+// The keyboard stopped answering in the middle of a byte.
+static void _timed_out(void) {
+    uint8_t intr_state = SREG;
+    cli();
+    if (_completed) {
+        // finished (or the inquiry loop paused) after all
+        SREG = intr_state;
+        return;
+    }
+    EIMSK &= ~0x80; // disable int7
+    _cancel_receive();
+    _completed = 1;
+    _active = 0;
+    SREG = intr_state;
+
+#ifdef KB_ISR_INQUIRY_LOOP
+    if (_loop_running) {
+        _loop_running = 0;
+        if (_loop_failed) {
+            _loop_failed();
+        }
+        return;
+    }
+#endif
+
+    void (*read_completion)(uint8_t result, uint8_t data) = _read_completion;
+    void (*write_completion)(uint8_t result) = _write_completion;
+    _read_completion = NULL;
+    _write_completion = NULL;
+
+    if (_reading && read_completion) {
+        read_completion(1, 0);
+    } else if (!_reading && write_completion) {
+        write_completion(1);
+    }
+}
+
+
+void kb_readbyte(void (*read_completed)(uint8_t result, uint8_t data)) {
+    _read_completion = read_completed;
+    _begin_read();
+}
+
+void kb_writebyte(uint8_t data, void (*write_completed)(uint8_t result)) {
+    _write_completion = write_completed;
+    _begin_write(data);
+}
+
+#ifdef KB_ISR_INQUIRY_LOOP
+
+void kb_start_inquiry_loop(void (*loop_failed)(void)) {
+    _loop_failed = loop_failed;
+
+    uint8_t intr_state = SREG;
+    cli();
+    _scancodes_tail = _scancodes_head;
+    _loop_keypad = 0;
+    _loop_stalled = 0;
+    _loop_park = 0;
+    _loop_running = 1;
+    _begin_write(KB_CMD_TRANSITION);
+    SREG = intr_state;
+}
+
+void kb_park_inquiry_loop(uint8_t park) {
+    _loop_park = park;
+}
+
+uint8_t kb_scancode_stalls(void) {
+    return _scancode_stalls;
+}
+
+// Called with interrupts disabled, with the loop between Inquiries.
+static void _stop_inquiry_loop(void) {
+    _loop_running = 0;
+    _completed = 1;
+    _active = 0;
+    st_stop(&_timeout_timer);
+}
+
+// Called from the ISR at the end of every byte while the loop is
+// running.  Sends the next command as soon as the previous reply is in,
+// so keystrokes never wait on the main loop.
+static void _continue_inquiry_loop(void) {
+    if (!_reading) {
+        // command sent; wait for the reply
+        _begin_read();
+        return;
+    }
+
+    uint8_t data = _xfer_byte;
+
+    if (data == KB_REPLY_KEYPAD) {
+        // keypad; perform instant
+        _loop_keypad = 1;
+        _begin_write(KB_CMD_INSTANT);
+        return;
+    }
+
+    if (data != KB_REPLY_NULL) {
+        uint8_t head = _scancodes_head;
+        _scancodes[head].keypad = _loop_keypad;
+        _scancodes[head].data = data;
+        head = (head + 1) & (SCANCODE_QUEUE_SIZE - 1);
+        _scancodes_head = head;
+        event_set_pending(EVENT_PENDING_KEYBOARD);
+        _loop_keypad = 0;
+
+        if (((head + 1) & (SCANCODE_QUEUE_SIZE - 1)) == _scancodes_tail) {
+            // No room for another reply.  The keyboard buffers
+            // transitions itself, so stop asking until kb_postisr
+            // catches up rather than dropping any.
+            _scancode_stalls++;
+            _loop_stalled = 1;
+            _completed = 1;
+            _active = 0;
+            st_stop(&_timeout_timer);
+            return;
+        }
+    }
+
+    if (_loop_park) {
+        _stop_inquiry_loop();
+        return;
+    }
+
+    _begin_write(KB_CMD_TRANSITION);
+}
+
+#endif
+
 void kb_postisr(void) {
-    
+
+#ifdef KB_ISR_INQUIRY_LOOP
+    while (_scancodes_tail != _scancodes_head) {
+        uint8_t tail = _scancodes_tail;
+        event_key_transition_t transition = {
+            .keypad = _scancodes[tail].keypad,
+            .data = _scancodes[tail].data,
+        };
+        _scancodes_tail = (tail + 1) & (SCANCODE_QUEUE_SIZE - 1);
+
+        TRACE_EVENT(TRACE_KB_POSTISR, transition.data);
+        event_key_transition(transition);
+    }
+
+    if (_loop_stalled) {
+        uint8_t intr_state = SREG;
+        cli();
+        _loop_stalled = 0;
+        if (_loop_running) {
+            if (_loop_park) {
+                _stop_inquiry_loop();
+            } else {
+                _begin_write(KB_CMD_TRANSITION);
+            }
+        }
+        SREG = intr_state;
+    }
+#endif
+
     void (*read_completion)(uint8_t result, uint8_t data) = NULL;
     void (*write_completion)(uint8_t result) = NULL;
 
@@ -134,7 +355,7 @@ void kb_postisr(void) {
     cli();
     if (_completed && _active) {
         _active = 0;
-        _ticks_since_last_comm = 0;
+        st_stop(&_timeout_timer);
 
         // end of byte
         _count = ISR_CALLS_PER_BYTE + 1;
@@ -152,6 +373,7 @@ void kb_postisr(void) {
     SREG = intr_state;
 
     if (read_completion) {
+        TRACE_EVENT(TRACE_KB_POSTISR, _xfer_byte);
         read_completion(0, _xfer_byte);
     }
     if (write_completion) {
@@ -159,30 +381,160 @@ void kb_postisr(void) {
     }
 }
 
-uint8_t kb_isr_fired(void) {
-    return (_completed && _active);
+uint8_t kb_busy(void) {
+#ifdef KB_ISR_INQUIRY_LOOP
+    if (_loop_running) {
+        return 1;
+    }
+#endif
+    return _active;
+}
+
+uint32_t kb_turnaround_us(void) {
+    uint8_t intr_state = SREG;
+    cli();
+    uint16_t turnaround = _turnaround;
+    SREG = intr_state;
+
+    return TV_TIMER1_COUNTS_TO_MICROS(turnaround);
+}
+
+uint32_t kb_max_turnaround_us(void) {
+    uint8_t intr_state = SREG;
+    cli();
+    uint16_t turnaround = _max_turnaround;
+    SREG = intr_state;
+
+    return TV_TIMER1_COUNTS_TO_MICROS(turnaround);
+}
+
+// Noise on the clock line garbled the byte: give up on it as if it had
+// timed out.
+static void _garbled(void) {
+    TM_COUNT(TM_COUNTER_KB_GLITCHES);
+    EIMSK &= ~0x80; // disable int7
+    _cancel_receive();
+    st_start(&_timeout_timer, 0);
+}
+
+// Called from INT7 at a falling edge partway through a byte.  Returns
+// non-zero if the edge was noise and the byte has been given up on.
+static uint8_t _check_edge_spacing(void) {
+    uint16_t now = timer1_read();
+    uint16_t cycles = timer3_read();
+    uint16_t since = now - _edge_at;
+    uint16_t since_cycles = cycles - _edge_cycles;
+    _edge_at = now;
+    _edge_cycles = cycles;
+
+    if (since > MAX_BIT_COUNTS) {
+        // the edges so far were noise; this one starts the byte
+        _xfer_byte = _reading ? 0x00 : _write_data;
+        _count = 0;
+    } else if (since_cycles < MIN_BIT_CYCLES) {
+        // (timer3 wraps every 4 ms, but since is short enough to trust it)
+        _garbled();
+        return 1;
+    }
+    return 0;
+}
+
+// The byte's done: hand it on.  Called with int7 disabled.
+static void _end_byte(void) {
+    if (!_reading) {
+        _write_completed_at = timer1_read();
+        TRACE_EVENT(TRACE_KB_SENT, 0);
+    } else {
+        TRACE_EVENT(TRACE_KB_RECEIVED, _xfer_byte);
+        if (_xfer_byte != KB_REPLY_NULL && _xfer_byte != KB_REPLY_KEYPAD) {
+            TRACE_LATENCY_START(TRACE_HISTOGRAM_KEY);
+        }
+    }
+#ifdef KB_ISR_INQUIRY_LOOP
+    if (_loop_running) {
+        _continue_inquiry_loop();
+        return;
+    }
+#endif
+    _completed = 1;
+    event_set_pending(EVENT_PENDING_KEYBOARD);
 }
 
 ISR(INT7_vect) {
-    if (!(KB_CLK_PIN & _BV(KB_CLK_BIT))) {
-        if (_reading) {
-            _xfer_byte = (_xfer_byte << 1) | ((KB_DATA_PIN & _BV(KB_DATA_BIT)) ? 0x01 : 0);
-        } else {
-            if (_xfer_byte & 0x80) {
-                KB_DATA_PORT |= _BV(KB_DATA_BIT);
-            } else {
-                KB_DATA_PORT &= ~_BV(KB_DATA_BIT);
-            }
+    TRACE_ISR(TRACE_ISR_KEYBOARD);
+
+    uint8_t clock = KB_CLK_PIN & _BV(KB_CLK_BIT);
 
-            _xfer_byte <<= 1;
+    if (_count == ISR_CALLS_PER_BYTE) {
+        // Armed for the rising edge that ends the byte.  If the clock's
+        // low it hasn't come yet (changing the sense can raise the flag),
+        // or a glitch has come since; either way there's one to come.
+        if (!clock) {
+            return;
         }
-        _count++;
+        if (_reading) {
+            // wait for quiet before believing it; one-shot on compare B,
+            // see ISR(TIMER1_COMPB_vect)
+            _count = QUIET_AFTER_BYTE;
+            EICRB = (EICRB | 0x80) & ~0x40; // int7: trigger on falling edge
+            OCR1B = _edge_at + MAX_BIT_COUNTS;
+            TIFR1 = _BV(OCF1B);
+            TIMSK1 |= _BV(OCIE1B);
+            return;
+        }
+        EIMSK &= ~0x80; // disable int7 until next call
+        _end_byte();
+        return;
+    }
+
+    if (clock) {
+        // a falling edge, but the clock's high again already: a glitch
+        // shorter than it took to get here, so not a bit at all
+        return;
+    }
+
+    if (_count == QUIET_AFTER_BYTE) {
+        // a ninth bit: the reply started with a glitch, and is missing
+        // its last bit
+        _garbled();
+        return;
+    }
 
-        if (_count == ISR_CALLS_PER_BYTE) {
-            EICRB |= 0xC0; // int7: trigger on RISING edge (to release output)
+    if (_count == 0) {
+        _edge_at = timer1_read();
+        _edge_cycles = timer3_read();
+    } else if (_check_edge_spacing()) {
+        return;
+    }
+
+    if (_reading) {
+        _xfer_byte = (_xfer_byte << 1) | ((KB_DATA_PIN & _BV(KB_DATA_BIT)) ? 0x01 : 0);
+    } else {
+        if (_xfer_byte & 0x80) {
+            KB_DATA_PORT |= _BV(KB_DATA_BIT);
+        } else {
+            KB_DATA_PORT &= ~_BV(KB_DATA_BIT);
         }
+
+        _xfer_byte <<= 1;
+    }
+    _count++;
+
+    if (_count == ISR_CALLS_PER_BYTE) {
+        EICRB |= 0xC0; // int7: trigger on RISING edge (to release output)
+    }
+}
+
+// Compare B is a one-shot for two things that never overlap: the wait
+// after a command before the reply is armed, and the quiet after a reply.
+ISR(TIMER1_COMPB_vect) {
+    TRACE_ISR(TRACE_ISR_TURNAROUND);
+
+    _cancel_receive();
+    if (_reading && _count == QUIET_AFTER_BYTE) {
+        EIMSK &= ~0x80; // disable int7
+        _end_byte();
     } else {
-        EIMSK &= ~0x80; // disable int7 until next call
-        _completed = 1;
+        _arm_receive();
     }
 }
@@ -13,10 +13,49 @@
 #define KB_DATA_DDR DDRB
 #define KB_DATA_BIT 0
 
+// M0110 commands
+#define KB_CMD_TRANSITION 0x10 // Inquiry: reply when a key changes, or null after 250 ms
+#define KB_CMD_INSTANT 0x14
+#define KB_CMD_MODEL 0x16
+
+// M0110 replies
+#define KB_REPLY_KEYPAD 0x79 // keypad key follows; ask for it with KB_CMD_INSTANT
+#define KB_REPLY_NULL 0x7b
+
+// When defined, the Inquiry -> read -> Inquiry sequence (and the
+// Instant that follows a keypad prefix) is driven directly from the
+// keyboard interrupts, and the main loop only sees finished scancodes.
+// Comment this out to drive every byte through kbglue's callbacks.
+#define KB_ISR_INQUIRY_LOOP
+
 void kb_setup(void);
 void kb_readbyte(void (*read_completed)(uint8_t result, uint8_t data));
 void kb_writebyte(uint8_t data, void (*write_completed)(uint8_t result));
+// Call when EVENT_PENDING_KEYBOARD is set.
 void kb_postisr(void);
-uint8_t kb_isr_fired(void);
+
+// Non-zero while a byte (or the inquiry loop) is in progress.
+uint8_t kb_busy(void);
+
+#ifdef KB_ISR_INQUIRY_LOOP
+// Start polling the keyboard from the ISR.  kb_postisr publishes
+// event_key_transition for each key transition; loop_failed is called if
+// the keyboard stops answering, after which the loop is no longer running.
+void kb_start_inquiry_loop(void (*loop_failed)(void));
+
+// With park set, stop the loop at the end of the current Inquiry, once
+// its reply has been queued; kb_busy says when it has.  With park clear,
+// take back a request that hasn't taken effect yet.
+void kb_park_inquiry_loop(uint8_t park);
+
+// Number of times the loop paused because the main loop hadn't drained
+// the scancode queue yet.
+uint8_t kb_scancode_stalls(void);
+#endif
+
+// Measured time from the end of a command byte until we were ready to
+// receive the reply: the last one, and the worst seen since reset.
+uint32_t kb_turnaround_us(void);
+uint32_t kb_max_turnaround_us(void);
 
 #endif
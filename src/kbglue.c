@@ -1,82 +1,160 @@
 #include "kbglue.h"
 
 #include "kbcomm.h"
+#include "events.h"
+#include "timevalues.h"
 #include "usb_keyboard.h"
 #include "keymap.h"
+#include "telemetry.h"
+#include "trace.h"
 
 #include <string.h>
 
-#define CMD_MODEL 0x16
-#define CMD_TRANSITION 0x10
-#define CMD_INSTANT 0x14
-
 static void _model_write_completed(uint8_t result);
 static void _model_read_completed(uint8_t result, uint8_t data);
 
+static void _poll_write_completed(uint8_t result);
+static void _poll_read_completed(uint8_t result, uint8_t data);
+
+#ifdef KB_ISR_INQUIRY_LOOP
+static void _inquiry_loop_failed(void);
+#else
 static void _instant_write_completed(uint8_t result);
 
 static void _transition_write_completed(uint8_t result);
 static void _transition_read_completed(uint8_t result, uint8_t data);
+#endif
 
 static uint8_t _expecting_keypad_result = 0;
 
-static uint8_t _keys_in_buffer[128]; // index is a key scancode; this points to the location in keyboard_keys for each key when pressed and contains 0xff when not pressed
-static uint8_t _keypad_keys_in_buffer[128];
-static uint8_t _shifted_keypad_keys_in_buffer[128];
+typedef enum {
+    KEYMAP_MAIN = 0,
+    KEYMAP_KEYPAD,
+    KEYMAP_SHIFTED_KEYPAD,
+
+    KEYMAP_COUNT
+} _keymap_t;
+
+static uint8_t const * const _keymaps[KEYMAP_COUNT] = {
+    AppleScancodeToUSBKey,
+    AppleKeypadScancodeToUSBKey,
+    AppleShiftedKeypadScancodeToUSBKey,
+};
+
+// One bit per (keymap, scancode >> 1): set while that key is down.  The
+// usage to release is looked up again from the keymap, which can't have
+// changed since the press.
+static uint8_t _pressed[KEYMAP_COUNT][KEYMAP_SIZE / 8];
+
+// Set from the first failed exchange with the keyboard until it answers
+// the Model command again, which can take longer than timer1 takes to
+// wrap.
+static uint8_t _recovering = 0;
+static uint32_t _recovery_started;
+
+// Set while the host has the bus suspended.  The keyboard only clocks
+// when asked to, so it can't wake us by itself: we stop sending it
+// Inquiries, and instead ask it for one transition (with Instant) each
+// time event_suspended_poll comes round.
+static uint8_t _suspended = 0;
 
 
 //
 
+static uint8_t _count_bits(uint8_t bits) {
+    uint8_t count = 0;
+    for (; bits; bits &= bits - 1) {
+        count++;
+    }
+    return count;
+}
+
+// Returns the number of keys (and modifiers) that were down.
+static uint8_t _release_all(void) {
+    uint8_t released = _count_bits(keyboard_modifier_keys);
+    for (uint8_t i = 0; i < sizeof(_pressed); i++) {
+        released += _count_bits(((uint8_t *)_pressed)[i]);
+    }
+
+    memset(_pressed, 0, sizeof(_pressed));
+
+    for(uint8_t i = 0; i < KEYBOARD_KEY_BITS_SIZE; i++) {
+        keyboard_key_bits[i] = 0;
+    }
+    keyboard_modifier_keys = 0;
+    _expecting_keypad_result = 0;
+
+    usb_keyboard_send();
+    return released;
+}
+
 static uint8_t _check_result(uint8_t result) {
     if (result != 0) {
-        // start over
-        kb_writebyte(CMD_MODEL, _model_write_completed);
+        // start over; anything still held down would otherwise be stuck
+        uint8_t released = _release_all();
+        if (!_recovering) {
+            _recovering = 1;
+            _recovery_started = timer1_read32();
+            TM_COUNT(TM_COUNTER_LINK_RESETS);
+            TM_ADD(TM_COUNTER_KEYS_RELEASED, released);
+        }
+        kb_writebyte(KB_CMD_MODEL, _model_write_completed);
     }
     return result;
 }
 
 // processing
 
-static void _dbg_send_data(uint8_t data) {
-    return;
+// Returns non-zero if the key was down in this keymap (and now isn't).
+static uint8_t _unpress(_keymap_t keymap, uint8_t scancode) {
+    uint8_t *pressed = &_pressed[keymap][scancode >> 4];
+    uint8_t bit = 1 << ((scancode >> 1) & 7);
 
-    if (_expecting_keypad_result) {
-        usb_keyboard_press(KEY_K, 0);
+    if (!(*pressed & bit)) {
+        return 0;
     }
-    for (int i = 0; i < 8; i++) {
-        uint8_t ltr = (data & 0x80) ? KEY_1 : KEY_0;
-        data <<= 1;
-        usb_keyboard_press(ltr, 0);
+
+    *pressed &= ~bit;
+    keyboard_key_release(keymap_lookup(_keymaps[keymap], scancode));
+    return 1;
+}
+
+static void _press(_keymap_t keymap, uint8_t scancode, uint8_t data) {
+    uint8_t *pressed = &_pressed[keymap][scancode >> 4];
+    uint8_t bit = 1 << ((scancode >> 1) & 7);
+
+    if (*pressed & bit) {
+        return; // key is already pressed
     }
-    usb_keyboard_press(KEY_ENTER, 0);
 
+    uint8_t key = keymap_lookup(_keymaps[keymap], scancode);
+    if (!key || key >= KEYBOARD_KEY_BITS_SIZE * 8) {
+        tm_unknown_scancode(data);
+        return;
+    }
+
+    *pressed |= bit;
+    keyboard_key_press(key);
 }
 
-static void _press_or_unpress(uint8_t *keys_buffer, uint8_t const *keymap, uint8_t data) {
+static void _press_or_unpress(_keymap_t keymap, uint8_t data) {
     uint8_t scancode = data & 0x7f;
     uint8_t key_up = !!(data & 0x80);
 
+    if (!(scancode & 0x01)) {
+        // not a valid scancode
+        tm_unknown_scancode(data);
+        return;
+    }
+
     if (key_up) {
-        // key up
-        if (keys_buffer[scancode] != 0xff) {
-            keyboard_keys[keys_buffer[scancode]] = 0;
-            keys_buffer[scancode] = 0xff;
-        } // else: key wasn't actually pressed
+        // A keypad key is released from whichever keypad map it was
+        // pressed in, even if shift has changed in the meantime.
+        if (!_unpress(keymap, scancode) && keymap != KEYMAP_MAIN) {
+            _unpress((keymap == KEYMAP_KEYPAD) ? KEYMAP_SHIFTED_KEYPAD : KEYMAP_KEYPAD, scancode);
+        }
     } else {
-        // key down
-        if (keys_buffer[scancode] == 0xff) {
-            if (!keymap[scancode]) {
-                _dbg_send_data(data);
-            }
-
-            for(uint8_t i = 0; i < 6; i++) {
-                if (keyboard_keys[i] == 0) {
-                    keys_buffer[scancode] = i;
-                    keyboard_keys[i] = keymap[scancode];
-                    break;
-                }
-            }
-        } // else: key is already pressed
+        _press(keymap, scancode, data);
     }
 }
 
@@ -104,20 +182,28 @@ static uint8_t _press_or_unpress_if_modifier(uint8_t data) {
 }
 
 static void _process_key(uint8_t data) {
+    TRACE_EVENT(TRACE_KEY_PROCESSED, data);
+    TM_COUNT(TM_COUNTER_KEY_TRANSITIONS);
+
+    if (!(data & 0x80)) {
+        // a key went down; does nothing unless we're suspended
+        usb_remote_wakeup();
+    }
+
     if (!_expecting_keypad_result) {
         if (_press_or_unpress_if_modifier(data)) {
-            _press_or_unpress(_keys_in_buffer, AppleScancodeToUSBKey, data);
+            _press_or_unpress(KEYMAP_MAIN, data);
         }
 
     } else {
         if (keyboard_modifier_keys & MODIFIER_KEY_SHIFT) {
             // shift pressed: use shifted keypad keymap
             keyboard_modifier_keys &= ~MODIFIER_KEY_SHIFT;
-            _press_or_unpress(_shifted_keypad_keys_in_buffer, AppleShiftedKeypadScancodeToUSBKey, data);
+            _press_or_unpress(KEYMAP_SHIFTED_KEYPAD, data);
             usb_keyboard_send();
             keyboard_modifier_keys |= MODIFIER_KEY_SHIFT;
         } else {
-            _press_or_unpress(_keypad_keys_in_buffer, AppleKeypadScancodeToUSBKey, data);
+            _press_or_unpress(KEYMAP_KEYPAD, data);
         }
         _expecting_keypad_result = 0;
     }
@@ -125,6 +211,18 @@ static void _process_key(uint8_t data) {
     usb_keyboard_send();
 }
 
+// Start (or restart) asking for transitions, unless suspended.
+static void _resume_transitions(void) {
+    if (_suspended) {
+        return;
+    }
+#ifdef KB_ISR_INQUIRY_LOOP
+    kb_start_inquiry_loop(_inquiry_loop_failed);
+#else
+    kb_writebyte(KB_CMD_TRANSITION, _transition_write_completed);
+#endif
+}
+
 // reads
 
 static void _model_read_completed(uint8_t result, uint8_t data) {
@@ -132,33 +230,73 @@ static void _model_read_completed(uint8_t result, uint8_t data) {
         return;
     }
 
+    if (_recovering) {
+        _recovering = 0;
+        uint32_t ms = TV_TIMER1_COUNTS_TO_MILLIS(timer1_read32() - _recovery_started);
+        tm_link_recovered((ms > UINT16_MAX) ? UINT16_MAX : ms);
+    }
+
     // don't actually care about model
-    kb_writebyte(CMD_TRANSITION, _transition_write_completed);
+    _resume_transitions();
+}
+
+static void _poll_read_completed(uint8_t result, uint8_t data) {
+    if (_check_result(result)) {
+        return;
+    }
+
+    if (data == KB_REPLY_KEYPAD) {
+        // keypad; the key itself comes with the next Instant
+        _expecting_keypad_result = 1;
+        kb_writebyte(KB_CMD_INSTANT, _poll_write_completed);
+        return;
+    }
+    if (data != KB_REPLY_NULL) {
+        _process_key(data);
+    }
+
+    // the host may have resumed while we were asking
+    _resume_transitions();
+}
+
+#ifdef KB_ISR_INQUIRY_LOOP
+
+void kg_key_transition(event_key_transition_t transition) {
+    _expecting_keypad_result = transition.keypad;
+    _process_key(transition.data);
 }
 
+static void _inquiry_loop_failed(void) {
+    _check_result(1);
+}
+
+#else
+
 static void _transition_read_completed(uint8_t result, uint8_t data) {
     if (_check_result(result)) {
         return;
     }
 
-    if (data == 0x7b) {
+    if (data == KB_REPLY_NULL) {
         // null; wait for next transition
-        kb_writebyte(CMD_TRANSITION, _transition_write_completed);
-    } else if (data == 0x79) {
+        _resume_transitions();
+    } else if (data == KB_REPLY_KEYPAD) {
         // keypad; perform instant
-        // _dbg_send_data(data);
         _expecting_keypad_result = 1;
-        kb_writebyte(CMD_INSTANT, _instant_write_completed);
+        kb_writebyte(KB_CMD_INSTANT, _instant_write_completed);
     } else {
         // process key in data and request next key transition
         _process_key(data);
-        // _dbg_send_data(data);
-        kb_writebyte(CMD_TRANSITION, _transition_write_completed);
+        _resume_transitions();
     }
 }
 
+#endif
+
 // writes
 
+#ifndef KB_ISR_INQUIRY_LOOP
+
 static void _instant_write_completed(uint8_t result) {
     if (_check_result(result)) {
         return;
@@ -176,6 +314,8 @@ static void _transition_write_completed(uint8_t result) {
     kb_readbyte(_transition_read_completed);
 }
 
+#endif
+
 static void _model_write_completed(uint8_t result) {
     if (_check_result(result)) {
         return;
@@ -184,19 +324,37 @@ static void _model_write_completed(uint8_t result) {
     kb_readbyte(_model_read_completed);
 }
 
-void kg_begin(void) {
-
-    for(uint8_t i = 0; i < 128; i++) {
-        _keys_in_buffer[i] = 0xff;
+static void _poll_write_completed(uint8_t result) {
+    if (_check_result(result)) {
+        return;
     }
 
-    for(uint8_t i = 0; i < 128; i++) {
-        _keypad_keys_in_buffer[i] = 0xff;
+    kb_readbyte(_poll_read_completed);
+}
+
+void kg_usb_state(event_usb_state_t state) {
+    if (state.suspended == _suspended) {
+        return;
+    }
+    _suspended = state.suspended;
+
+#ifdef KB_ISR_INQUIRY_LOOP
+    kb_park_inquiry_loop(_suspended);
+#endif
+    // Otherwise whatever is in progress carries on, and picks up where
+    // it should when it finishes.
+    if (!_suspended && !kb_busy()) {
+        _resume_transitions();
     }
+}
 
-    for(uint8_t i = 0; i < 128; i++) {
-        _shifted_keypad_keys_in_buffer[i] = 0xff;
+void kg_suspended_poll(void) {
+    if (!_suspended || _recovering || kb_busy()) {
+        return;
     }
+    kb_writebyte(KB_CMD_INSTANT, _poll_write_completed);
+}
 
-    kb_writebyte(CMD_MODEL, _model_write_completed);
+void kg_begin(void) {
+    kb_writebyte(KB_CMD_MODEL, _model_write_completed);
 }
@@ -1,6 +1,11 @@
 #ifndef KBGLUE_H_
 #define KBGLUE_H_
 
+#include "events.h"
+
 void kg_begin(void);
+void kg_key_transition(event_key_transition_t transition);
+void kg_usb_state(event_usb_state_t state);
+void kg_suspended_poll(void);
 
 #endif
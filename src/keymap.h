@@ -2,9 +2,22 @@
 #define KEYMAP_H_
 
 #include <stdint.h>
+#include <avr/pgmspace.h>
 
-extern uint8_t const AppleScancodeToUSBKey[128];
-extern uint8_t const AppleKeypadScancodeToUSBKey[128];
-extern uint8_t const AppleShiftedKeypadScancodeToUSBKey[128];
+// M0110 scancodes always have bit 0 set, so the tables only hold the
+// odd entries and are indexed by scancode >> 1.  Use keymap_lookup()
+// to read them; they live in flash.
+#define KEYMAP_SIZE 64
+
+extern uint8_t const PROGMEM AppleScancodeToUSBKey[KEYMAP_SIZE];
+extern uint8_t const PROGMEM AppleKeypadScancodeToUSBKey[KEYMAP_SIZE];
+extern uint8_t const PROGMEM AppleShiftedKeypadScancodeToUSBKey[KEYMAP_SIZE];
+
+static inline uint8_t keymap_lookup(uint8_t const *keymap, uint8_t scancode) {
+    if (!(scancode & 0x01)) {
+        return 0;
+    }
+    return pgm_read_byte(&keymap[scancode >> 1]);
+}
 
 #endif
@@ -3,19 +3,18 @@
 #include <avr/interrupt.h>
 #include <avr/sleep.h>
 #include <avr/wdt.h>
-#include <util/delay.h>
 #include <stdint.h>
-#include <stdio.h>
 
 #include "timevalues.h"
 #include "usb_keyboard.h"
 #include "events.h"
 #include "kbcomm.h"
 #include "kbglue.h"
-
-#ifndef NULL
-#define NULL ((void *)0)
-#endif
+#include "mouseglue.h"
+#include "softtimer.h"
+#include "power.h"
+#include "telemetry.h"
+#include "trace.h"
 
 //
 // Private definitions and types
@@ -74,22 +73,8 @@
 // You probably won't need or want to change anything after this
 // line.
 
-// Number of consecutive ticks that a switch has to maintain the same
-// value in order to register a keypress.
-//
-// Calculated the same way as LongPressTime, and affected by
-// Timer0Overflow in the same way as well.
-static uint8_t DebounceTimeLimitMS = 12;
-
-// Amount to report the mouse moves for each quadrature change interrupt.
-static uint8_t const MouseMoveAmountLowSpeed = 0x04;
-static uint8_t const MouseMoveAmountMedSpeed = 0x08;
-static uint8_t const MouseMoveAmountHighSpeed = 0x10;
-
-static uint8_t const MouseCooldownMedSpeedStart =  8; // start highspeed when cooldown hits this value
-static uint8_t const MouseCooldownHighSpeedStart = 16; // start highspeed when cooldown hits this value
-static uint8_t const MouseCooldownHighSpeedCap = 75;
-static uint8_t const MouseCooldownMovementStep = 3; // increment by this amount with each mouse movement; decrement by 1
+// The mouse button debounce time is in mouseglue.c, and acceleration is
+// set by the gain curve in mouseaccel.c.
 
 //
 // End of user-configurable stuff.
@@ -106,20 +91,33 @@ static uint8_t const MouseCooldownMovementStep = 3; // increment by this amount
 // Constants
 //
 
+// Quadrature decoding, indexed by (previous state << 2) | new state,
+// where a state is the two phase pins of one axis (bit 0 = phase 1,
+// bit 1 = phase 2).  Moving in the positive direction goes
+// 0 -> 1 -> 3 -> 2 -> 0.  If both phases changed at once we missed an
+// edge and can't tell which way the mouse went.
+#define QUADRATURE_ILLEGAL 2
+
+static int8_t const QuadratureSteps[16] = {
+     0, +1, -1, QUADRATURE_ILLEGAL,
+    -1,  0, QUADRATURE_ILLEGAL, +1,
+    +1, QUADRATURE_ILLEGAL,  0, -1,
+    QUADRATURE_ILLEGAL, -1, +1,  0,
+};
 
 //
 // Interrupt state
 //
 
-// Whether timer0 fired or not.  Set in ISR, and cleared in main.
-static volatile uint8_t _timer0_fired;
+// Which ISRs have fired is kept in EVENT_PENDING (see events.h).
+
+// Counts accumulated by the quadrature ISRs since the main loop last
+// took them.
+static volatile int16_t _mouse_counts_x, _mouse_counts_y;
 
-// Mouse
-static volatile uint8_t _mouse_quadrature_x_1_fired;
-static volatile uint8_t _mouse_quadrature_x_2_fired;
-static volatile uint8_t _mouse_quadrature_y_1_fired;
-static volatile uint8_t _mouse_quadrature_y_2_fired;
-static volatile uint8_t _mouse_button_fired;
+// Last phase state seen on each axis; only touched by the ISRs (and
+// setup, before they're enabled).
+static uint8_t _mouse_state_x, _mouse_state_y;
 
 
 //
@@ -130,8 +128,8 @@ static void setup(void) {
 
 
     LED_CONFIG;
-    LED_ON;
-    
+    LED_OFF; // comes on once the host has configured us
+
     // Clear the watchdog
     MCUSR &= ~_BV(WDRF);
     wdt_disable();
@@ -147,27 +145,15 @@ static void setup(void) {
     // the switch is pressed (ie. active low).
     PORTB = 0x7f;
 
-    LED_OFF;
-    
-	// Initialize USB, and then wait for the host to set
-	// configuration.  If the Teensy is powered without a PC connected
-	// to the USB port, this will wait forever.
-	usb_init();
-	while (!usb_configured()) /* wait */ ;
-
-    LED_ON;
-    
-	// Wait an extra second for the PC's operating system to load
-	// drivers and do whatever it does to actually be ready for input.
-	// Show a little light show during this time.
-    for(uint8_t i = 0; i < 5; i++) {
-        _delay_ms(180);
-        LED_OFF;
-        _delay_ms(20);
-        LED_ON;
-    }
-    
     cli();
+
+    EVENT_PENDING = 0; // nothing has fired yet
+
+    // Software timers run on timer1, so start it before anyone uses
+    // them.  It also counts from here, so telemetry's startup times are
+    // from power-up.
+    timer1_setup();
+    timer3_setup();
     
     // PORTD[0:3] as quadrature inputs (pull-ups in case mouse is disconnected, but it always sends logic high/low)
     DDRD &= ~0x0f;
@@ -177,10 +163,8 @@ static void setup(void) {
     EICRA = 0x55; // int3:0: trigger on any edge change
     EIMSK |= 0x0f; // enable int3:0
     EIFR &= ~0x0f; // clear int3:0 flags
-    _mouse_quadrature_x_1_fired = 0;
-    _mouse_quadrature_x_2_fired = 0;
-    _mouse_quadrature_y_1_fired = 0;
-    _mouse_quadrature_y_2_fired = 0;
+    _mouse_state_x = PIND & 0x03;
+    _mouse_state_y = (PIND >> 2) & 0x03;
 
     // PORTE6 as button input (requires pull-up)
     DDRE &= ~0x40;
@@ -190,63 +174,50 @@ static void setup(void) {
     EICRB = 0x10; // int6: trigger on any edge change
     EIMSK |= 0x40; // enable int6
     EIFR &= ~0x40; // clear int6 flags
-    _mouse_button_fired = 0;
-
-    // Configure timer 0 to give us ticks
-	TCCR0A = 0x00;
-	TCCR0B = TVTimer0Overflow & 0x07;
-	TIMSK0 = (1<<TOIE0); // use the overflow interrupt only
-    _timer0_fired = 0;
 
     kb_setup();
 
-    timer1_setup();
-}
+    tm_setup();
 
-static int anything_fired(void) {
-    return _timer0_fired || _mouse_quadrature_x_1_fired || _mouse_quadrature_x_2_fired || _mouse_quadrature_x_1_fired || _mouse_quadrature_y_2_fired || kb_isr_fired() || _mouse_button_fired;
+    // Don't wait for the host: enumeration carries on in the USB
+    // interrupts while the keyboard and mouse start up, and anything
+    // typed in the meantime is held until the host configures us (see
+    // usb_keyboard_send).  This enables interrupts.
+    usb_init();
 }
 
 static void run(void) {
-    /* char buf[100]; */
-    /* _delay_ms(100); */
+    // There's no regular tick: the CPU sleeps until an input, the USB
+    // controller or the next software timer wakes it.
+    pw_setup();
 
-    /* uint32_t start = timer1_read_ms(); */
-    /* snprintf(buf, 100, "start %ld (%d)\n", start, timer1_read()); */
-    /* usb_keyboard_send_message(buf); */
-
-    /* _delay_ms(500); */
-    /* uint32_t end = timer1_read_ms(); */
-
-    /* snprintf(buf, 100, "%ld (%d) - %ld = %ld ms\n", end, timer1_read(), start, end - start); */
-    /* usb_keyboard_send_message(buf); */
-    
-    wdt_reset();
-    wdt_enable(WDTO_1S);
-
-    uint8_t const DebounceTickLimit = DebounceTimeLimitMS / TVMillisPerTickTimer0;
-
-    // mouse button debounce state
-    uint8_t mouse_current_button = 0;
-    uint8_t mouse_button_debounce_ticks = DebounceTickLimit + 1;
-
-    // mouse "acceleration"
-    uint8_t mouse_cooldown_ticks_x = 0, mouse_cooldown_ticks_y = 0;
+    // what the host last told us, to spot changes
+    event_usb_state_t usb_state = { usb_configured(), usb_suspended() };
+    uint8_t host_leds = keyboard_leds;
+    event_usb_state(usb_state);
 
     kg_begin();
 
 	for(;;) {        
-        uint8_t timer0_fired = 0;
-        uint8_t mouse_quadrature_x_1_fired = 0;
-        uint8_t mouse_quadrature_x_2_fired = 0;
-        uint8_t mouse_quadrature_y_1_fired = 0;
-        uint8_t mouse_quadrature_y_2_fired = 0;
-        uint8_t mouse_button_fired = 0;
+        uint8_t pending;
+        int16_t mouse_counts_x = 0;
+        int16_t mouse_counts_y = 0;
         
         // Watch for interrupts, and sleep if nothing has fired.
+        uint16_t wakeups = 0;
+        uint16_t sleep_started;
+        uint16_t slept = 0;
+
         cli();
-        while(!anything_fired()) {
-            set_sleep_mode(SLEEP_MODE_IDLE);
+        sleep_started = timer1_read();
+        while(!EVENT_PENDING) {
+            uint8_t sleep_mode = pw_sleep_mode();
+            if (sleep_mode == SLEEP_MODE_PWR_DOWN && (PINE & _BV(6))) {
+                // INT6 can't see edges without the I/O clock, so wake
+                // on the button going low instead; the ISR puts it back.
+                EICRB &= ~0x30;
+            }
+            set_sleep_mode(sleep_mode);
             sleep_enable();
             // It's safe to enable interrupts (sei) immediately before
             // sleeping.  Interrupts can't fire until after the
@@ -256,125 +227,65 @@ static void run(void) {
             sleep_cpu();
             sleep_disable();
             cli();
+            wakeups++;
+        }
+        if (wakeups) {
+            slept = timer1_read() - sleep_started;
         }
 
-        timer0_fired = _timer0_fired;
-        mouse_quadrature_x_1_fired = _mouse_quadrature_x_1_fired;
-        mouse_quadrature_x_2_fired = _mouse_quadrature_x_2_fired;
-        mouse_quadrature_y_1_fired = _mouse_quadrature_y_1_fired;
-        mouse_quadrature_y_2_fired = _mouse_quadrature_y_2_fired;
-        mouse_button_fired = _mouse_button_fired;
-
-        _timer0_fired = 0;
-        _mouse_quadrature_x_1_fired = 0;
-        _mouse_quadrature_x_2_fired = 0;
-        _mouse_quadrature_y_1_fired = 0;
-        _mouse_quadrature_y_2_fired = 0;
-        _mouse_button_fired = 0;
+        pending = EVENT_PENDING;
+        EVENT_PENDING = 0;
+        if (pending & _BV(EVENT_PENDING_MOUSE_MOVED)) {
+            mouse_counts_x = _mouse_counts_x;
+            mouse_counts_y = _mouse_counts_y;
+            _mouse_counts_x = 0;
+            _mouse_counts_y = 0;
+        }
 
         sei();
 
-        // Keyboard
-
-        kb_postisr();
-
-        //
-        // Mouse button
-        //
-
-        int8_t mouse_button_changed = 0;
-
-        if (timer0_fired) {
-            wdt_reset();
-
-            // dispatch to listeners
-            event_dispatch(EVENT_TYPE_TICK, NULL);
-
-            // mouse debounce
-
-            if (mouse_button_debounce_ticks < DebounceTickLimit) {
-                mouse_button_debounce_ticks++;
-
-                if (mouse_button_debounce_ticks == DebounceTickLimit) {
-                    mouse_button_changed = 1;
-                    mouse_current_button = (PINE & _BV(6)) ? 0x00 : 0x01;
-                }
-            }
-
-            if (mouse_cooldown_ticks_x != 0) {
-                mouse_cooldown_ticks_x--;
-            }
-            if (mouse_cooldown_ticks_y != 0) {
-                mouse_cooldown_ticks_y--;
-            }
+        if (wakeups) {
+            tm_idle(wakeups, slept);
         }
 
-        //
-        // Mouse movement
-        //
-
-        // If a quadrature pair doesn't match, then the one whose interrupt fired has a
-        // leading edge, indicating that the mouse is moving in that direction.
+        // Turn what the ISRs flagged into events.
 
-        int8_t delta_x = 0;
-        int8_t delta_y = 0;
-
-        uint8_t mouse_speed_x = (mouse_cooldown_ticks_x >= MouseCooldownHighSpeedStart) ? MouseMoveAmountHighSpeed : ((mouse_cooldown_ticks_x >= MouseCooldownMedSpeedStart) ? MouseMoveAmountMedSpeed : MouseMoveAmountLowSpeed);
-        uint8_t mouse_speed_y = (mouse_cooldown_ticks_y >= MouseCooldownHighSpeedStart) ? MouseMoveAmountHighSpeed : ((mouse_cooldown_ticks_y >= MouseCooldownMedSpeedStart) ? MouseMoveAmountMedSpeed : MouseMoveAmountLowSpeed);
-        
-        if (mouse_quadrature_x_1_fired) {
-            uint8_t leading = (!(PIND & _BV(0)) != !(PIND & _BV(1)));
-            if (leading) {
-                delta_x += mouse_speed_x;
-            } else {
-                delta_x -= mouse_speed_y;
-            }
+        if (pending & _BV(EVENT_PENDING_KEYBOARD)) {
+            kb_postisr();
         }
 
-        if (mouse_quadrature_x_2_fired) {
-            uint8_t leading = (!(PIND & _BV(0)) != !(PIND & _BV(1)));
-            if (leading) {
-                delta_x -= mouse_speed_x;
-            } else {
-                delta_x += mouse_speed_y;
-            }
+        if (pending & _BV(EVENT_PENDING_TIMERS)) {
+            st_dispatch();
         }
 
-        if (mouse_quadrature_y_1_fired) {
-            uint8_t leading = (!(PIND & _BV(2)) != !(PIND & _BV(3)));
-            if (leading) {
-                delta_y -= mouse_speed_x;
-            } else {
-                delta_y += mouse_speed_y;
-            }
+        if (pending & _BV(EVENT_PENDING_MOUSE_BUTTON)) {
+            event_mouse_button();
         }
 
-        if (mouse_quadrature_y_2_fired) {
-            uint8_t leading = (!(PIND & _BV(2)) != !(PIND & _BV(3)));
-            if (leading) {
-                delta_y += mouse_speed_x;
-            } else {
-                delta_y -= mouse_speed_y;
-            }
+        if (mouse_counts_x != 0 || mouse_counts_y != 0) {
+            event_mouse_motion((event_mouse_motion_t){ mouse_counts_x, mouse_counts_y });
         }
 
-        if (mouse_button_fired) {
-            mouse_button_debounce_ticks = 0;
+        if (pending & _BV(EVENT_PENDING_WATCHDOG)) {
+            event_suspended_poll();
         }
 
-        if (delta_x != 0 || delta_y != 0 || mouse_button_changed) {
-            if (delta_x != 0) {
-                if (mouse_cooldown_ticks_x < MouseCooldownHighSpeedCap - MouseCooldownMovementStep) {
-                    mouse_cooldown_ticks_x += MouseCooldownMovementStep;
+        if (pending & _BV(EVENT_PENDING_USB)) {
+            uint8_t configured = usb_configured();
+            uint8_t suspended = usb_suspended();
+            if (configured != usb_state.configured || suspended != usb_state.suspended) {
+                usb_state = (event_usb_state_t){ configured, suspended };
+                event_usb_state(usb_state);
+                if (configured) {
+                    LED_ON;
+                } else {
+                    LED_OFF;
                 }
             }
-            if (delta_y != 0) {
-                if (mouse_cooldown_ticks_y < MouseCooldownHighSpeedCap - MouseCooldownMovementStep) {
-                    mouse_cooldown_ticks_y += MouseCooldownMovementStep;
-                }
+            if (keyboard_leds != host_leds) {
+                host_leds = keyboard_leds;
+                event_host_leds((event_host_leds_t){ host_leds });
             }
-        
-            usb_mouse_send(mouse_current_button, delta_x, delta_y);
         }
     }
 }
@@ -386,27 +297,51 @@ int main(void) {
 }
 
 
-// Timer 0 overflow interrupt handler.
-ISR(TIMER0_OVF_vect) {
-    _timer0_fired = 1;
-}
+// Both phases of an axis share one handler: read the pins once, look
+// up the transition, and accumulate.
 
 ISR(INT0_vect) {
-    _mouse_quadrature_x_1_fired = 1;
-}
+    TRACE_ISR(TRACE_ISR_QUADRATURE_X);
 
-ISR(INT1_vect) {
-    _mouse_quadrature_x_2_fired = 1;
+    uint8_t state = PIND & 0x03;
+    int8_t step = QuadratureSteps[(_mouse_state_x << 2) | state];
+    _mouse_state_x = state;
+
+    if (step == QUADRATURE_ILLEGAL) {
+        TM_COUNT(TM_COUNTER_QUADRATURE_ERRORS);
+    } else {
+        _mouse_counts_x += step;
+        TM_COUNT(TM_COUNTER_MOUSE_EDGES);
+    }
+    event_set_pending(EVENT_PENDING_MOUSE_MOVED);
+    TRACE_EVENT(TRACE_QUADRATURE, 0);
+    TRACE_LATENCY_START(TRACE_HISTOGRAM_MOTION);
 }
 
+ISR(INT1_vect, ISR_ALIASOF(INT0_vect));
+
 ISR(INT2_vect) {
-    _mouse_quadrature_y_1_fired = 1;
+    TRACE_ISR(TRACE_ISR_QUADRATURE_Y);
+
+    uint8_t state = (PIND >> 2) & 0x03;
+    int8_t step = QuadratureSteps[(_mouse_state_y << 2) | state];
+    _mouse_state_y = state;
+
+    // the Y phases are wired the opposite way round to X
+    if (step == QUADRATURE_ILLEGAL) {
+        TM_COUNT(TM_COUNTER_QUADRATURE_ERRORS);
+    } else {
+        _mouse_counts_y -= step;
+        TM_COUNT(TM_COUNTER_MOUSE_EDGES);
+    }
+    event_set_pending(EVENT_PENDING_MOUSE_MOVED);
+    TRACE_EVENT(TRACE_QUADRATURE, 1);
+    TRACE_LATENCY_START(TRACE_HISTOGRAM_MOTION);
 }
 
-ISR(INT3_vect) {
-    _mouse_quadrature_y_2_fired = 1;
-}
+ISR(INT3_vect, ISR_ALIASOF(INT2_vect));
 
 ISR(INT6_vect) {
-    _mouse_button_fired = 1;
+    EICRB = (EICRB & ~0x30) | 0x10; // back to any edge, after a power-down
+    event_set_pending(EVENT_PENDING_MOUSE_BUTTON);
 }
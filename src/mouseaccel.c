@@ -0,0 +1,81 @@
+#include "mouseaccel.h"
+#include "timevalues.h"
+
+#include <stdlib.h>
+
+#include <avr/pgmspace.h>
+
+// Gain applied to each count, as 8.8 fixed point, at velocities of 0,
+// 0.25, 0.5, ... 4 counts per ms.  Values in between are interpolated,
+// and anything faster gets the last entry.  The ends match the old
+// low and high speed steps (4 and 16 per count).
+#define GAIN_STEP_SHIFT 2 // velocity units (1/16 count per ms) between entries
+#define GAIN_POINTS 17
+
+static uint16_t const PROGMEM GainCurve[GAIN_POINTS] = {
+    0x0400, 0x0400, 0x0480, 0x0580,
+    0x0700, 0x0880, 0x0a00, 0x0b80,
+    0x0d00, 0x0e00, 0x0f00, 0x0f80,
+    0x1000, 0x1000, 0x1000, 0x1000,
+    0x1000,
+};
+
+// A pause longer than this (in timer1 counts) starts velocity from
+// scratch rather than averaging with the old value.
+#define IDLE_COUNTS TV_MICROS_TO_TIMER1_COUNTS(64000UL)
+
+static uint16_t _gain(uint16_t velocity) {
+    uint8_t index = velocity >> GAIN_STEP_SHIFT;
+    if (index >= GAIN_POINTS - 1) {
+        return pgm_read_word(&GainCurve[GAIN_POINTS - 1]);
+    }
+
+    uint16_t low = pgm_read_word(&GainCurve[index]);
+    uint16_t high = pgm_read_word(&GainCurve[index + 1]);
+    uint8_t fraction = velocity & ((1 << GAIN_STEP_SHIFT) - 1);
+
+    return low + (((int32_t)high - low) * fraction >> GAIN_STEP_SHIFT);
+}
+
+int16_t ma_apply(ma_axis_t *axis, int16_t counts, uint32_t now) {
+    if (counts == 0) {
+        return 0;
+    }
+
+    // 32 bits, because 16 would wrap every 4.2 s: a pause of just under
+    // that would look like a burst of speed.
+    uint32_t elapsed = now - axis->last_time;
+    axis->last_time = now;
+    if (elapsed == 0) {
+        elapsed = 1;
+    }
+
+    // counts per ms with 4 fractional bits: counts * 16 * 1000 / (elapsed * 64 us)
+    uint32_t sample = (uint32_t)abs(counts) * (16UL * 1000 / TV_MICROS_PER_COUNT_TIMER1) / elapsed;
+    if (sample > UINT16_MAX) {
+        sample = UINT16_MAX;
+    }
+
+    if (elapsed > IDLE_COUNTS) {
+        axis->velocity = sample;
+    } else {
+        axis->velocity = ((uint32_t)axis->velocity + sample) / 2;
+    }
+
+    // a change of direction shouldn't inherit the fraction left over
+    // from moving the other way
+    if ((counts < 0) != (axis->remainder < 0)) {
+        axis->remainder = 0;
+    }
+
+    int32_t scaled = (int32_t)counts * _gain(axis->velocity) + axis->remainder;
+    int32_t movement = scaled / 256;
+    axis->remainder = scaled - movement * 256;
+
+    if (movement > INT16_MAX) {
+        return INT16_MAX;
+    } else if (movement < -INT16_MAX) {
+        return -INT16_MAX;
+    }
+    return movement;
+}
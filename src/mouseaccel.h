@@ -0,0 +1,17 @@
+#ifndef MOUSEACCEL_H_
+#define MOUSEACCEL_H_
+
+#include <stdint.h>
+
+// Per-axis acceleration state.  Zero-initialise before first use.
+typedef struct {
+    uint32_t last_time; // timer1_read32 at the last movement
+    uint16_t velocity;  // smoothed counts per ms, 4 fractional bits
+    int16_t remainder;  // output not yet reported, 8 fractional bits
+} ma_axis_t;
+
+// Convert quadrature counts that arrived at `now` (from timer1_read32)
+// into pointer movement, according to how fast the axis is moving.
+int16_t ma_apply(ma_axis_t *axis, int16_t counts, uint32_t now);
+
+#endif
@@ -0,0 +1,51 @@
+#include "mouseglue.h"
+
+#include "timevalues.h"
+#include "usb_keyboard.h"
+#include "mouseaccel.h"
+#include "softtimer.h"
+
+#include <stdint.h>
+
+#include <avr/io.h>
+
+// Number of microseconds that the button has to hold the same value
+// before we report it.
+#define DEBOUNCE_TIME_US 12000UL
+
+static void _debounce_expired(void);
+
+// button debounce state
+static uint8_t _current_button = 0;
+static st_timer_t _debounce_timer = ST_TIMER(_debounce_expired, 0);
+
+// acceleration
+static ma_axis_t _accel_x, _accel_y;
+
+// The button has held still for the whole debounce time.
+static void _debounce_expired(void) {
+    _current_button = (PINE & _BV(6)) ? 0x00 : 0x01;
+    if (_current_button) {
+        // does nothing unless we're suspended
+        usb_remote_wakeup();
+    }
+    usb_mouse_send(_current_button, 0, 0);
+}
+
+// The quadrature ISRs have already decoded every edge into counts;
+// accelerate them according to how fast they're coming.
+void mg_mouse_motion(event_mouse_motion_t motion) {
+    uint32_t now = timer1_read32();
+    int16_t delta_x = ma_apply(&_accel_x, motion.counts_x, now);
+    int16_t delta_y = ma_apply(&_accel_y, motion.counts_y, now);
+
+    if (delta_x != 0 || delta_y != 0) {
+        usb_mouse_send(_current_button, delta_x, delta_y);
+    }
+}
+
+// The button line changed; wait for it to settle, starting over if it
+// was already settling.
+void mg_mouse_button(void) {
+    st_start(&_debounce_timer, TV_MICROS_TO_TIMER1_COUNTS(DEBOUNCE_TIME_US));
+}
@@ -0,0 +1,12 @@
+#ifndef MOUSEGLUE_H_
+#define MOUSEGLUE_H_
+
+#include "events.h"
+
+// Turns quadrature counts and button edges from the ISRs into USB mouse
+// reports: debounces the button and applies acceleration.
+
+void mg_mouse_motion(event_mouse_motion_t motion);
+void mg_mouse_button(void);
+
+#endif
@@ -0,0 +1,70 @@
+#include "power.h"
+#include "timevalues.h"
+#include "softtimer.h"
+#include "kbcomm.h"
+#include "usb_keyboard.h"
+
+#include <stdint.h>
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+
+static void _watchdog_service(void);
+
+// The watchdog is reset from a software timer, so it only bites if the
+// main loop stops dispatching them.
+static st_timer_t _watchdog_timer = ST_TIMER(_watchdog_service, TV_MILLIS_TO_TIMER1_COUNTS(250));
+
+static uint8_t _suspended = 0;
+
+static void _watchdog_service(void) {
+    wdt_reset();
+}
+
+void pw_setup(void) {
+    wdt_reset();
+    wdt_enable(WDTO_1S);
+    st_start(&_watchdog_timer, _watchdog_timer.period);
+}
+
+// Interrupt every 120 ms, without resetting.  wdt_enable can only set
+// reset mode, so this is the same timed sequence by hand.
+static void _watchdog_interrupt_mode(void) {
+    uint8_t intr_state = SREG;
+    cli();
+    wdt_reset();
+    WDTCSR = _BV(WDCE) | _BV(WDE);
+    WDTCSR = _BV(WDIE) | WDTO_120MS;
+    SREG = intr_state;
+}
+
+void pw_usb_state(event_usb_state_t state) {
+    if (state.suspended == _suspended) {
+        return;
+    }
+    _suspended = state.suspended;
+
+    if (_suspended) {
+        st_stop(&_watchdog_timer);
+        _watchdog_interrupt_mode();
+    } else {
+        pw_setup();
+    }
+}
+
+uint8_t pw_sleep_mode(void) {
+    // Power-down stops the I/O clock, and with it timer1 and the edge
+    // detection on INT7:4, so only once nothing's in progress.  The
+    // quadrature inputs (INT3:0), the watchdog and USB resume detection
+    // still wake us.
+    if (usb_suspended() && !kb_busy() && st_idle()) {
+        return SLEEP_MODE_PWR_DOWN;
+    }
+    return SLEEP_MODE_IDLE;
+}
+
+ISR(WDT_vect) {
+    event_set_pending(EVENT_PENDING_WATCHDOG);
+}
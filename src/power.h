@@ -0,0 +1,23 @@
+#ifndef POWER_H_
+#define POWER_H_
+
+#include <stdint.h>
+
+#include "events.h"
+
+// The watchdog, and how deeply the main loop may sleep.
+//
+// Normally the watchdog resets the chip unless a software timer keeps
+// resetting it.  While the host has the bus suspended it's switched to
+// interrupt-only mode instead, as a 120 ms wakeup for
+// event_suspended_poll; once the keyboard is parked and no timers are
+// running, the main loop can then power down completely.
+
+void pw_setup(void);
+void pw_usb_state(event_usb_state_t state);
+
+// The sleep mode for the main loop to use next.  Call with interrupts
+// disabled, just before sleeping.
+uint8_t pw_sleep_mode(void);
+
+#endif
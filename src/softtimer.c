@@ -0,0 +1,198 @@
+#include "softtimer.h"
+#include "timevalues.h"
+#include "events.h"
+#include "trace.h"
+
+#include <stdint.h>
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#ifndef NULL
+#define NULL ((void *)0)
+#endif
+
+#define FLAG_RUNNING 0x01 // in _running
+#define FLAG_EXPIRED 0x02 // in _expired
+
+// Sorted by deadline.  The first timer's delta is counted from _base.
+static st_timer_t *_running;
+static uint16_t _base;
+
+// Waiting for st_dispatch, oldest first.
+static st_timer_t *_expired, *_expired_tail;
+
+// All of the following are called with interrupts disabled.
+
+// Insert a timer to expire at counts after _base.
+static void _insert(st_timer_t *timer, uint16_t counts) {
+    st_timer_t **link = &_running;
+
+    // timers due at the same time expire in the order they were started
+    while (*link && (*link)->delta <= counts) {
+        counts -= (*link)->delta;
+        link = &(*link)->next;
+    }
+    if (*link) {
+        (*link)->delta -= counts;
+    }
+    timer->delta = counts;
+    timer->next = *link;
+    *link = timer;
+    timer->flags |= FLAG_RUNNING;
+}
+
+static void _unlink(st_timer_t *timer) {
+    st_timer_t **link = &_running;
+
+    while (*link != timer) {
+        link = &(*link)->next;
+    }
+    if (timer->next) {
+        timer->next->delta += timer->delta;
+    }
+    *link = timer->next;
+    timer->flags &= ~FLAG_RUNNING;
+}
+
+static void _unlink_expired(st_timer_t *timer) {
+    st_timer_t **link = &_expired;
+    st_timer_t *previous = NULL;
+
+    while (*link != timer) {
+        previous = *link;
+        link = &(*link)->next_expired;
+    }
+    *link = timer->next_expired;
+    if (_expired_tail == timer) {
+        _expired_tail = previous;
+    }
+    timer->flags &= ~FLAG_EXPIRED;
+}
+
+// Take the first timer off the list, because its deadline has passed.
+static void _expire_first(void) {
+    st_timer_t *timer = _running;
+
+    _running = timer->next;
+    timer->flags &= ~FLAG_RUNNING;
+    _base += timer->delta;
+
+    // a periodic timer's next deadline is counted from the one just
+    // passed, not from when we got round to it, so it doesn't drift
+    if (timer->period) {
+        _insert(timer, timer->period);
+    }
+
+    if (!(timer->flags & FLAG_EXPIRED)) {
+        timer->next_expired = NULL;
+        if (_expired_tail) {
+            _expired_tail->next_expired = timer;
+        } else {
+            _expired = timer;
+        }
+        _expired_tail = timer;
+        timer->flags |= FLAG_EXPIRED;
+    }
+    event_set_pending(EVENT_PENDING_TIMERS);
+}
+
+// Point compare A at the first deadline.  A deadline that has already
+// passed wouldn't match until timer1 wrapped, so expire those here.
+static void _schedule(void) {
+    while (_running) {
+        OCR1A = _base + _running->delta;
+        TIFR1 = _BV(OCF1A);
+        if ((uint16_t)(timer1_read() - _base) < _running->delta) {
+            TIMSK1 |= _BV(OCIE1A);
+            return;
+        }
+        _expire_first();
+    }
+    TIMSK1 &= ~_BV(OCIE1A);
+}
+
+void st_start(st_timer_t *timer, uint16_t counts) {
+    if (counts > ST_MAX_COUNTS) {
+        counts = ST_MAX_COUNTS;
+    }
+
+    uint8_t intr_state = SREG;
+    cli();
+
+    if (timer->flags & FLAG_RUNNING) {
+        _unlink(timer);
+    }
+
+    // Count the new deadline from now.  If the first deadline has
+    // already passed, the ISR is about to run; leave _base for it and
+    // count from there instead.
+    uint16_t now = timer1_read();
+    if (!_running) {
+        _base = now;
+    } else {
+        uint16_t elapsed = now - _base;
+        if (elapsed < _running->delta) {
+            _running->delta -= elapsed;
+            _base = now;
+        } else {
+            counts += elapsed;
+        }
+    }
+
+    _insert(timer, counts);
+    _schedule();
+
+    SREG = intr_state;
+}
+
+void st_stop(st_timer_t *timer) {
+    uint8_t intr_state = SREG;
+    cli();
+
+    if (timer->flags & FLAG_RUNNING) {
+        uint8_t first = (_running == timer);
+        _unlink(timer);
+        if (first) {
+            _schedule();
+        }
+    }
+    if (timer->flags & FLAG_EXPIRED) {
+        _unlink_expired(timer);
+    }
+
+    SREG = intr_state;
+}
+
+uint8_t st_running(st_timer_t const *timer) {
+    return (timer->flags & FLAG_RUNNING) ? 1 : 0;
+}
+
+uint8_t st_idle(void) {
+    return _running == NULL;
+}
+
+void st_dispatch(void) {
+    for (;;) {
+        uint8_t intr_state = SREG;
+        cli();
+        st_timer_t *timer = _expired;
+        if (timer) {
+            _unlink_expired(timer);
+        }
+        SREG = intr_state;
+
+        if (!timer) {
+            return;
+        }
+        if (timer->expired) {
+            timer->expired();
+        }
+    }
+}
+
+ISR(TIMER1_COMPA_vect) {
+    TRACE_ISR(TRACE_ISR_SOFTTIMER);
+
+    _schedule();
+}
@@ -0,0 +1,50 @@
+#ifndef SOFTTIMER_H_
+#define SOFTTIMER_H_
+
+#include <stdint.h>
+
+// Software timers on timer1, at its resolution of one count (64 us; see
+// timevalues.h).  Running timers are kept in a list sorted by deadline,
+// each storing only the counts after the one before it, and compare A
+// interrupts at the first deadline.  (kbcomm has compare B to itself.)
+//
+// The ISR only moves due timers onto an expired queue and sets
+// EVENT_PENDING_TIMERS; their callbacks are run from the main loop by
+// st_dispatch, so they can do anything a tick handler could.
+
+// Longest delay or period, in timer1 counts (about 2 s).  Keeping well
+// inside the 16-bit wrap means deadlines can be compared by subtraction.
+#define ST_MAX_COUNTS 0x7FFF
+
+typedef struct st_timer {
+    void (*expired)(void);      // called from st_dispatch
+    uint16_t period;            // counts between expiries, or 0 for a one-shot
+
+    // private
+    struct st_timer *next;      // in the running list
+    struct st_timer *next_expired;
+    uint16_t delta;             // counts after the previous running timer's deadline
+    uint8_t flags;
+} st_timer_t;
+
+// Initialiser for a static st_timer_t.
+#define ST_TIMER(expired, period) { (expired), (period), 0, 0, 0, 0 }
+
+// (Re)start a timer so that it first expires counts from now.  Any
+// expiry that hasn't been dispatched yet still is.  May be called from
+// ISRs.
+void st_start(st_timer_t *timer, uint16_t counts);
+
+// Stop a timer, and forget an expiry that hasn't been dispatched yet.
+// May be called from ISRs.
+void st_stop(st_timer_t *timer);
+
+uint8_t st_running(st_timer_t const *timer);
+
+// Non-zero if no timers are running at all.
+uint8_t st_idle(void);
+
+// Call when EVENT_PENDING_TIMERS is set.
+void st_dispatch(void);
+
+#endif
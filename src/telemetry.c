@@ -0,0 +1,233 @@
+#include "telemetry.h"
+#include "timevalues.h"
+#include "kbcomm.h"
+#include "usb_keyboard.h"
+#include "trace.h"
+#include "softtimer.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+volatile uint16_t tm_counters[TM_COUNTER_COUNT];
+
+// fails to compile if a record doesn't fit in one report
+typedef char _counters_record_fits[(sizeof(tm_counters_record_t) <= USB_RAWHID_REPORT_SIZE) ? 1 : -1];
+typedef char _histogram_record_fits[(sizeof(tm_histogram_record_t) <= USB_RAWHID_REPORT_SIZE) ? 1 : -1];
+typedef char _isr_cycles_record_fits[(sizeof(tm_isr_cycles_record_t) <= USB_RAWHID_REPORT_SIZE) ? 1 : -1];
+typedef char _trace_record_fits[(sizeof(tm_trace_record_t) <= USB_RAWHID_REPORT_SIZE) ? 1 : -1];
+
+static uint8_t _last_unknown_scancode;
+static uint16_t _last_recovery_ms;
+static uint8_t _host_leds;
+static event_usb_state_t _usb_state;
+static uint16_t _configured_ms;
+static uint32_t _idle_counts;
+static uint8_t _sequence;
+
+static void _record_due(void);
+static void _poll(void);
+
+// counters (and the rest) are sent about once a second
+static st_timer_t _record_timer = ST_TIMER(_record_due, TV_MILLIS_TO_TIMER1_COUNTS(1000));
+
+// While there's something to send, offer it as often as the host polls
+// the interface.
+static st_timer_t _poll_timer = ST_TIMER(_poll, TV_MILLIS_TO_TIMER1_COUNTS(8));
+
+// Records due to be sent, once the host has taken the previous one: the
+// counters, the ISR times, then one bit per histogram.
+#define PENDING_COUNTERS 0x01
+#define PENDING_ISR_CYCLES 0x02
+#define PENDING_HISTOGRAM(histogram) (0x04 << (histogram))
+static uint8_t _pending;
+
+static uint16_t _clamp16(uint32_t value) {
+    return (value > UINT16_MAX) ? UINT16_MAX : value;
+}
+
+void tm_setup(void) {
+    st_start(&_record_timer, _record_timer.period);
+#ifdef TRACE
+    st_start(&_poll_timer, _poll_timer.period);
+#endif
+}
+
+void tm_unknown_scancode(uint8_t data) {
+    TM_COUNT(TM_COUNTER_UNKNOWN_SCANCODES);
+    _last_unknown_scancode = data;
+}
+
+void tm_link_recovered(uint16_t ms) {
+    _last_recovery_ms = ms;
+}
+
+void tm_usb_state(event_usb_state_t state) {
+    if (state.configured && !_usb_state.configured) {
+        TM_COUNT(TM_COUNTER_USB_CONFIGURED);
+        if (!_configured_ms) {
+            _configured_ms = _clamp16(timer1_read_ms());
+        }
+    }
+
+    if (state.suspended && !_usb_state.suspended) {
+        // nothing can be sent, so don't wake up to try
+        TM_COUNT(TM_COUNTER_USB_SUSPENDS);
+        st_stop(&_record_timer);
+        st_stop(&_poll_timer);
+    } else if (!state.suspended && _usb_state.suspended) {
+        tm_setup();
+    }
+
+    _usb_state = state;
+}
+
+void tm_host_leds(event_host_leds_t leds) {
+    _host_leds = leds.leds;
+}
+
+void tm_idle(uint16_t wakeups, uint16_t counts) {
+    TM_ADD(TM_COUNTER_WAKEUPS, wakeups);
+    _idle_counts += counts;
+}
+
+static void _copy_tx_stats(tm_tx_stats_t *dest, volatile usb_tx_stats_t *src) {
+    dest->drops = src->drops;
+    dest->overruns = src->overruns;
+}
+
+static void _send_counters(void) {
+    uint8_t report[USB_RAWHID_REPORT_SIZE];
+    tm_counters_record_t *record = (tm_counters_record_t *)report;
+
+    memset(report, 0, sizeof(report));
+    record->type = TM_RECORD_COUNTERS;
+    record->sequence = _sequence++;
+    record->timestamp = timer1_read32();
+    record->kb_turnaround_us = _clamp16(kb_turnaround_us());
+    record->kb_max_turnaround_us = _clamp16(kb_max_turnaround_us());
+    record->keyboard_latency_us = _clamp16(TV_TIMER1_COUNTS_TO_MICROS(usb_keyboard_report_latency()));
+#ifdef KB_ISR_INQUIRY_LOOP
+    record->scancode_stalls = kb_scancode_stalls();
+#endif
+    record->last_unknown_scancode = _last_unknown_scancode;
+    record->last_recovery_ms = _last_recovery_ms;
+    record->host_leds = _host_leds;
+    record->idle_counts = _idle_counts;
+    record->configured_ms = _configured_ms;
+    uint32_t first_key = usb_keyboard_first_key_time();
+    if (first_key) {
+        record->first_key_ms = _clamp16(TV_TIMER1_COUNTS_TO_MILLIS(first_key));
+    }
+
+    // The USB interrupts update these, so take them all at once.
+    uint8_t intr_state = SREG;
+    cli();
+    _copy_tx_stats(&record->tx[0], &usb_keyboard_tx_stats);
+    _copy_tx_stats(&record->tx[1], &usb_media_tx_stats);
+    _copy_tx_stats(&record->tx[2], &usb_mouse_tx_stats);
+    _copy_tx_stats(&record->tx[3], &usb_rawhid_tx_stats);
+    for (uint8_t i = 0; i < TM_COUNTER_COUNT; i++) {
+        record->counters[i] = tm_counters[i];
+    }
+    SREG = intr_state;
+
+    usb_rawhid_send(report);
+}
+
+#ifdef TRACE
+static void _send_histogram(trace_histogram_t histogram) {
+    uint8_t report[USB_RAWHID_REPORT_SIZE];
+    tm_histogram_record_t *record = (tm_histogram_record_t *)report;
+
+    memset(report, 0, sizeof(report));
+    record->type = TM_RECORD_HISTOGRAM;
+    record->histogram = histogram;
+    uint16_t buckets[TRACE_HISTOGRAM_BUCKETS];
+    trace_copy_histogram(histogram, buckets);
+    memcpy(record->buckets, buckets, sizeof(buckets));
+
+    usb_rawhid_send(report);
+}
+
+static void _send_isr_cycles(void) {
+    uint8_t report[USB_RAWHID_REPORT_SIZE];
+    tm_isr_cycles_record_t *record = (tm_isr_cycles_record_t *)report;
+
+    memset(report, 0, sizeof(report));
+    record->type = TM_RECORD_ISR_CYCLES;
+    uint16_t max_cycles[TRACE_ISR_COUNT];
+    trace_copy_isr_cycles(max_cycles);
+    memcpy(record->max_cycles, max_cycles, sizeof(max_cycles));
+
+    usb_rawhid_send(report);
+}
+
+static void _send_trace(void) {
+    uint8_t report[USB_RAWHID_REPORT_SIZE];
+    tm_trace_record_t *record = (tm_trace_record_t *)report;
+
+    memset(report, 0, sizeof(report));
+    record->type = TM_RECORD_TRACE;
+    record->count = trace_read(record->records, TM_TRACE_RECORDS);
+    record->lost = trace_lost();
+
+    if (record->count) {
+        usb_rawhid_send(report);
+    }
+}
+#endif
+
+static void _record_due(void) {
+    _pending = PENDING_COUNTERS;
+#ifdef TRACE
+    _pending |= PENDING_ISR_CYCLES;
+    for (uint8_t i = 0; i < TRACE_HISTOGRAM_COUNT; i++) {
+        _pending |= PENDING_HISTOGRAM(i);
+    }
+#endif
+    if (!st_running(&_poll_timer)) {
+        st_start(&_poll_timer, 0);
+    }
+}
+
+static void _send_next(void) {
+    if (_pending & PENDING_COUNTERS) {
+        _pending &= ~PENDING_COUNTERS;
+        _send_counters();
+        return;
+    }
+#ifdef TRACE
+    if (_pending & PENDING_ISR_CYCLES) {
+        _pending &= ~PENDING_ISR_CYCLES;
+        _send_isr_cycles();
+        return;
+    }
+    for (uint8_t i = 0; i < TRACE_HISTOGRAM_COUNT; i++) {
+        if (_pending & PENDING_HISTOGRAM(i)) {
+            _pending &= ~PENDING_HISTOGRAM(i);
+            _send_histogram(i);
+            return;
+        }
+    }
+    _send_trace();
+#endif
+}
+
+static void _poll(void) {
+    // one record per poll from the host; nothing is lost while nobody
+    // is reading
+    if (usb_rawhid_ready()) {
+        _send_next();
+    }
+
+#ifndef TRACE
+    // Without trace records to stream, stop once everything has gone, or
+    // if nobody is reading; the next record starts polling again.
+    if (!_pending || !usb_rawhid_ready()) {
+        st_stop(&_poll_timer);
+    }
+#endif
+}
@@ -0,0 +1,107 @@
+#ifndef TELEMETRY_H_
+#define TELEMETRY_H_
+
+#include <stdint.h>
+
+#include "trace.h"
+#include "events.h"
+
+// Telemetry goes out on the raw HID interface (see usb_rawhid_send), one
+// record per report, so we can watch a unit without it typing anything.
+// tools/hidtelemetry.c reads it on Linux, and includes this header, so
+// the records here are packed and little-endian like the AVR.
+
+// Counters that other modules bump with TM_COUNT.  Each counter must be
+// bumped either only from ISRs or only from the main loop, since the
+// increment isn't atomic.
+typedef enum {
+    TM_COUNTER_QUADRATURE_ERRORS = 0, // mouse edges where both phases changed
+    TM_COUNTER_UNKNOWN_SCANCODES,     // scancodes that aren't in any keymap
+    TM_COUNTER_KEY_TRANSITIONS,       // key transitions kbglue has processed
+    TM_COUNTER_LINK_RESETS,           // times the keyboard stopped answering
+    TM_COUNTER_KEYS_RELEASED,         // keys that were down when that happened
+    TM_COUNTER_MOUSE_EDGES,           // quadrature edges decoded into counts
+    TM_COUNTER_MOUSE_REPORTS,         // mouse reports with motion sent to the host
+    TM_COUNTER_USB_CONFIGURED,        // times the host configured the device
+    TM_COUNTER_WAKEUPS,               // times the CPU woke from sleep
+    TM_COUNTER_USB_SUSPENDS,          // times the host suspended the bus
+    TM_COUNTER_KB_GLITCHES,           // keyboard bytes given up on for noise on the clock
+
+    TM_COUNTER_COUNT
+} tm_counter_t;
+
+extern volatile uint16_t tm_counters[TM_COUNTER_COUNT];
+
+#define TM_COUNT(counter) (tm_counters[counter]++)
+#define TM_ADD(counter, n) (tm_counters[counter] += (n))
+
+// Record types, in the first byte of every report.
+#define TM_RECORD_COUNTERS 0x01
+#define TM_RECORD_HISTOGRAM 0x02
+#define TM_RECORD_TRACE 0x03
+#define TM_RECORD_ISR_CYCLES 0x04
+
+typedef struct {
+    uint8_t drops;
+    uint8_t overruns;
+} __attribute__((packed)) tm_tx_stats_t;
+
+// Sent about once a second.
+typedef struct {
+    uint8_t type;                   // TM_RECORD_COUNTERS
+    uint8_t sequence;               // goes up by one for every record sent
+    uint32_t timestamp;             // timer1_read32 when the record was built
+    uint16_t kb_turnaround_us;      // see kb_turnaround_us
+    uint16_t kb_max_turnaround_us;
+    uint16_t keyboard_latency_us;   // time the last keyboard report was queued
+    uint8_t scancode_stalls;        // see kb_scancode_stalls
+    uint8_t last_unknown_scancode;
+    uint16_t last_recovery_ms;      // from losing the keyboard to it answering again
+    uint8_t host_leds;              // keyboard LEDs, as last set by the host
+    uint32_t idle_counts;           // timer1 counts spent asleep, wrapping
+    uint16_t configured_ms;         // from power-up until the host first configured us
+    uint16_t first_key_ms;          // from power-up until the first key reached the host
+    tm_tx_stats_t tx[4];            // keyboard, media, mouse, telemetry
+    uint16_t counters[TM_COUNTER_COUNT];
+} __attribute__((packed)) tm_counters_record_t;
+
+// With TRACE defined, each histogram follows the counters.
+typedef struct {
+    uint8_t type;                   // TM_RECORD_HISTOGRAM
+    uint8_t histogram;              // trace_histogram_t
+    uint16_t buckets[TRACE_HISTOGRAM_BUCKETS];
+} __attribute__((packed)) tm_histogram_record_t;
+
+// With TRACE defined, the longest time spent in each ISR follows the
+// histograms.
+typedef struct {
+    uint8_t type;                   // TM_RECORD_ISR_CYCLES
+    uint16_t max_cycles[TRACE_ISR_COUNT]; // indexed by trace_isr_t
+} __attribute__((packed)) tm_isr_cycles_record_t;
+
+// With TRACE defined, trace records are sent whenever the interface is
+// otherwise idle.
+#define TM_TRACE_RECORDS 7
+
+typedef struct {
+    uint8_t type;                   // TM_RECORD_TRACE
+    uint8_t count;                  // records that follow
+    uint8_t lost;                   // overwritten before they could be sent
+    trace_record_t records[TM_TRACE_RECORDS];
+} __attribute__((packed)) tm_trace_record_t;
+
+void tm_setup(void);
+void tm_usb_state(event_usb_state_t state);
+void tm_host_leds(event_host_leds_t leds);
+
+// Count a scancode that kbglue couldn't translate, and remember it.
+void tm_unknown_scancode(uint8_t data);
+
+// The keyboard answered again, ms after it stopped.
+void tm_link_recovered(uint16_t ms);
+
+// The main loop slept for counts timer1 counts, waking wakeups times
+// before anything needed it.
+void tm_idle(uint16_t wakeups, uint16_t counts);
+
+#endif
@@ -2,26 +2,46 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 
-// Timer 0 clock select (prescaling; controls TCCR0B[2:0] aka
-// CS0[2:0]).
-//
-// This controls how fast the system ticks.  We need to debounce
-// before registering a keypress, so this should be reasonably fast in
-// order to feel responsive.  See also DebounceTickLimit, which should
-// be decreased if you increase the tick frequency.
-//
-//   0x05; // clkIO/1024 -> 61 Hz
-//   0x04; // clkIO/256 -> 244.14 Hz
-//   0x03; // clkIO/64 -> 976.6 Hz
-uint8_t const TVTimer0Overflow = 0x04;
-uint16_t const TVMillisPerTickTimer0 = 4; // 1000 * 1 / 244.14 Hz
-
-
-uint16_t const TVMillisPerTickTimer1 = 1;
+// There's no timer0 tick any more; everything that used to count ticks
+// uses a software timer on timer1 (see softtimer.h).
+
+// high half of timer1_read32
+static volatile uint16_t _timer1_overflows;
 
 void timer1_setup(void) {
     TCCR1B = 0x05; // clkIO/1024 -> 15625 Hz
 
     TCNT1 = 0;
+    _timer1_overflows = 0;
+    TIFR1 = _BV(TOV1);
+    TIMSK1 |= _BV(TOIE1);
+}
+
+uint32_t timer1_read32(void) {
+    uint8_t intr_state = SREG;
+    cli();
+
+    uint16_t count = TCNT1;
+    uint16_t overflows = _timer1_overflows;
+    // If timer1 overflowed since interrupts were disabled, the ISR hasn't
+    // counted it yet.  A low count means the overflow came before we read
+    // it; a high one means it came after.
+    if ((TIFR1 & _BV(TOV1)) && count < 0x8000) {
+        overflows++;
+    }
+
+    SREG = intr_state;
+
+    return ((uint32_t)overflows << 16) | count;
+}
+
+ISR(TIMER1_OVF_vect) {
+    _timer1_overflows++;
+}
+
+void timer3_setup(void) {
+    TCCR3A = 0x00;
+    TCCR3B = 0x01; // clkIO/1
+    TCNT3 = 0;
 }
 
@@ -3,22 +3,37 @@
 
 #include "stdint.h"
 
-extern uint8_t const TVTimer0Overflow;
+// timer1 counts at clkIO/1024 (see timer1_setup), so each count is 64
+// microseconds.  These are macros so that conversions of constant
+// values happen at compile time.
+#define TV_MICROS_PER_COUNT_TIMER1 64
+#define TV_MICROS_TO_TIMER1_COUNTS(us) (((us) + TV_MICROS_PER_COUNT_TIMER1 - 1) / TV_MICROS_PER_COUNT_TIMER1)
+#define TV_MILLIS_TO_TIMER1_COUNTS(ms) TV_MICROS_TO_TIMER1_COUNTS((ms) * 1000UL)
+#define TV_TIMER1_COUNTS_TO_MICROS(counts) ((uint32_t)(counts) * TV_MICROS_PER_COUNT_TIMER1)
+// 64 / 1000 is 8 / 125; split so that no 32-bit count can overflow
+#define TV_TIMER1_COUNTS_TO_MILLIS(counts) \
+    ((uint32_t)(counts) / 125 * 8 + (uint32_t)(counts) % 125 * 8 / 125)
 
-// TODO: These two very similarly-named variables have different semantics.  Please fix them.
 
+void timer1_setup(void);
 
-// TVMillisPerTickTimer0 is the approximate number of milliseconds per OVERFLOW (ie. interrupt fired) on timer0.
-extern uint16_t const TVMillisPerTickTimer0;
+// The 16-bit count, which wraps about every 4.2 s: fine for timing
+// anything shorter.
+#define timer1_read() (TCNT1)
 
-// TVMillisPerTickTimer1 is the approximate number of milliseconds per OVERFLOW on timer1.
-extern uint16_t const TVMillisPerTickTimer1;
+// The count extended to 32 bits by counting overflows, so it only wraps
+// after about 76 hours.  Safe to call from ISRs.
+uint32_t timer1_read32(void);
+#define timer1_read_ms() TV_TIMER1_COUNTS_TO_MILLIS(timer1_read32())
 
+// timer3 counts every CPU cycle, with no interrupts, for timing things
+// too short for timer1 to see: the gaps between the keyboard's clock
+// edges, and in TRACE builds the time spent in each ISR.  It wraps
+// every 4 ms, so only time things shorter than that.
+#define TV_MICROS_TO_TIMER3_CYCLES(us) ((us) * (F_CPU / 1000000UL))
 
+void timer3_setup(void);
 
-void timer1_setup(void);
-
-#define timer1_read() (TCNT1)
-#define timer1_read_ms() (timer1_read() * TVMillisPerTickTimer1)
+#define timer3_read() (TCNT3)
 
 #endif
@@ -0,0 +1,118 @@
+#include "trace.h"
+
+#ifdef TRACE
+
+#include "timevalues.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+// Must be a power of two.  When it's full the oldest records are
+// overwritten, since the latest ones are usually the interesting ones.
+#define TRACE_BUFFER_SIZE 32
+
+static trace_record_t _records[TRACE_BUFFER_SIZE];
+static uint8_t _head;
+static uint8_t _tail;
+static uint8_t _lost;
+
+static uint16_t _histograms[TRACE_HISTOGRAM_COUNT][TRACE_HISTOGRAM_BUCKETS];
+static uint16_t _latency_started_at[TRACE_HISTOGRAM_COUNT];
+static uint8_t _latency_started;
+
+static uint16_t _isr_max_cycles[TRACE_ISR_COUNT];
+
+void trace_event(trace_event_t event, uint8_t payload) {
+    uint8_t intr_state = SREG;
+    cli();
+    trace_record_t *record = &_records[_head];
+    record->timestamp = timer1_read();
+    record->event = event;
+    record->payload = payload;
+    _head = (_head + 1) & (TRACE_BUFFER_SIZE - 1);
+    if (_head == _tail) {
+        _tail = (_tail + 1) & (TRACE_BUFFER_SIZE - 1);
+        if (_lost < UINT8_MAX) {
+            _lost++;
+        }
+    }
+    SREG = intr_state;
+}
+
+// Only the first start counts until the matching end, so the latency is
+// from the oldest input that hasn't been reported yet.
+void trace_latency_start(trace_histogram_t histogram) {
+    uint8_t intr_state = SREG;
+    cli();
+    if (!(_latency_started & _BV(histogram))) {
+        _latency_started |= _BV(histogram);
+        _latency_started_at[histogram] = timer1_read();
+    }
+    SREG = intr_state;
+}
+
+void trace_latency_end(trace_histogram_t histogram) {
+    uint8_t intr_state = SREG;
+    cli();
+    if (_latency_started & _BV(histogram)) {
+        _latency_started &= ~_BV(histogram);
+
+        uint16_t latency = timer1_read() - _latency_started_at[histogram];
+        uint8_t bucket = 0;
+        while (latency && bucket < TRACE_HISTOGRAM_BUCKETS - 1) {
+            latency >>= 1;
+            bucket++;
+        }
+
+        uint16_t *count = &_histograms[histogram][bucket];
+        if (*count < UINT16_MAX) {
+            (*count)++;
+        }
+    }
+    SREG = intr_state;
+}
+
+// Called with interrupts disabled, at the end of the ISR being timed.
+void trace_isr_end(trace_isr_timer_t *timer) {
+    uint16_t cycles = timer3_read() - timer->start;
+    if (cycles > _isr_max_cycles[timer->isr]) {
+        _isr_max_cycles[timer->isr] = cycles;
+    }
+}
+
+uint8_t trace_read(trace_record_t *records, uint8_t max) {
+    uint8_t count = 0;
+
+    uint8_t intr_state = SREG;
+    cli();
+    while (count < max && _tail != _head) {
+        records[count++] = _records[_tail];
+        _tail = (_tail + 1) & (TRACE_BUFFER_SIZE - 1);
+    }
+    SREG = intr_state;
+
+    return count;
+}
+
+uint8_t trace_lost(void) {
+    return _lost;
+}
+
+void trace_copy_histogram(trace_histogram_t histogram, uint16_t *buckets) {
+    uint8_t intr_state = SREG;
+    cli();
+    memcpy(buckets, _histograms[histogram], sizeof(_histograms[histogram]));
+    SREG = intr_state;
+}
+
+void trace_copy_isr_cycles(uint16_t *max_cycles) {
+    uint8_t intr_state = SREG;
+    cli();
+    memcpy(max_cycles, _isr_max_cycles, sizeof(_isr_max_cycles));
+    SREG = intr_state;
+}
+
+#endif
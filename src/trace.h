@@ -0,0 +1,97 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+
+// Uncomment to record a trace of what the keyboard and mouse paths are
+// doing, histograms of how long input takes to reach the host, and the
+// longest time spent in each ISR.  All are sent out as telemetry.  This
+// costs about 200 bytes of RAM and a little time in every hooked ISR, so
+// it's off by default.  ISRs are timed with timer3 (see timevalues.h).
+// #define TRACE
+
+typedef enum {
+    TRACE_KB_SENT = 1,      // M0110 command byte sent; payload unused
+    TRACE_KB_RECEIVED,      // M0110 reply byte received; payload is the byte
+    TRACE_KB_POSTISR,       // kb_postisr handed a reply to kbglue; payload is the byte
+    TRACE_KEY_PROCESSED,    // kbglue applied a transition; payload is the byte
+    TRACE_KEYBOARD_QUEUED,  // usb_keyboard_send queued a report
+    TRACE_KEYBOARD_SENT,    // keyboard report written for the host
+    TRACE_QUADRATURE,       // quadrature edge; payload is the axis (0 = X)
+    TRACE_MOUSE_QUEUED,     // usb_mouse_send accumulated motion
+    TRACE_MOUSE_SENT,       // mouse report written for the host
+} trace_event_t;
+
+typedef struct {
+    uint16_t timestamp;     // timer1 count
+    uint8_t event;          // trace_event_t
+    uint8_t payload;
+} __attribute__((packed)) trace_record_t;
+
+// Latency histograms.  Bucket 0 counts latencies of 0 timer1 counts,
+// bucket n counts latencies of 2^(n-1) up to 2^n - 1 counts, and the last
+// bucket also takes everything longer.
+typedef enum {
+    TRACE_HISTOGRAM_KEY = 0,    // M0110 reply byte to keyboard report
+    TRACE_HISTOGRAM_MOTION,     // first quadrature edge to mouse report
+
+    TRACE_HISTOGRAM_COUNT
+} trace_histogram_t;
+
+#define TRACE_HISTOGRAM_BUCKETS 14
+
+// ISRs whose duration is measured, in CPU cycles from just after the
+// prologue to just before the epilogue.  No ISR can be interrupted, so
+// the longest of these is also the longest that INT7 (or any other
+// interrupt) can be kept waiting by another ISR.
+typedef enum {
+    TRACE_ISR_USB_GEN = 0,
+    TRACE_ISR_USB_COM,
+    TRACE_ISR_KEYBOARD,         // INT7
+    TRACE_ISR_TURNAROUND,       // TIMER1_COMPB
+    TRACE_ISR_QUADRATURE_X,     // INT0/INT1
+    TRACE_ISR_QUADRATURE_Y,     // INT2/INT3
+    TRACE_ISR_SOFTTIMER,        // TIMER1_COMPA
+
+    TRACE_ISR_COUNT
+} trace_isr_t;
+
+#ifdef TRACE
+
+// All of these may be called from ISRs.
+void trace_event(trace_event_t event, uint8_t payload);
+void trace_latency_start(trace_histogram_t histogram);
+void trace_latency_end(trace_histogram_t histogram);
+
+// For telemetry: take up to max records from the trace, oldest first,
+// returning how many were taken; and copy out a histogram.
+uint8_t trace_read(trace_record_t *records, uint8_t max);
+uint8_t trace_lost(void);
+void trace_copy_histogram(trace_histogram_t histogram, uint16_t *buckets);
+void trace_copy_isr_cycles(uint16_t *max_cycles);
+
+// Put TRACE_ISR first in an ISR to time it.  The cleanup attribute makes
+// the compiler call trace_isr_end on every way out of the ISR, early
+// returns included.
+typedef struct {
+    uint16_t start;
+    uint8_t isr;
+} trace_isr_timer_t;
+
+void trace_isr_end(trace_isr_timer_t *timer);
+
+#define TRACE_EVENT(event, payload) trace_event((event), (payload))
+#define TRACE_LATENCY_START(histogram) trace_latency_start(histogram)
+#define TRACE_LATENCY_END(histogram) trace_latency_end(histogram)
+#define TRACE_ISR(isr) trace_isr_timer_t _trace_isr_timer __attribute__((cleanup(trace_isr_end))) = { TCNT3, (isr) }
+
+#else
+
+#define TRACE_EVENT(event, payload)
+#define TRACE_LATENCY_START(histogram)
+#define TRACE_LATENCY_END(histogram)
+#define TRACE_ISR(isr)
+
+#endif
+
+#endif
@@ -27,7 +27,12 @@
 
 #define USB_SERIAL_PRIVATE_INCLUDE
 #include "usb_keyboard.h"
+#include "timevalues.h"
+#include "trace.h"
+#include "telemetry.h"
+#include "events.h"
 
+#include <stddef.h>
 #include <string.h>
  
 /**************************************************************************
@@ -57,6 +62,13 @@
 #define SUPPORT_ENDPOINT_HALT
 
 
+// Report every pressed key as a bitmap (N-key rollover) when the host
+// uses the report protocol.  Hosts that select the boot protocol (BIOS
+// setup screens and the like) still get the standard 8-byte report.
+// Comment this out to always send the boot report.
+#define KEYBOARD_NKRO
+
+
 
 /**************************************************************************
  *
@@ -67,7 +79,7 @@
 #define ENDPOINT0_SIZE          32
 
 #define FIRST_ENDPOINT 2
-#define LAST_ENDPOINT 4
+#define LAST_ENDPOINT 5
 
 #define KEYBOARD_INTERFACE      0
 #define MEDIA_INTERFACE         1
@@ -75,18 +87,45 @@
 #define MOUSE_ENDPOINT          2
 #define KEYBOARD_ENDPOINT       3
 #define MEDIA_ENDPOINT          4
-#define MOUSE_SIZE              4
+#define MOUSE_SIZE              8
 #define MOUSE_BUFFER            EP_DOUBLE_BUFFER
+#ifdef KEYBOARD_NKRO
+#define KEYBOARD_SIZE           32
+#else
 #define KEYBOARD_SIZE           8
+#endif
 #define KEYBOARD_BUFFER         EP_DOUBLE_BUFFER
 #define MEDIA_SIZE              8
 #define MEDIA_BUFFER            EP_DOUBLE_BUFFER
+#define RAWHID_INTERFACE        3
+#define RAWHID_ENDPOINT         5
+#define RAWHID_SIZE             USB_RAWHID_REPORT_SIZE
+#define RAWHID_BUFFER           EP_DOUBLE_BUFFER
+#define RAWHID_INTERVAL         8
+#define NUM_INTERFACES          4
+
+// Idle rates after reset, in 4 ms units (0 = only report changes).  These
+// are the defaults the HID spec recommends: 500 ms for the keyboard,
+// infinite for everything else.
+#define KEYBOARD_IDLE_DEFAULT   125
+#define MEDIA_IDLE_DEFAULT      0
+#define MOUSE_IDLE_DEFAULT      0
+#define RAWHID_IDLE_DEFAULT     0
+
+// Number of keyboard reports that can wait for the host to poll.
+// Must be a power of two.
+#define KEYBOARD_QUEUE_SIZE     8
+
+// The same for media reports, which come a press and a release at a
+// time: room for a few keystrokes.  Must be a power of two.
+#define MEDIA_QUEUE_SIZE        8
 
 static const uint8_t PROGMEM endpoint_config_table[] = {
     0,
     1, EP_TYPE_INTERRUPT_IN,  EP_SIZE(MOUSE_SIZE) | MOUSE_BUFFER,
     1, EP_TYPE_INTERRUPT_IN,  EP_SIZE(KEYBOARD_SIZE) | KEYBOARD_BUFFER,
     1, EP_TYPE_INTERRUPT_IN,  EP_SIZE(MEDIA_SIZE) | MEDIA_BUFFER,
+    1, EP_TYPE_INTERRUPT_IN,  EP_SIZE(RAWHID_SIZE) | RAWHID_BUFFER,
 };
 
 
@@ -120,6 +159,7 @@ static uint8_t const PROGMEM device_descriptor[] = {
     1                                       // bNumConfigurations
 };
 
+#ifndef KEYBOARD_NKRO
 // Keyboard Protocol 1, HID 1.11 spec, Appendix B, page 59-60
 static uint8_t const PROGMEM keyboard_hid_report_desc[] = {
     0x05, 0x01,          // Usage Page (Generic Desktop),
@@ -162,6 +202,50 @@ static uint8_t const PROGMEM keyboard_hid_report_desc[] = {
     0xc0                 // End Collection
 };
 
+#define KEYBOARD_REPORT_DESC keyboard_hid_report_desc
+#else
+// The report above, but with the key array replaced by one bit for
+// each of the first 128 usages.  Boot protocol hosts ignore this and
+// expect the 8-byte boot report, so that is what they're sent.
+static uint8_t const PROGMEM keyboard_nkro_hid_report_desc[] = {
+    0x05, 0x01,          // Usage Page (Generic Desktop),
+    0x09, 0x06,          // Usage (Keyboard),
+    0xA1, 0x01,          // Collection (Application),
+
+    0x75, 0x01,          //   Report Size (1),
+    0x95, 0x08,          //   Report Count (8),
+    0x05, 0x07,          //   Usage Page (Key Codes),
+    0x19, 0xE0,          //   Usage Minimum (224),
+    0x29, 0xE7,          //   Usage Maximum (231),
+    0x15, 0x00,          //   Logical Minimum (0),
+    0x25, 0x01,          //   Logical Maximum (1),
+    0x81, 0x02,          //   Input (Data, Variable, Absolute), ;Modifier byte
+
+    0x95, 0x05,          //   Report Count (5),
+    0x75, 0x01,          //   Report Size (1),
+    0x05, 0x08,          //   Usage Page (LEDs),
+    0x19, 0x01,          //   Usage Minimum (1),
+    0x29, 0x05,          //   Usage Maximum (5),
+    0x91, 0x02,          //   Output (Data, Variable, Absolute), ;LED report
+
+    0x95, 0x01,          //   Report Count (1),
+    0x75, 0x03,          //   Report Size (3),
+    0x91, 0x03,          //   Output (Constant),                 ;LED report padding
+
+    0x95, 0x80,          //   Report Count (128),
+    0x75, 0x01,          //   Report Size (1),
+    0x15, 0x00,          //   Logical Minimum (0),
+    0x25, 0x01,          //   Logical Maximum (1),
+    0x05, 0x07,          //   Usage Page (Key Codes),
+    0x19, 0x00,          //   Usage Minimum (0),
+    0x29, 0x7F,          //   Usage Maximum (127),
+    0x81, 0x02,          //   Input (Data, Variable, Absolute),  ;Key bitmap
+
+    0xc0                 // End Collection
+};
+#define KEYBOARD_REPORT_DESC keyboard_nkro_hid_report_desc
+#endif
+
 // Media keys: Modified version of above
 static uint8_t const PROGMEM media_hid_report_desc[] = {
     0x05, 0x0c,          // Usage Page (Generic Desktop),
@@ -180,6 +264,9 @@ static uint8_t const PROGMEM media_hid_report_desc[] = {
     0xc0                 // End Collection
 };
 
+// Report protocol mouse: 16-bit X and Y, wheel, and AC Pan.  Hosts that
+// select the boot protocol get the usual 8-bit boot report instead
+// (see send_mouse_data).
 static uint8_t const PROGMEM mouse_hid_report_desc[] = {
     0x05, 0x01,         // Usage Page (Generic Desktop)
     0x09, 0x02,         // Usage (Mouse)
@@ -198,32 +285,55 @@ static uint8_t const PROGMEM mouse_hid_report_desc[] = {
     0x05, 0x01,         //   Usage Page (Generic Desktop)
     0x09, 0x30,         //   Usage (X)
     0x09, 0x31,         //   Usage (Y)
+    0x16, 0x01, 0x80,   //   Logical Minimum (-32767)
+    0x26, 0xFF, 0x7F,   //   Logical Maximum (32767)
+    0x75, 0x10,         //   Report Size (16),
+    0x95, 0x02,         //   Report Count (2),
+    0x81, 0x06,         //   Input (Data, Variable, Relative)
+    0x09, 0x38,         //   Usage (Wheel)
     0x15, 0x81,         //   Logical Minimum (-127)
     0x25, 0x7F,         //   Logical Maximum (127)
     0x75, 0x08,         //   Report Size (8),
-    0x95, 0x02,         //   Report Count (2),
+    0x95, 0x01,         //   Report Count (1),
     0x81, 0x06,         //   Input (Data, Variable, Relative)
-    0x09, 0x38,         //   Usage (Wheel)
+    0x05, 0x0C,         //   Usage Page (Consumer)
+    0x0A, 0x38, 0x02,   //   Usage (AC Pan)
     0x95, 0x01,         //   Report Count (1),
     0x81, 0x06,         //   Input (Data, Variable, Relative)
     0xC0                // End Collection
 };
 
+// Raw HID: vendor-defined usage page, so the host's HID drivers leave it
+// alone and it shows up as a hidraw device.
+static uint8_t const PROGMEM rawhid_hid_report_desc[] = {
+    0x06, 0xAB, 0xFF,   // Usage Page (Vendor Defined 0xFFAB)
+    0x0A, 0x00, 0x02,   // Usage (0x0200)
+    0xA1, 0x01,         // Collection (Application)
+    0x75, 0x08,         //   Report Size (8)
+    0x15, 0x00,         //   Logical Minimum (0)
+    0x26, 0xFF, 0x00,   //   Logical Maximum (255)
+    0x95, RAWHID_SIZE,  //   Report Count
+    0x09, 0x01,         //   Usage (0x01)
+    0x81, 0x02,         //   Input (Data, Variable, Absolute)
+    0xC0                // End Collection
+};
+
 
-#define CONFIG1_DESC_SIZE        (9+ 9+9+7+ 9+9+7+ 9+9+7)
+#define CONFIG1_DESC_SIZE        (9+ 9+9+7+ 9+9+7+ 9+9+7+ 9+9+7)
 #define KEYBOARD_HID_DESC_OFFSET (9+9)
 #define MEDIA_HID_DESC_OFFSET    (9+9+9+7+9)
 #define MOUSE_HID_DESC_OFFSET    (9+9+9+7+9+9+7+9)
+#define RAWHID_HID_DESC_OFFSET   (9+9+9+7+9+9+7+9+9+7+9)
 static uint8_t const PROGMEM config1_descriptor[CONFIG1_DESC_SIZE] = {
     // configuration descriptor, USB spec 9.6.3, page 264-266, Table 9-10
     9,                                      // bLength;
     2,                                      // bDescriptorType;
     LSB(CONFIG1_DESC_SIZE),                 // wTotalLength
     MSB(CONFIG1_DESC_SIZE),
-    3,                                      // bNumInterfaces
+    4,                                      // bNumInterfaces
     1,                                      // bConfigurationValue
     0,                                      // iConfiguration
-    0xC0,                                   // bmAttributes
+    0xE0,                                   // bmAttributes (0x20=remote wakeup)
     50,                                     // bMaxPower
 
     // interface descriptor, USB spec 9.6.5, page 267-269, Table 9-12
@@ -243,7 +353,7 @@ static uint8_t const PROGMEM config1_descriptor[CONFIG1_DESC_SIZE] = {
     0,                                      // bCountryCode
     1,                                      // bNumDescriptors
     0x22,                                   // bDescriptorType
-    sizeof(keyboard_hid_report_desc),       // wDescriptorLength
+    sizeof(KEYBOARD_REPORT_DESC),           // wDescriptorLength
     0,
     // endpoint descriptor, USB spec 9.6.6, page 269-271, Table 9-13
     7,                                      // bLength
@@ -305,7 +415,34 @@ static uint8_t const PROGMEM config1_descriptor[CONFIG1_DESC_SIZE] = {
     MOUSE_ENDPOINT | 0x80,                  // bEndpointAddress
     0x03,                                   // bmAttributes (0x03=intr)
     MOUSE_SIZE, 0,                          // wMaxPacketSize
-    0x01                                    // bInterval
+    0x01,                                   // bInterval
+
+    // fourth (raw HID telemetry) interface descriptor
+    9,                                      // bLength
+    4,                                      // bDescriptorType
+    RAWHID_INTERFACE,                       // bInterfaceNumber
+    0,                                      // bAlternateSetting
+    1,                                      // bNumEndpoints
+    0x03,                                   // bInterfaceClass (0x03 = HID)
+    0x00,                                   // bInterfaceSubClass
+    0x00,                                   // bInterfaceProtocol
+    0,                                      // iInterface
+    // HID interface descriptor
+    9,                                      // bLength
+    0x21,                                   // bDescriptorType
+    0x11, 0x01,                             // bcdHID
+    0,                                      // bCountryCode
+    1,                                      // bNumDescriptors
+    0x22,                                   // bDescriptorType
+    sizeof(rawhid_hid_report_desc),         // wDescriptorLength
+    0,
+    // endpoint descriptor
+    7,                                      // bLength
+    5,                                      // bDescriptorType
+    RAWHID_ENDPOINT | 0x80,                 // bEndpointAddress
+    0x03,                                   // bmAttributes (0x03=intr)
+    RAWHID_SIZE, 0,                         // wMaxPacketSize
+    RAWHID_INTERVAL                         // bInterval
 };
 
 // If you're desperate for a little extra code memory, these strings
@@ -314,7 +451,7 @@ static uint8_t const PROGMEM config1_descriptor[CONFIG1_DESC_SIZE] = {
 struct usb_string_descriptor_struct {
     uint8_t bLength;
     uint8_t bDescriptorType;
-    int16_t wString[];
+    wchar_t wString[]; // 16 bits, from the L"" strings above
 };
 static struct usb_string_descriptor_struct const PROGMEM string0 = {
     4,
@@ -342,12 +479,14 @@ static struct descriptor_list_struct {
 } const PROGMEM descriptor_list[] = {
     {0x0100, 0x0000, device_descriptor, sizeof(device_descriptor)},
     {0x0200, 0x0000, config1_descriptor, sizeof(config1_descriptor)},
-    {0x2200, KEYBOARD_INTERFACE, keyboard_hid_report_desc, sizeof(keyboard_hid_report_desc)},
+    {0x2200, KEYBOARD_INTERFACE, KEYBOARD_REPORT_DESC, sizeof(KEYBOARD_REPORT_DESC)},
     {0x2100, KEYBOARD_INTERFACE, config1_descriptor+KEYBOARD_HID_DESC_OFFSET, 9},
     {0x2200, MEDIA_INTERFACE, media_hid_report_desc, sizeof(media_hid_report_desc)},
     {0x2101, MEDIA_INTERFACE, config1_descriptor+MEDIA_HID_DESC_OFFSET, 9},
     {0x2200, MOUSE_INTERFACE, mouse_hid_report_desc, sizeof(mouse_hid_report_desc)},
     {0x2102, MOUSE_INTERFACE, config1_descriptor+MOUSE_HID_DESC_OFFSET, 9},
+    {0x2200, RAWHID_INTERFACE, rawhid_hid_report_desc, sizeof(rawhid_hid_report_desc)},
+    {0x2103, RAWHID_INTERFACE, config1_descriptor+RAWHID_HID_DESC_OFFSET, 9},
     {0x0300, 0x0000, (const uint8_t *)&string0, 4},
     {0x0301, 0x0409, (const uint8_t *)&string1, sizeof(STR_MANUFACTURER)},
     {0x0302, 0x0409, (const uint8_t *)&string2, sizeof(STR_PRODUCT)}
@@ -364,41 +503,154 @@ static struct descriptor_list_struct {
 // zero when we are not configured, non-zero when enumerated
 static volatile uint8_t usb_configuration=0;
 
+// set the first time the host configures us, after which keyboard
+// reports are no longer held for it
+static volatile uint8_t usb_configured_once=0;
+
+// While suspended the PLL is off and the USB clock frozen, so nothing
+// may be queued until a remote wakeup has started them again.
+#define USB_AWAKE	0
+#define USB_SUSPENDED	1
+#define USB_WAKING	2	// remote wakeup sent; waiting for the host to resume
+static volatile uint8_t usb_suspend_state=USB_AWAKE;
+
+// set by the host with SET_FEATURE(DEVICE_REMOTE_WAKEUP)
+static volatile uint8_t usb_remote_wakeup_enabled=0;
+
+#define usb_can_send() (usb_configuration && usb_suspend_state != USB_SUSPENDED)
+
 // which modifier keys are currently pressed
 // 1=left ctrl,    2=left shift,   4=left alt,    8=left gui
 // 16=right ctrl, 32=right shift, 64=right alt, 128=right gui
 volatile uint8_t keyboard_modifier_keys=0;
 volatile uint8_t keyboard_modifier_keys_acked=0;
 
-// which keys are currently pressed, up to 6 keys may be down at once
-volatile uint8_t keyboard_keys[6] = {0, 0, 0, 0, 0, 0};
-volatile uint8_t keyboard_keys_acked[6] = {0, 0, 0, 0, 0, 0};
+// which keys are currently pressed, one bit per usage; the boot report
+// can only carry 6 of them
+volatile uint8_t keyboard_key_bits[KEYBOARD_KEY_BITS_SIZE];
+volatile uint8_t keyboard_key_bits_acked[KEYBOARD_KEY_BITS_SIZE];
+
+// Snapshots of the keyboard report, one per call to usb_keyboard_send(),
+// so that changes landing between two polls from the host are sent in
+// order rather than overwriting each other.  Only usb_keyboard_send()
+// writes at the head, and only the endpoint interrupt reads at the tail.
+struct keyboard_report_struct {
+    uint16_t timestamp;     // timer1 count when queued
+    uint8_t modifier_keys;
+    uint8_t key_bits[KEYBOARD_KEY_BITS_SIZE];
+};
+static struct keyboard_report_struct keyboard_queue[KEYBOARD_QUEUE_SIZE];
+static volatile uint8_t keyboard_queue_head=0;
+static volatile uint8_t keyboard_queue_tail=0;
+
+// the last report taken from the queue, which idle reports repeat
+static struct keyboard_report_struct keyboard_report_sent;
+
+// timer1 counts the last report spent in the queue
+static volatile uint16_t keyboard_report_latency=0;
+
+// timer1_read32 when the first report with a key down went out
+static volatile uint32_t keyboard_first_key_time=0;
 
 volatile uint16_t media_keys[4] = {0, 0, 0, 0};
-volatile uint8_t mouse_buttons = 0;
 
-// protocol setting from the host.  We use exactly the same report
-// either way, so this variable only stores the setting since we
-// are required to be able to report which setting is in use.
-static uint8_t keyboard_protocol=1;
+// Snapshots of media_keys, one per call to usb_media_send(), queued the
+// same way as the keyboard's.
+struct media_report_struct {
+    uint16_t keys[4];
+};
+static struct media_report_struct media_queue[MEDIA_QUEUE_SIZE];
+static volatile uint8_t media_queue_head=0;
+static volatile uint8_t media_queue_tail=0;
 
-// the idle configuration, how often we send the report to the
-// host (ms * 4) even when it hasn't changed
-static uint8_t keyboard_idle_config=125;
+// the last report taken from the queue, which idle reports repeat
+static struct media_report_struct media_report_sent;
+
+volatile uint8_t mouse_buttons = 0;
 
-// count until idle timeout
-static uint8_t keyboard_idle_count=0;
+// Nothing here waits for the host: the send functions only record what
+// to send and enable the endpoint's interrupt, and the report goes out
+// when the host polls.  Keyboard and media reports are queued; for the
+// others, or once a queue is full, a newer report replaces the one
+// waiting and the endpoint's overrun count goes up.  If the device isn't
+// configured the report is dropped.
+volatile usb_tx_stats_t usb_keyboard_tx_stats;
+volatile usb_tx_stats_t usb_media_tx_stats;
+volatile usb_tx_stats_t usb_mouse_tx_stats;
+volatile usb_tx_stats_t usb_rawhid_tx_stats;
+
+// the next raw HID report
+static uint8_t rawhid_tx_buffer[RAWHID_SIZE];
+
+// Mouse motion not yet reported.  usb_mouse_send() adds to it, and the
+// start of frame interrupt stages at most one report per frame, carrying
+// whatever doesn't fit in the report over to the next one.
+static volatile int16_t mouse_pending_x=0;
+static volatile int16_t mouse_pending_y=0;
+static volatile int16_t mouse_pending_wheel=0;
+static volatile int16_t mouse_pending_pan=0;
+static volatile uint8_t mouse_pending=0;
+
+// protocol setting from the host: 0 = boot, 1 = report.  With
+// KEYBOARD_NKRO the report protocol sends the key bitmap; otherwise we
+// use exactly the same report either way, and this variable only stores
+// the setting since we are required to be able to report which setting
+// is in use.
+static uint8_t keyboard_protocol=1;
 
 // 1=num lock, 2=caps lock, 4=scroll lock, 8=compose, 16=kana
 volatile uint8_t keyboard_leds=0;
 
 static uint8_t media_protocol=1;
-static uint8_t media_idle_config=125;
-static uint8_t media_idle_count=0;
 
+// 0 = boot, 1 = report (16-bit X/Y, wheel and pan)
 static uint8_t mouse_protocol=1;
-static uint8_t mouse_idle_config=125;
-static uint8_t mouse_idle_count=0;
+
+// The idle configuration, one entry per interface: how often we repeat
+// the last report to the host (ms * 4) even when it hasn't changed, and
+// the count of 4 ms ticks left until the next repeat.  Sending any report
+// restarts the count.
+static void send_key_idle(void);
+static void send_media_idle(void);
+static void send_mouse_idle(void);
+static void send_rawhid_data(void);
+
+struct idle_struct {
+    uint8_t endpoint;
+    uint8_t config;
+    uint8_t countdown;
+    void (*send)(void);
+};
+static struct idle_struct idle_table[NUM_INTERFACES] = {
+    {KEYBOARD_ENDPOINT, KEYBOARD_IDLE_DEFAULT, KEYBOARD_IDLE_DEFAULT, send_key_idle},
+    {MEDIA_ENDPOINT, MEDIA_IDLE_DEFAULT, MEDIA_IDLE_DEFAULT, send_media_idle},
+    {MOUSE_ENDPOINT, MOUSE_IDLE_DEFAULT, MOUSE_IDLE_DEFAULT, send_mouse_idle},
+    {RAWHID_ENDPOINT, RAWHID_IDLE_DEFAULT, RAWHID_IDLE_DEFAULT, send_rawhid_data},
+};
+
+static inline void idle_restart(uint8_t interface)
+{
+    idle_table[interface].countdown = idle_table[interface].config;
+}
+
+// The start of frame interrupt sends mouse motion and counts the idle
+// rates, and otherwise would only wake the CPU every millisecond for
+// nothing.  Enable it while there's motion waiting or any interface has
+// an idle rate, and the bus is up.  Call with interrupts disabled,
+// whenever one of those changes.
+static void usb_sof_update(void)
+{
+    uint8_t i, needed = mouse_pending;
+
+    for (i = 0; i < NUM_INTERFACES; i++) {
+        needed |= idle_table[i].config;
+    }
+    if (needed && usb_configuration && usb_suspend_state == USB_AWAKE) {
+        UDIEN |= (1<<SOFE);
+    } else {
+        UDIEN &= ~(1<<SOFE);
+    }
+}
 
 
 /**************************************************************************
@@ -418,7 +670,7 @@ void usb_init(void)
     USB_CONFIG();                               // start USB clock
     UDCON = 0;                          // enable attach resistor
     usb_configuration = 0;
-    UDIEN = (1<<EORSTE)|(1<<SOFE);
+    UDIEN = (1<<EORSTE)|(1<<SUSPE);
     sei();
 }
 
@@ -429,6 +681,42 @@ uint8_t usb_configured(void)
     return usb_configuration;
 }
 
+uint8_t usb_suspended(void)
+{
+    return usb_suspend_state == USB_SUSPENDED;
+}
+
+// stop the USB clock and the PLL; only resume detection keeps running
+static void usb_freeze(void)
+{
+    USB_FREEZE();
+    PLLCSR &= ~(1<<PLLE);
+}
+
+// start them again, as usb_init() does
+static void usb_thaw(void)
+{
+    PLL_CONFIG();
+    while (!(PLLCSR & (1<<PLOCK))) ;
+    USB_CONFIG();
+}
+
+int8_t usb_remote_wakeup(void)
+{
+    uint8_t intr_state = SREG;
+
+    cli();
+    if (usb_suspend_state != USB_SUSPENDED || !usb_remote_wakeup_enabled) {
+        SREG = intr_state;
+        return -1;
+    }
+    usb_thaw();
+    UDCON |= (1<<RMWKUP);
+    usb_suspend_state = USB_WAKING;
+    SREG = intr_state;
+    return 0;
+}
+
 
 // perform a single keystroke
 int8_t usb_keyboard_press(uint8_t key, uint8_t modifier)
@@ -436,11 +724,11 @@ int8_t usb_keyboard_press(uint8_t key, uint8_t modifier)
     int8_t r;
 
     keyboard_modifier_keys = modifier;
-    keyboard_keys[0] = key;
+    keyboard_key_press(key);
     r = usb_keyboard_send_now();
-    if (r) return r;
     keyboard_modifier_keys = 0;
-    keyboard_keys[0] = 0;
+    keyboard_key_release(key);
+    if (r) return r;
     return usb_keyboard_send_now();
 }
 
@@ -456,112 +744,201 @@ int8_t usb_media_press(uint16_t key)
     return usb_media_send_now();
 }
 
-static void send_key_data(void);
-static void send_media_key_data(void);
-static void send_mouse_data(int8_t delta_x, int8_t delta_y);
-
-// send the contents of keyboard_keys and keyboard_modifier_keys
-void usb_keyboard_send(void)
+static void snapshot_key_data(struct keyboard_report_struct *report);
+static void snapshot_media_keys(struct media_report_struct *report);
+static void send_media_key_data(const struct media_report_struct *report);
+static uint8_t report_has_keys(const struct keyboard_report_struct *report);
+static void send_key_data(const struct keyboard_report_struct *report);
+static void send_mouse_data(int16_t delta_x, int16_t delta_y, int8_t wheel, int8_t pan);
+static int16_t add_saturating(int16_t a, int16_t b);
+static int16_t clamp_mouse_delta(int16_t delta, int16_t limit);
+
+// enable the endpoint's interrupt, so that the next report goes out when
+// the host polls
+static void request_tx(uint8_t endpoint)
 {
-    UENUM = KEYBOARD_ENDPOINT;
+    uint8_t intr_state = SREG;
+
+    cli();
+    UENUM = endpoint;
     UEIENX |= (1 << TXINE);
+    SREG = intr_state;
 }
 
-void usb_media_send(void)
+// queue the contents of keyboard_key_bits and keyboard_modifier_keys, to be
+// sent when the host next polls the keyboard endpoint
+int8_t usb_keyboard_send(void)
 {
-    UENUM = MEDIA_ENDPOINT;
-    UEIENX |= (1 << TXINE);
+    uint8_t intr_state, head, next;
+
+    // Until the host first configures us, keep what's typed, as far as
+    // the queue goes: it's sent once the host is ready, rather than lost
+    // because it came in during enumeration.
+    if (!usb_can_send() && (usb_configured_once || usb_configuration)) {
+        usb_keyboard_tx_stats.drops++;
+        return -1;
+    }
+    head = keyboard_queue_head;
+    next = (head + 1) & (KEYBOARD_QUEUE_SIZE - 1);
+    if (next != keyboard_queue_tail) {
+        snapshot_key_data(&keyboard_queue[head]);
+        keyboard_queue_head = next;
+    } else {
+        // Full: replace the newest report, so that the host still ends
+        // up with the current state of the keyboard.
+        intr_state = SREG;
+        cli();
+        usb_keyboard_tx_stats.overruns++;
+        snapshot_key_data(&keyboard_queue[(head - 1) & (KEYBOARD_QUEUE_SIZE - 1)]);
+        SREG = intr_state;
+    }
+    TRACE_EVENT(TRACE_KEYBOARD_QUEUED, 0);
+    if (usb_configuration) {
+        request_tx(KEYBOARD_ENDPOINT);
+    }
+    return 0;
 }
 
-int8_t usb_mouse_send(uint8_t buttons, int8_t delta_x, int8_t delta_y)
+uint16_t usb_keyboard_report_latency(void)
 {
-    mouse_buttons = buttons;
-    uint8_t intr_state, timeout;
+    uint8_t intr_state = SREG;
+    uint16_t latency;
 
-    if (!usb_configuration) return -1;
-    intr_state = SREG;
     cli();
-    UENUM = MOUSE_ENDPOINT;
-    timeout = UDFNUML + 50;
-    while (1) {
-        // are we ready to transmit?
-        if (UEINTX & (1<<RWAL)) break;
-        SREG = intr_state;
-        // has the USB gone offline?
-        if (!usb_configuration) return -1;
-        // have we waited too long?
-        if (UDFNUML == timeout) return -1;
-        // get ready to try checking again
+    latency = keyboard_report_latency;
+    SREG = intr_state;
+    return latency;
+}
+
+uint32_t usb_keyboard_first_key_time(void)
+{
+    uint8_t intr_state = SREG;
+    uint32_t time;
+
+    cli();
+    time = keyboard_first_key_time;
+    SREG = intr_state;
+    return time;
+}
+
+// queue the contents of media_keys, to be sent when the host next polls
+// the media endpoint
+int8_t usb_media_send(void)
+{
+    uint8_t intr_state, head, next;
+
+    if (!usb_can_send()) {
+        usb_media_tx_stats.drops++;
+        return -1;
+    }
+    head = media_queue_head;
+    next = (head + 1) & (MEDIA_QUEUE_SIZE - 1);
+    if (next != media_queue_tail) {
+        snapshot_media_keys(&media_queue[head]);
+        media_queue_head = next;
+    } else {
+        // full: replace the newest report, as for the keyboard
         intr_state = SREG;
         cli();
-        UENUM = MOUSE_ENDPOINT;
+        usb_media_tx_stats.overruns++;
+        snapshot_media_keys(&media_queue[(head - 1) & (MEDIA_QUEUE_SIZE - 1)]);
+        SREG = intr_state;
     }
-    send_mouse_data(delta_x, delta_y);
-    UEINTX = 0x3A;
-    mouse_idle_count = 0;
-    SREG = intr_state;
+    request_tx(MEDIA_ENDPOINT);
     return 0;
 }
 
- // send the contents of keyboard_keys and keyboard_modifier_keys
- int8_t usb_keyboard_send_now(void)
- {
-    uint8_t intr_state, timeout;
+// add mouse motion (and the current buttons) to the next report; this
+// never waits for the host, the report is sent on the next frame
+int8_t usb_mouse_send(uint8_t buttons, int16_t delta_x, int16_t delta_y)
+{
+    uint8_t intr_state;
 
-    if (!usb_configuration) return -1;
+    if (!usb_can_send()) {
+        usb_mouse_tx_stats.drops++;
+        return -1;
+    }
     intr_state = SREG;
     cli();
-    UENUM = KEYBOARD_ENDPOINT;
-    timeout = UDFNUML + 50;
-    while (1) {
-        // are we ready to transmit?
-        if (UEINTX & (1<<RWAL)) break;
-        SREG = intr_state;
-        // has the USB gone offline?
-        if (!usb_configuration) return -1;
-        // have we waited too long?
-        if (UDFNUML == timeout) return -1;
-        // get ready to try checking again
-        intr_state = SREG;
-        cli();
-        UENUM = KEYBOARD_ENDPOINT;
+    mouse_buttons = buttons;
+    mouse_pending_x = add_saturating(mouse_pending_x, delta_x);
+    mouse_pending_y = add_saturating(mouse_pending_y, delta_y);
+    mouse_pending = 1;
+    usb_sof_update();
+    SREG = intr_state;
+    TRACE_EVENT(TRACE_MOUSE_QUEUED, 0);
+    return 0;
+}
+
+// add wheel and horizontal pan movement to the next mouse report
+int8_t usb_mouse_scroll(int8_t wheel, int8_t pan)
+{
+    uint8_t intr_state;
+
+    if (!usb_can_send()) {
+        usb_mouse_tx_stats.drops++;
+        return -1;
     }
-    send_key_data();
-    UEINTX = 0x3A;
-    keyboard_idle_count = 0;
+    intr_state = SREG;
+    cli();
+    mouse_pending_wheel = add_saturating(mouse_pending_wheel, wheel);
+    mouse_pending_pan = add_saturating(mouse_pending_pan, pan);
+    mouse_pending = 1;
+    usb_sof_update();
     SREG = intr_state;
     return 0;
 }
 
-int8_t usb_media_send_now(void)
+// copy a report into the raw HID buffer, to be sent when the host next
+// polls; a report that hasn't gone out yet is replaced
+int8_t usb_rawhid_send(const uint8_t *buffer)
 {
-    uint8_t intr_state, timeout;
+    uint8_t intr_state;
 
-    if (!usb_configuration) return -1;
+    if (!usb_can_send()) {
+        usb_rawhid_tx_stats.drops++;
+        return -1;
+    }
     intr_state = SREG;
     cli();
-    UENUM = MEDIA_ENDPOINT;
-    timeout = UDFNUML + 50;
-    while (1) {
-        // are we ready to transmit?
-        if (UEINTX & (1<<RWAL)) break;
-        SREG = intr_state;
-        // has the USB gone offline?
-        if (!usb_configuration) return -1;
-        // have we waited too long?
-        if (UDFNUML == timeout) return -1;
-        // get ready to try checking again
-        intr_state = SREG;
-        cli();
-        UENUM = MEDIA_ENDPOINT;
+    memcpy(rawhid_tx_buffer, buffer, RAWHID_SIZE);
+    UENUM = RAWHID_ENDPOINT;
+    if (UEIENX & (1 << TXINE)) {
+        usb_rawhid_tx_stats.overruns++;
     }
-    send_media_key_data();
-    UEINTX = 0x3A;
-    media_idle_count = 0;
+    UEIENX |= (1 << TXINE);
     SREG = intr_state;
     return 0;
 }
 
+// non-zero if usb_rawhid_send() wouldn't replace a report still waiting
+// for the host
+uint8_t usb_rawhid_ready(void)
+{
+    uint8_t intr_state, ready;
+
+    if (!usb_can_send()) return 0;
+    intr_state = SREG;
+    cli();
+    UENUM = RAWHID_ENDPOINT;
+    ready = !(UEIENX & (1 << TXINE));
+    SREG = intr_state;
+    return ready;
+}
+
+// send the contents of keyboard_key_bits and keyboard_modifier_keys; kept
+// for older callers, this is the same as usb_keyboard_send() and doesn't
+// wait for the host either
+int8_t usb_keyboard_send_now(void)
+{
+    return usb_keyboard_send();
+}
+
+int8_t usb_media_send_now(void)
+{
+    return usb_media_send();
+}
+
 
 
 /**************************************************************************
@@ -570,30 +947,126 @@ int8_t usb_media_send_now(void)
  *
  **************************************************************************/
 
-static void send_key_data() {
+static void snapshot_key_data(struct keyboard_report_struct *report) {
     int i;
-    UEDATX = keyboard_modifier_keys;
+    report->timestamp = timer1_read();
+    report->modifier_keys = keyboard_modifier_keys;
+    for (i=0; i<KEYBOARD_KEY_BITS_SIZE; i++) {
+        report->key_bits[i] = keyboard_key_bits[i];
+    }
+}
+
+static uint8_t report_has_keys(const struct keyboard_report_struct *report) {
+    uint8_t i, any = report->modifier_keys;
+    for (i=0; i<KEYBOARD_KEY_BITS_SIZE; i++) {
+        any |= report->key_bits[i];
+    }
+    return any != 0;
+}
+
+static void send_key_data(const struct keyboard_report_struct *report) {
+    uint8_t i, j, n, bits;
+    uint8_t keys[6];
+
+#ifdef KEYBOARD_NKRO
+    if (keyboard_protocol) {
+        UEDATX = report->modifier_keys;
+        for (i=0; i<KEYBOARD_KEY_BITS_SIZE; i++) {
+            UEDATX = report->key_bits[i];
+        }
+        return;
+    }
+#endif
+
+    // boot report: the first 6 keys pressed, or ErrorRollOver in every
+    // slot if there are more than that
+    n = 0;
+    for (i=0; i<KEYBOARD_KEY_BITS_SIZE; i++) {
+        bits = report->key_bits[i];
+        for (j = i << 3; bits; j++, bits >>= 1) {
+            if (bits & 1) {
+                if (n < 6) keys[n] = j;
+                n++;
+            }
+        }
+    }
+    UEDATX = report->modifier_keys;
     UEDATX = 0;
     for (i=0; i<6; i++) {
-        UEDATX = keyboard_keys[i];
+        if (n > 6) {
+            UEDATX = KEY_ERROR_ROLLOVER;
+        } else {
+            UEDATX = (i < n) ? keys[i] : 0;
+        }
     }
 }
 
-static void send_media_key_data() {
+static void snapshot_media_keys(struct media_report_struct *report) {
+    uint8_t i;
+    for (i = 0; i < 4; i++) {
+        report->keys[i] = media_keys[i];
+    }
+}
+
+static void send_media_key_data(const struct media_report_struct *report) {
     int i;
     for(i = 0; i < 4; i++) {
-        UEDATX = media_keys[i] & 0xff;
-        UEDATX = media_keys[i] >> 8;
+        UEDATX = report->keys[i] & 0xff;
+        UEDATX = report->keys[i] >> 8;
+    }
+}
+
+// motion that doesn't fit is lost, which counts as an overrun
+static int16_t add_saturating(int16_t a, int16_t b) {
+    int32_t sum = (int32_t)a + b;
+    if (sum > INT16_MAX || sum < -INT16_MAX) {
+        usb_mouse_tx_stats.overruns++;
+        return sum > 0 ? INT16_MAX : -INT16_MAX;
     }
+    return sum;
 }
 
-static void send_mouse_data(int8_t delta_x, int8_t delta_y) {
+static int16_t clamp_mouse_delta(int16_t delta, int16_t limit) {
+    if (delta > limit) return limit;
+    if (delta < -limit) return -limit;
+    return delta;
+}
+
+// In the boot protocol the caller must already have clamped X and Y
+// to 8 bits, and the host doesn't know about pan.
+static void send_mouse_data(int16_t delta_x, int16_t delta_y, int8_t wheel, int8_t pan) {
     UEDATX = mouse_buttons;
 
-    UEDATX = delta_x;
-    UEDATX = delta_y;
+    if (mouse_protocol) {
+        UEDATX = LSB(delta_x);
+        UEDATX = MSB(delta_x);
+        UEDATX = LSB(delta_y);
+        UEDATX = MSB(delta_y);
+        UEDATX = wheel;
+        UEDATX = pan;
+    } else {
+        UEDATX = delta_x;
+        UEDATX = delta_y;
+        UEDATX = wheel;
+    }
+}
+
+static void send_key_idle(void) {
+    send_key_data(&keyboard_report_sent);
+}
+
+static void send_media_idle(void) {
+    send_media_key_data(&media_report_sent);
+}
+
+static void send_mouse_idle(void) {
+    send_mouse_data(0, 0, 0, 0);
+}
 
-    UEDATX = 0; // wheel
+static void send_rawhid_data(void) {
+    for (uint8_t i = 0; i < RAWHID_SIZE; i++) {
+        UEDATX = rawhid_tx_buffer[i];
+    }
 }
 
 
@@ -602,11 +1075,31 @@ static void send_mouse_data(int8_t delta_x, int8_t delta_y) {
 //
 ISR(USB_GEN_vect)
 {
+    TRACE_ISR(TRACE_ISR_USB_GEN);
     uint8_t intbits, t, i;
-    static uint8_t div4=0;
+    static uint8_t prescale=0;
 
     intbits = UDINT;
     UDINT = 0;
+    if ((intbits & (1<<WAKEUPI)) && usb_suspend_state != USB_AWAKE) {
+        // Bus activity after a suspend.  WAKEUPI can only be cleared
+        // with the clock running.
+        usb_thaw();
+        UDINT &= ~(1<<WAKEUPI);
+        UDIEN = (1<<EORSTE)|(1<<SUSPE);
+        usb_suspend_state = USB_AWAKE;
+        usb_sof_update();
+        event_set_pending(EVENT_PENDING_USB);
+    }
+    if (intbits & (1<<SUSPI)) {
+        // No frames for 3 ms: the host has suspended the bus.  Wake on
+        // the next bus activity instead.
+        UDINT &= ~(1<<WAKEUPI);
+        UDIEN = (1<<EORSTE)|(1<<WAKEUPE);
+        usb_freeze();
+        usb_suspend_state = USB_SUSPENDED;
+        event_set_pending(EVENT_PENDING_USB);
+    }
     if (intbits & (1<<EORSTI)) {
         UENUM = 0;
         UECONX = 1;
@@ -614,41 +1107,57 @@ ISR(USB_GEN_vect)
         UECFG1X = EP_SIZE(ENDPOINT0_SIZE) | EP_SINGLE_BUFFER;
         UEIENX = (1<<RXSTPE);
         usb_configuration = 0;
+        usb_remote_wakeup_enabled = 0;
+        keyboard_protocol = 1;
+        mouse_protocol = 1;
+        idle_table[KEYBOARD_INTERFACE].config = KEYBOARD_IDLE_DEFAULT;
+        idle_table[MEDIA_INTERFACE].config = MEDIA_IDLE_DEFAULT;
+        idle_table[MOUSE_INTERFACE].config = MOUSE_IDLE_DEFAULT;
+        idle_table[RAWHID_INTERFACE].config = RAWHID_IDLE_DEFAULT;
+        usb_sof_update();
+        event_set_pending(EVENT_PENDING_USB);
     }
     if ((intbits & (1<<SOFI)) && usb_configuration) {
-        if (keyboard_idle_config && (++div4 & 3) == 0) {
-            UENUM = KEYBOARD_ENDPOINT;
-            if (UEINTX & (1<<RWAL)) {
-                keyboard_idle_count++;
-                if (keyboard_idle_count == keyboard_idle_config) {
-                    keyboard_idle_count = 0;
-                    send_key_data();
-                    UEINTX = 0x3A;
-                }
-            }
-        }
-        if (media_idle_config && (++div4 & 3) == 0) {
-            UENUM = MEDIA_ENDPOINT;
+        if (mouse_pending) {
+            UENUM = MOUSE_ENDPOINT;
             if (UEINTX & (1<<RWAL)) {
-                media_idle_count++;
-                if (media_idle_count == media_idle_config) {
-                    media_idle_count = 0;
-                    send_media_key_data();
-                    UEINTX = 0x3A;
-                }
+                int16_t limit = mouse_protocol ? INT16_MAX : 127;
+                int16_t delta_x = clamp_mouse_delta(mouse_pending_x, limit);
+                int16_t delta_y = clamp_mouse_delta(mouse_pending_y, limit);
+                int8_t wheel = clamp_mouse_delta(mouse_pending_wheel, 127);
+                int8_t pan = clamp_mouse_delta(mouse_pending_pan, 127);
+                mouse_pending_x -= delta_x;
+                mouse_pending_y -= delta_y;
+                mouse_pending_wheel -= wheel;
+                mouse_pending_pan -= pan;
+                mouse_pending = (mouse_pending_x || mouse_pending_y || mouse_pending_wheel || mouse_pending_pan);
+                send_mouse_data(delta_x, delta_y, wheel, pan);
+                UEINTX = 0x3A;
+                idle_restart(MOUSE_INTERFACE);
+                TM_COUNT(TM_COUNTER_MOUSE_REPORTS);
+                TRACE_EVENT(TRACE_MOUSE_SENT, 0);
+                TRACE_LATENCY_END(TRACE_HISTOGRAM_MOTION);
             }
         }
-        if (mouse_idle_config && (++div4 & 3) == 0) {
-            UENUM = MOUSE_ENDPOINT;
-            if (UEINTX & (1<<RWAL)) {
-                mouse_idle_count++;
-                if (mouse_idle_count == mouse_idle_config) {
-                    mouse_idle_count = 0;
-                    send_mouse_data(0, 0);
+        if (++prescale == 4) {
+            // another 4 ms; repeat any report whose idle time is up, unless
+            // a newer one is already waiting to go
+            prescale = 0;
+            for (i = 0; i < NUM_INTERFACES; i++) {
+                struct idle_struct *idle = &idle_table[i];
+                if (!idle->config) continue;
+                if (idle->countdown) idle->countdown--;
+                if (idle->countdown) continue;
+                UENUM = idle->endpoint;
+                if ((UEINTX & (1<<RWAL)) && !(UEIENX & (1<<TXINE))
+                    && !(idle->endpoint == MOUSE_ENDPOINT && mouse_pending)) {
+                    idle->send();
                     UEINTX = 0x3A;
+                    idle->countdown = idle->config;
                 }
             }
         }
+        usb_sof_update();
     }
 }
 
@@ -680,6 +1189,8 @@ static inline void usb_ack_out(void)
 
 ISR(USB_COM_vect)
 {
+    TRACE_ISR(TRACE_ISR_USB_COM);
+
     // device endpoint interrupt handling
 
     for (uint8_t epnum = FIRST_ENDPOINT; epnum <= LAST_ENDPOINT; epnum++) {
@@ -693,17 +1204,52 @@ ISR(USB_COM_vect)
             UEIENX &= ~(1 << TXINE);
 
             switch(epnum) {
-            case KEYBOARD_ENDPOINT:
-                send_key_data();
+            case KEYBOARD_ENDPOINT: {
+                // one queued report per IN transaction
+                uint8_t tail = keyboard_queue_tail;
+                if (tail != keyboard_queue_head) {
+                    keyboard_report_sent = keyboard_queue[tail];
+                    keyboard_queue_tail = tail = (tail + 1) & (KEYBOARD_QUEUE_SIZE - 1);
+                    keyboard_report_latency = timer1_read() - keyboard_report_sent.timestamp;
+                    if (!keyboard_first_key_time && report_has_keys(&keyboard_report_sent)) {
+                        keyboard_first_key_time = timer1_read32();
+                    }
+                }
+                send_key_data(&keyboard_report_sent);
                 UEINTX &= ~(1 << FIFOCON);
+                TRACE_EVENT(TRACE_KEYBOARD_SENT, 0);
+                TRACE_LATENCY_END(TRACE_HISTOGRAM_KEY);
+                idle_restart(KEYBOARD_INTERFACE);
 
-                keyboard_modifier_keys_acked = keyboard_modifier_keys;
-                memcpy((void *)keyboard_keys_acked, (void *)keyboard_keys, sizeof(keyboard_keys));
+                keyboard_modifier_keys_acked = keyboard_report_sent.modifier_keys;
+                memcpy((void *)keyboard_key_bits_acked, keyboard_report_sent.key_bits, sizeof(keyboard_key_bits_acked));
+
+                if (tail != keyboard_queue_head) {
+                    // more to send when the host polls again
+                    UEIENX |= (1 << TXINE);
+                }
+                break;
+            }
+            case MEDIA_ENDPOINT: {
+                // one queued report per IN transaction, like the keyboard
+                uint8_t tail = media_queue_tail;
+                if (tail != media_queue_head) {
+                    media_report_sent = media_queue[tail];
+                    media_queue_tail = tail = (tail + 1) & (MEDIA_QUEUE_SIZE - 1);
+                }
+                send_media_key_data(&media_report_sent);
+                UEINTX &= ~(1 << FIFOCON);
+                idle_restart(MEDIA_INTERFACE);
 
+                if (tail != media_queue_head) {
+                    UEIENX |= (1 << TXINE);
+                }
                 break;
-            case MEDIA_ENDPOINT:
-                send_media_key_data();
+            }
+            case RAWHID_ENDPOINT:
+                send_rawhid_data();
                 UEINTX &= ~(1 << FIFOCON);
+                idle_restart(RAWHID_INTERFACE);
                 break;
 
             }
@@ -799,8 +1345,18 @@ ISR(USB_COM_vect)
                     UECFG1X = pgm_read_byte(cfg++);
                 }
             }
-            UERST = 0x1E;
+            UERST = 0x3E;
             UERST = 0;
+            if (usb_configuration) {
+                usb_configured_once = 1;
+                // send whatever was typed while we waited
+                if (keyboard_queue_tail != keyboard_queue_head) {
+                    UENUM = KEYBOARD_ENDPOINT;
+                    UEIENX |= (1 << TXINE);
+                }
+            }
+            usb_sof_update();
+            event_set_pending(EVENT_PENDING_USB);
             return;
         }
         if (bRequest == GET_CONFIGURATION && bmRequestType == 0x80) {
@@ -813,6 +1369,9 @@ ISR(USB_COM_vect)
         if (bRequest == GET_STATUS) {
             usb_wait_in_ready();
             i = 0;
+            if (bmRequestType == 0x80 && usb_remote_wakeup_enabled) {
+                i = 0x02;
+            }
 #ifdef SUPPORT_ENDPOINT_HALT
             if (bmRequestType == 0x82) {
                 UENUM = wIndex;
@@ -825,6 +1384,12 @@ ISR(USB_COM_vect)
             usb_send_in();
             return;
         }
+        if ((bRequest == CLEAR_FEATURE || bRequest == SET_FEATURE)
+            && bmRequestType == 0x00 && wValue == DEVICE_REMOTE_WAKEUP) {
+            usb_remote_wakeup_enabled = (bRequest == SET_FEATURE);
+            usb_send_in();
+            return;
+        }
 #ifdef SUPPORT_ENDPOINT_HALT
         if ((bRequest == CLEAR_FEATURE || bRequest == SET_FEATURE)
             && bmRequestType == 0x02 && wValue == 0) {
@@ -843,17 +1408,28 @@ ISR(USB_COM_vect)
             }
         }
 #endif
+        if (wIndex < NUM_INTERFACES) {
+            if (bmRequestType == 0xA1 && bRequest == HID_GET_IDLE) {
+                usb_wait_in_ready();
+                UEDATX = idle_table[wIndex].config;
+                usb_send_in();
+                return;
+            }
+            if (bmRequestType == 0x21 && bRequest == HID_SET_IDLE) {
+                idle_table[wIndex].config = (wValue >> 8);
+                idle_restart(wIndex);
+                usb_sof_update();
+                usb_send_in();
+                return;
+            }
+        }
         if (wIndex == KEYBOARD_INTERFACE) {
             if (bmRequestType == 0xA1) {
                 if (bRequest == HID_GET_REPORT) {
+                    struct keyboard_report_struct report;
+                    snapshot_key_data(&report);
                     usb_wait_in_ready();
-                    send_key_data();
-                    usb_send_in();
-                    return;
-                }
-                if (bRequest == HID_GET_IDLE) {
-                    usb_wait_in_ready();
-                    UEDATX = keyboard_idle_config;
+                    send_key_data(&report);
                     usb_send_in();
                     return;
                 }
@@ -869,12 +1445,7 @@ ISR(USB_COM_vect)
                     usb_wait_receive_out();
                     keyboard_leds = UEDATX;
                     usb_ack_out();
-                    usb_send_in();
-                    return;
-                }
-                if (bRequest == HID_SET_IDLE) {
-                    keyboard_idle_config = (wValue >> 8);
-                    keyboard_idle_count = 0;
+                    event_set_pending(EVENT_PENDING_USB);
                     usb_send_in();
                     return;
                 }
@@ -888,14 +1459,10 @@ ISR(USB_COM_vect)
         if (wIndex == MEDIA_INTERFACE) {
             if (bmRequestType == 0xA1) {
                 if (bRequest == HID_GET_REPORT) {
+                    struct media_report_struct report;
+                    snapshot_media_keys(&report);
                     usb_wait_in_ready();
-                    send_media_key_data();
-                    usb_send_in();
-                    return;
-                }
-                if (bRequest == HID_GET_IDLE) {
-                    usb_wait_in_ready();
-                    UEDATX = media_idle_config;
+                    send_media_key_data(&report);
                     usb_send_in();
                     return;
                 }
@@ -911,12 +1478,7 @@ ISR(USB_COM_vect)
                     usb_wait_receive_out();
                     keyboard_leds = UEDATX;
                     usb_ack_out();
-                    usb_send_in();
-                    return;
-                }
-                if (bRequest == HID_SET_IDLE) {
-                    media_idle_config = (wValue >> 8);
-                    media_idle_count = 0;
+                    event_set_pending(EVENT_PENDING_USB);
                     usb_send_in();
                     return;
                 }
@@ -931,13 +1493,7 @@ ISR(USB_COM_vect)
             if (bmRequestType == 0xA1) {
                 if (bRequest == HID_GET_REPORT) {
                     usb_wait_in_ready();
-                    send_mouse_data(0, 0);
-                    usb_send_in();
-                    return;
-                }
-                if (bRequest == HID_GET_IDLE) {
-                    usb_wait_in_ready();
-                    UEDATX = mouse_idle_config;
+                    send_mouse_data(0, 0, 0, 0);
                     usb_send_in();
                     return;
                 }
@@ -955,12 +1511,6 @@ ISR(USB_COM_vect)
                     usb_send_in();
                     return;
                 }
-                if (bRequest == HID_SET_IDLE) {
-                    mouse_idle_config = (wValue >> 8);
-                    mouse_idle_count = 0;
-                    usb_send_in();
-                    return;
-                }
                 if (bRequest == HID_SET_PROTOCOL) {
                     mouse_protocol = wValue;
                     usb_send_in();
@@ -968,165 +1518,27 @@ ISR(USB_COM_vect)
                 }
             }
         }
-    }
-    UECONX = (1<<STALLRQ) | (1<<EPEN);      // stall
-}
-
-
-/////////////////////
-// Debug helpers
-
-static uint8_t _char_to_key[][2] = { 
-    { 0, 0 },
-    { 0, 0 },
-    { 0, 0 },
-    { 0, 0 },
-    { 0, 0 },
-    { 0, 0 },
-    { 0, 0 },
-    { 0, 0 },
-
-    { 0, 0 }, // 8
-    { 0, KEY_TAB },
-    { 0, KEY_ENTER },
-    { 0, 0 },
-    { 0, 0 },
-    { 0, 0 },
-    { 0, 0 },
-    { 0, 0 },
-    
-    { 0, 0 }, // 16
-    { 0, 0 },
-    { 0, 0 },
-    { 0, 0 },
-    { 0, 0 },
-    { 0, 0 },
-    { 0, 0 },
-    { 0, 0 },
-    
-    { 0, 0 }, // 24
-    { 0, 0 },
-    { 0, 0 },
-    { 0, 0 },
-    { 0, 0 },
-    { 0, 0 },
-    { 0, 0 },
-    { 0, 0 },
-    
-    { 0, KEY_SPACE }, // 32
-    { MODIFIER_KEY_SHIFT, KEY_1 },
-    { MODIFIER_KEY_SHIFT, KEY_QUOTE },
-    { MODIFIER_KEY_SHIFT, KEY_3 },
-    { MODIFIER_KEY_SHIFT, KEY_4 },
-    { MODIFIER_KEY_SHIFT, KEY_5 },
-    { MODIFIER_KEY_SHIFT, KEY_7 },
-    { 0, KEY_QUOTE },
-    
-    { MODIFIER_KEY_SHIFT, KEY_9 }, // 40
-    { MODIFIER_KEY_SHIFT, KEY_0 },
-    { MODIFIER_KEY_SHIFT, KEY_8 },
-    { MODIFIER_KEY_SHIFT, KEY_EQUAL },
-    { 0, KEY_COMMA },
-    { 0, KEY_MINUS },
-    { 0, KEY_PERIOD },
-    { 0, KEY_SLASH },
-    
-    { 0, KEY_0 }, // 48
-    { 0, KEY_1 },
-    { 0, KEY_2 },
-    { 0, KEY_3 },
-    { 0, KEY_4 },
-    { 0, KEY_5 },
-    { 0, KEY_6 },
-    { 0, KEY_7 },
-
-    { 0, KEY_8 }, // 56
-    { 0, KEY_9 },
-    { MODIFIER_KEY_SHIFT, KEY_SEMICOLON },
-    { 0, KEY_SEMICOLON },
-    { MODIFIER_KEY_SHIFT, KEY_COMMA },
-    { 0, KEY_EQUAL },
-    { MODIFIER_KEY_SHIFT, KEY_PERIOD },
-    { MODIFIER_KEY_SHIFT, KEY_SLASH },
-    
-    { MODIFIER_KEY_SHIFT, KEY_2 }, // 64
-    { MODIFIER_KEY_SHIFT, KEY_A },
-    { MODIFIER_KEY_SHIFT, KEY_B },
-    { MODIFIER_KEY_SHIFT, KEY_C },
-    { MODIFIER_KEY_SHIFT, KEY_D },
-    { MODIFIER_KEY_SHIFT, KEY_E },
-    { MODIFIER_KEY_SHIFT, KEY_F },
-    { MODIFIER_KEY_SHIFT, KEY_G },
-    { MODIFIER_KEY_SHIFT, KEY_H },
-    { MODIFIER_KEY_SHIFT, KEY_I },
-    { MODIFIER_KEY_SHIFT, KEY_J },
-    { MODIFIER_KEY_SHIFT, KEY_K },
-    { MODIFIER_KEY_SHIFT, KEY_L },
-    { MODIFIER_KEY_SHIFT, KEY_M },
-    { MODIFIER_KEY_SHIFT, KEY_N },
-    { MODIFIER_KEY_SHIFT, KEY_O },
-    { MODIFIER_KEY_SHIFT, KEY_P },
-    { MODIFIER_KEY_SHIFT, KEY_Q },
-    { MODIFIER_KEY_SHIFT, KEY_R },
-    { MODIFIER_KEY_SHIFT, KEY_S },
-    { MODIFIER_KEY_SHIFT, KEY_T },
-    { MODIFIER_KEY_SHIFT, KEY_U },
-    { MODIFIER_KEY_SHIFT, KEY_V },
-    { MODIFIER_KEY_SHIFT, KEY_W },
-    { MODIFIER_KEY_SHIFT, KEY_X },
-    { MODIFIER_KEY_SHIFT, KEY_Y },
-    { MODIFIER_KEY_SHIFT, KEY_Z },
-
-    { 0, KEY_LEFT_BRACE }, // 91
-    { 0, KEY_BACKSLASH },
-    { 0, KEY_RIGHT_BRACE },
-    { MODIFIER_KEY_SHIFT, KEY_6 },
-    { MODIFIER_KEY_SHIFT, KEY_MINUS },
-
-    { 0, KEY_TILDE }, // 96
-    { 0, KEY_A },
-    { 0, KEY_B },
-    { 0, KEY_C },
-    { 0, KEY_D },
-    { 0, KEY_E },
-    { 0, KEY_F },
-    { 0, KEY_G },
-    { 0, KEY_H },
-    { 0, KEY_I },
-    { 0, KEY_J },
-    { 0, KEY_K },
-    { 0, KEY_L },
-    { 0, KEY_M },
-    { 0, KEY_N },
-    { 0, KEY_O },
-    { 0, KEY_P },
-    { 0, KEY_Q },
-    { 0, KEY_R },
-    { 0, KEY_S },
-    { 0, KEY_T },
-    { 0, KEY_U },
-    { 0, KEY_V },
-    { 0, KEY_W },
-    { 0, KEY_X },
-    { 0, KEY_Y },
-    { 0, KEY_Z },
-
-    { MODIFIER_KEY_SHIFT, KEY_LEFT_BRACE }, // 123
-    { MODIFIER_KEY_SHIFT, KEY_BACKSLASH },
-    { MODIFIER_KEY_SHIFT, KEY_RIGHT_BRACE },
-    { MODIFIER_KEY_SHIFT, KEY_TILDE },
-    { 0, 0 },
-};
-
-void usb_keyboard_send_message(char *msg) {
-    for(char *ltr = msg; *ltr; ltr++) {
-
-        uint8_t *values = _char_to_key[*ltr & 0x7f];
-        if (!values[1]) {
-            continue;
+        if (wIndex == RAWHID_INTERFACE) {
+            if (bmRequestType == 0xA1 && bRequest == HID_GET_REPORT) {
+                // the report is bigger than endpoint 0, so it goes the
+                // way a descriptor does, a packet at a time
+                const uint8_t *report = rawhid_tx_buffer;
+                len = (wLength < RAWHID_SIZE) ? wLength : RAWHID_SIZE;
+                do {
+                    do {
+                        i = UEINTX;
+                    } while (!(i & ((1<<TXINI)|(1<<RXOUTI))));
+                    if (i & (1<<RXOUTI)) return;    // abort
+                    n = len < ENDPOINT0_SIZE ? len : ENDPOINT0_SIZE;
+                    for (i = n; i; i--) {
+                        UEDATX = *report++;
+                    }
+                    len -= n;
+                    usb_send_in();
+                } while (len || n == ENDPOINT0_SIZE);
+                return;
+            }
         }
-
-        usb_keyboard_press(values[1], values[0]);
     }
+    UECONX = (1<<STALLRQ) | (1<<EPEN);      // stall
 }
-
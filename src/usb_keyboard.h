@@ -5,26 +5,60 @@
 
 void usb_init(void);			// initialize everything
 uint8_t usb_configured(void);		// is the USB port configured
+uint8_t usb_suspended(void);		// has the host suspended the bus
+
+// Ask the host to resume the bus, if it suspended it and enabled remote
+// wakeup.  Returns -1 if not; otherwise reports can be queued straight
+// away, and go out once the host resumes.
+int8_t usb_remote_wakeup(void);
 
 int8_t usb_keyboard_press(uint8_t key, uint8_t modifier);
-void usb_keyboard_send_message(char *msg);
 
 int8_t usb_media_press(uint16_t key);
 
-void usb_keyboard_send(void);
-void usb_media_send(void);
+// none of the send functions wait for the host; they return -1 and count
+// a drop if the device isn't configured, or is suspended and hasn't asked
+// for a remote wakeup.  Keyboard reports are the exception before the
+// host first configures us: they're queued, and go out once it does.
+int8_t usb_keyboard_send(void);
+int8_t usb_media_send(void);
+
+uint16_t usb_keyboard_report_latency(void);	// timer1 counts
+uint32_t usb_keyboard_first_key_time(void);	// timer1_read32 when a report with a key down first went out, or 0
 
 int8_t usb_keyboard_send_now(void);
 int8_t usb_media_send_now(void);
-int8_t usb_mouse_send(uint8_t buttons, int8_t delta_x, int8_t delta_y);
+int8_t usb_mouse_send(uint8_t buttons, int16_t delta_x, int16_t delta_y);
+int8_t usb_mouse_scroll(int8_t wheel, int8_t pan);
+
+// vendor-defined raw HID interface, for telemetry; sends one report of
+// USB_RAWHID_REPORT_SIZE bytes, replacing any report not yet sent
+#define USB_RAWHID_REPORT_SIZE	64
+int8_t usb_rawhid_send(const uint8_t *buffer);
+uint8_t usb_rawhid_ready(void);	// the host has taken the last report
+
+typedef struct {
+	uint8_t drops;		// reports discarded while not configured
+	uint8_t overruns;	// reports replaced by a newer one before the host polled
+} usb_tx_stats_t;
+
+extern volatile usb_tx_stats_t usb_keyboard_tx_stats;
+extern volatile usb_tx_stats_t usb_media_tx_stats;
+extern volatile usb_tx_stats_t usb_mouse_tx_stats;
+extern volatile usb_tx_stats_t usb_rawhid_tx_stats;
 
 
 
 extern volatile uint8_t keyboard_modifier_keys;
 extern volatile uint8_t keyboard_modifier_keys_acked; // set by keyboard_send isr when keys have been sent after a call to usb_keyboard_send()
 
-extern volatile uint8_t keyboard_keys[6];
-extern volatile uint8_t keyboard_keys_acked[6]; // set by keyboard_send isr when keys have been sent after a call to usb_keyboard_send()
+// which keys are currently pressed, one bit per usage 0-127
+#define KEYBOARD_KEY_BITS_SIZE 16
+extern volatile uint8_t keyboard_key_bits[KEYBOARD_KEY_BITS_SIZE];
+extern volatile uint8_t keyboard_key_bits_acked[KEYBOARD_KEY_BITS_SIZE]; // set by keyboard_send isr when keys have been sent after a call to usb_keyboard_send()
+
+#define keyboard_key_press(key) (keyboard_key_bits[(key) >> 3] |= (1 << ((key) & 7)))
+#define keyboard_key_release(key) (keyboard_key_bits[(key) >> 3] &= ~(1 << ((key) & 7)))
 
 
 extern volatile uint16_t media_keys[4];
@@ -50,6 +84,7 @@ extern volatile uint8_t keyboard_leds;
 #define MODIFIER_KEY_RIGHT_ALT	0x40
 #define MODIFIER_KEY_RIGHT_GUI	0x80
 
+#define KEY_ERROR_ROLLOVER	1
 #define KEY_A		4
 #define KEY_B		5
 #define KEY_C		6
@@ -172,7 +207,7 @@ extern volatile uint8_t keyboard_leds;
 			((s) == 16 ? 0x10 :	\
 			             0x00)))
 
-#define MAX_ENDPOINT		4
+#define MAX_ENDPOINT		5
 
 #define LSB(n) (n & 255)
 #define MSB(n) ((n >> 8) & 255)
@@ -203,6 +238,7 @@ extern volatile uint8_t keyboard_leds;
 #define GET_STATUS			0
 #define CLEAR_FEATURE			1
 #define SET_FEATURE			3
+#define DEVICE_REMOTE_WAKEUP		1	// feature selector
 #define SET_ADDRESS			5
 #define GET_DESCRIPTOR			6
 #define GET_CONFIGURATION		8
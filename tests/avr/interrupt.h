@@ -0,0 +1,16 @@
+#ifndef TESTS_AVR_INTERRUPT_H_
+#define TESTS_AVR_INTERRUPT_H_
+
+// Stand-in for avr-libc's <avr/interrupt.h>.  An ISR is an ordinary
+// function named after its vector, which hostsim calls with the I bit
+// clear, as the chip would.
+
+#include <avr/io.h>
+
+#define cli() (SREG &= ~_BV(SREG_I))
+#define sei() (SREG |= _BV(SREG_I))
+
+#define ISR(vector, ...) void vector(void) __VA_ARGS__
+#define ISR_ALIASOF(vector) __attribute__((alias(#vector)))
+
+#endif
@@ -0,0 +1,142 @@
+#ifndef TESTS_AVR_IO_H_
+#define TESTS_AVR_IO_H_
+
+// Stand-in for avr-libc's <avr/io.h>, for building the firmware on the
+// host (see hostsim.h).  Only the at90usb1286 registers and bits that
+// the firmware uses are here, with the datasheet's bit numbers.
+//
+// Most registers are plain variables.  The ones with side effects on
+// the real chip are accessed through hostsim functions instead:
+//
+//   - PINx read back the port's outputs, pull-ups and whatever the
+//     simulated devices drive.
+//   - EIFR and TIFR1 read the simulation's pending flags, and writes to
+//     them are ignored.  The firmware always clears a flag just before
+//     enabling its interrupt, so instead an interrupt that's raised
+//     while it's disabled is dropped.
+//   - The endpoint registers (UEINTX, UEDATX and so on) belong to the
+//     endpoint selected by UENUM, and UEDATX reads or writes the next
+//     byte of its FIFO.
+//   - PLLCSR reports lock as soon as the PLL is enabled.
+//   - TCNT3 counts hostsim_cycles at timer3's prescaler.
+
+#include <stdint.h>
+
+#include "hostsim.h"
+
+#define _BV(bit) (1 << (bit))
+
+#define __AVR_AT90USB1286__ 1
+
+extern volatile uint8_t SREG;
+extern volatile uint8_t MCUSR;
+extern volatile uint8_t CLKPR;
+extern volatile uint8_t SMCR;
+extern volatile uint8_t WDTCSR;
+extern volatile uint8_t GPIOR0;
+
+extern volatile uint8_t PORTB, DDRB;
+extern volatile uint8_t PORTD, DDRD;
+extern volatile uint8_t PORTE, DDRE;
+#define PINB (*hostsim_pin(HOSTSIM_PORT_B))
+#define PIND (*hostsim_pin(HOSTSIM_PORT_D))
+#define PINE (*hostsim_pin(HOSTSIM_PORT_E))
+
+extern volatile uint8_t EICRA, EICRB, EIMSK;
+#define EIFR (*hostsim_flags(HOSTSIM_EIFR))
+
+extern volatile uint8_t TCCR1A, TCCR1B, TCCR1C, TIMSK1;
+extern volatile uint16_t TCNT1, OCR1A, OCR1B;
+#define TIFR1 (*hostsim_flags(HOSTSIM_TIFR1))
+
+extern volatile uint8_t TCCR3A, TCCR3B;
+#define TCNT3 (*hostsim_tcnt3())
+
+extern volatile uint8_t UHWCON, USBCON, UDCON, UDINT, UDIEN, UDADDR, UENUM, UERST;
+#define PLLCSR (*hostsim_pllcsr())
+#define UECONX (*hostsim_endpoint_register(HOSTSIM_UECONX))
+#define UECFG0X (*hostsim_endpoint_register(HOSTSIM_UECFG0X))
+#define UECFG1X (*hostsim_endpoint_register(HOSTSIM_UECFG1X))
+#define UEINTX (*hostsim_endpoint_register(HOSTSIM_UEINTX))
+#define UEIENX (*hostsim_endpoint_register(HOSTSIM_UEIENX))
+#define UEDATX (*hostsim_endpoint_fifo())
+
+// SREG
+#define SREG_I 7
+
+// MCUSR
+#define WDRF 3
+
+// SMCR
+#define SE 0
+#define SM0 1
+#define SM1 2
+#define SM2 3
+
+// WDTCSR
+#define WDP0 0
+#define WDP1 1
+#define WDP2 2
+#define WDE 3
+#define WDCE 4
+#define WDP3 5
+#define WDIE 6
+#define WDIF 7
+
+// TIMSK1 and TIFR1
+#define TOIE1 0
+#define OCIE1A 1
+#define OCIE1B 2
+#define TOV1 0
+#define OCF1A 1
+#define OCF1B 2
+
+// PLLCSR
+#define PLOCK 0
+#define PLLE 1
+#define PLLP0 2
+
+// USBCON
+#define OTGPADE 4
+#define FRZCLK 5
+#define USBE 7
+
+// UDCON
+#define DETACH 0
+#define RMWKUP 1
+
+// UDINT and UDIEN
+#define SUSPI 0
+#define SOFI 2
+#define EORSTI 3
+#define WAKEUPI 4
+#define SUSPE 0
+#define SOFE 2
+#define EORSTE 3
+#define WAKEUPE 4
+
+// UDADDR
+#define ADDEN 7
+
+// UEINTX
+#define TXINI 0
+#define STALLEDI 1
+#define RXOUTI 2
+#define RXSTPI 3
+#define NAKOUTI 4
+#define RWAL 5
+#define NAKINI 6
+#define FIFOCON 7
+
+// UEIENX
+#define TXINE 0
+#define RXOUTE 2
+#define RXSTPE 3
+
+// UECONX
+#define EPEN 0
+#define RSTDT 3
+#define STALLRQC 4
+#define STALLRQ 5
+
+#endif
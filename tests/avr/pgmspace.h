@@ -0,0 +1,14 @@
+#ifndef TESTS_AVR_PGMSPACE_H_
+#define TESTS_AVR_PGMSPACE_H_
+
+// Stand-in for avr-libc's <avr/pgmspace.h>: there's only one address
+// space on the host, so flash reads are plain reads.
+
+#include <stdint.h>
+
+#define PROGMEM
+
+#define pgm_read_byte(address) (*(const uint8_t *)(address))
+#define pgm_read_word(address) (*(const uint16_t *)(address))
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef TESTS_AVR_SLEEP_H_
+#define TESTS_AVR_SLEEP_H_
+
+// Stand-in for avr-libc's <avr/sleep.h>.  Sleeping hands control back
+// to the simulation until an interrupt has run.
+
+#include <avr/io.h>
+
+#define SLEEP_MODE_IDLE 0
+#define SLEEP_MODE_PWR_DOWN _BV(SM1)
+
+#define set_sleep_mode(mode) (SMCR = (SMCR & ~(_BV(SM0) | _BV(SM1) | _BV(SM2))) | (mode))
+#define sleep_enable() (SMCR |= _BV(SE))
+#define sleep_disable() (SMCR &= ~_BV(SE))
+#define sleep_cpu() hostsim_sleep()
+
+#endif
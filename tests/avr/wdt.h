@@ -0,0 +1,16 @@
+#ifndef TESTS_AVR_WDT_H_
+#define TESTS_AVR_WDT_H_
+
+// Stand-in for avr-libc's <avr/wdt.h>.  The simulated watchdog never
+// resets anything.
+
+#include <avr/io.h>
+
+#define WDTO_120MS 3
+#define WDTO_1S 6
+
+#define wdt_reset()
+#define wdt_enable(timeout) (WDTCSR = _BV(WDE) | (timeout))
+#define wdt_disable() (WDTCSR = 0)
+
+#endif
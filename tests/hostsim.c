@@ -0,0 +1,653 @@
+#include "hostsim.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+
+#include <avr/io.h>
+
+// the registers that are plain variables
+volatile uint8_t SREG, MCUSR, CLKPR, SMCR, WDTCSR, GPIOR0;
+volatile uint8_t PORTB, DDRB, PORTD, DDRD, PORTE, DDRE;
+volatile uint8_t EICRA, EICRB, EIMSK;
+volatile uint8_t TCCR1A, TCCR1B, TCCR1C, TIMSK1;
+volatile uint16_t TCNT1, OCR1A, OCR1B;
+volatile uint8_t TCCR3A, TCCR3B;
+volatile uint8_t UHWCON, USBCON, UDCON, UDINT, UDIEN, UDADDR, UENUM, UERST;
+
+uint64_t hostsim_cycles;
+
+uint16_t hostsim_isr_cycles[HOSTSIM_VECTOR_COUNT] = {
+    [HOSTSIM_INT0] = 90,
+    [HOSTSIM_INT1] = 90,
+    [HOSTSIM_INT2] = 90,
+    [HOSTSIM_INT3] = 90,
+    [HOSTSIM_INT6] = 40,
+    [HOSTSIM_INT7] = 120,
+    [HOSTSIM_USB_GEN] = 300,
+    [HOSTSIM_USB_COM] = 600,
+    [HOSTSIM_TIMER1_COMPA] = 300,
+    [HOSTSIM_TIMER1_COMPB] = 100,
+    [HOSTSIM_TIMER1_OVF] = 40,
+};
+uint32_t hostsim_isr_calls[HOSTSIM_VECTOR_COUNT];
+uint64_t hostsim_isr_max_wait[HOSTSIM_VECTOR_COUNT];
+uint16_t hostsim_cli_cycles = 150;
+
+// set once HOSTSIM_ISR_CYCLES is read
+static char const *_isr_cycles_from = "guesses; set HOSTSIM_ISR_CYCLES for real ones";
+
+static char const *const _vector_names[HOSTSIM_VECTOR_COUNT] = {
+    "INT0", "INT1", "INT2", "INT3", "INT6", "INT7",
+    "USB_GEN", "USB_COM",
+    "TIMER1_COMPA", "TIMER1_COMPB", "TIMER1_OVF",
+};
+
+// hidtelemetry's names for the ISRs a TRACE build times, and the
+// vectors they cover; isrcycles also gives int6 and timer1_ovf.
+static struct {
+    char const *name;
+    hostsim_vector_t vectors[2];
+    uint8_t count;
+} const _measured_isrs[] = {
+    { "usb_gen", { HOSTSIM_USB_GEN }, 1 },
+    { "usb_com", { HOSTSIM_USB_COM }, 1 },
+    { "int7", { HOSTSIM_INT7 }, 1 },
+    { "timer1_compb", { HOSTSIM_TIMER1_COMPB }, 1 },
+    { "quad_x", { HOSTSIM_INT0, HOSTSIM_INT1 }, 2 },
+    { "quad_y", { HOSTSIM_INT2, HOSTSIM_INT3 }, 2 },
+    { "timer1_compa", { HOSTSIM_TIMER1_COMPA }, 1 },
+    { "int6", { HOSTSIM_INT6 }, 1 },
+    { "timer1_ovf", { HOSTSIM_TIMER1_OVF }, 1 },
+};
+
+hostsim_endpoint_t hostsim_endpoints[HOSTSIM_ENDPOINTS];
+
+// The firmware's ISRs.  Weak, so that a test can leave out the modules
+// it doesn't need.
+#define VECTOR(name) extern void name(void) __attribute__((weak));
+VECTOR(INT0_vect)
+VECTOR(INT1_vect)
+VECTOR(INT2_vect)
+VECTOR(INT3_vect)
+VECTOR(INT6_vect)
+VECTOR(INT7_vect)
+VECTOR(USB_GEN_vect)
+VECTOR(USB_COM_vect)
+VECTOR(TIMER1_COMPA_vect)
+VECTOR(TIMER1_COMPB_vect)
+VECTOR(TIMER1_OVF_vect)
+#undef VECTOR
+
+extern int firmware_main(void) __attribute__((weak));
+
+static void (*const _vectors[HOSTSIM_VECTOR_COUNT])(void) = {
+    INT0_vect, INT1_vect, INT2_vect, INT3_vect, INT6_vect, INT7_vect,
+    USB_GEN_vect, USB_COM_vect,
+    TIMER1_COMPA_vect, TIMER1_COMPB_vect, TIMER1_OVF_vect,
+};
+
+// Interrupts that have been raised and not yet run, one bit per vector,
+// and when.  The USB interrupts aren't here: they follow the USB
+// registers.
+static uint32_t _pending;
+static uint64_t _raised_at[HOSTSIM_VECTOR_COUNT];
+
+// Set whenever an ISR runs, which wakes the firmware.
+static uint8_t _woken;
+
+// The end of the current hostsim_run.  Interrupts that keep coming
+// faster than their ISRs finish stop there, rather than run forever.
+static uint64_t _deadline = HOSTSIM_NEVER;
+
+static hostsim_device_t *_devices;
+
+static ucontext_t _world_context, _firmware_context;
+static uint8_t _booted;
+
+#define FIRMWARE_STACK_SIZE (256 * 1024)
+
+
+//
+// Devices and pins
+//
+
+void hostsim_attach(hostsim_device_t *device) {
+    device->link = _devices;
+    _devices = device;
+}
+
+static volatile uint8_t *const _port_registers[HOSTSIM_PORT_COUNT] = { &PORTB, &PORTD, &PORTE };
+static volatile uint8_t *const _ddr_registers[HOSTSIM_PORT_COUNT] = { &DDRB, &DDRD, &DDRE };
+
+// what the devices are doing to each pin
+static uint8_t _driven[HOSTSIM_PORT_COUNT];
+static uint8_t _driven_high[HOSTSIM_PORT_COUNT];
+
+static uint8_t _wire(hostsim_port_t port) {
+    uint8_t output = *_ddr_registers[port];
+    uint8_t device_low = _driven[port] & ~_driven_high[port];
+    uint8_t firmware_low = output & ~*_port_registers[port];
+
+    // Undriven inputs read high, whether or not the pull-up is on; the
+    // firmware never leaves one floating.
+    return ~(device_low | firmware_low);
+}
+
+uint8_t hostsim_line(hostsim_port_t port, uint8_t bit) {
+    return (_wire(port) >> bit) & 1;
+}
+
+volatile uint8_t *hostsim_pin(hostsim_port_t port) {
+    static volatile uint8_t pin;
+    pin = _wire(port);
+    return &pin;
+}
+
+// The external interrupt on a pin, if there is one, and its sense
+// control bits.
+static int8_t _external_interrupt(hostsim_port_t port, uint8_t bit, uint8_t *sense) {
+    if (port == HOSTSIM_PORT_D && bit < 4) {
+        *sense = (EICRA >> (bit * 2)) & 3;
+        return HOSTSIM_INT0 + bit;
+    }
+    if (port == HOSTSIM_PORT_E && (bit == 6 || bit == 7)) {
+        *sense = (EICRB >> ((bit - 4) * 2)) & 3;
+        return (bit == 6) ? HOSTSIM_INT6 : HOSTSIM_INT7;
+    }
+    return -1;
+}
+
+static void _raise(hostsim_vector_t vector, uint8_t enabled) {
+    // see the note on flags in avr/io.h
+    if (enabled && !(_pending & (1UL << vector))) {
+        _pending |= 1UL << vector;
+        _raised_at[vector] = hostsim_cycles;
+    }
+}
+
+void hostsim_drive(hostsim_port_t port, uint8_t bit, int8_t level) {
+    uint8_t before = hostsim_line(port, bit);
+
+    if (level == HOSTSIM_RELEASE) {
+        _driven[port] &= ~_BV(bit);
+    } else {
+        _driven[port] |= _BV(bit);
+        if (level) {
+            _driven_high[port] |= _BV(bit);
+        } else {
+            _driven_high[port] &= ~_BV(bit);
+        }
+    }
+
+    uint8_t after = hostsim_line(port, bit);
+    uint8_t sense;
+    int8_t vector = _external_interrupt(port, bit, &sense);
+    if (vector < 0) {
+        return;
+    }
+    uint8_t enable_bit = (vector == HOSTSIM_INT6) ? 6 : (vector == HOSTSIM_INT7) ? 7 : bit;
+    uint8_t raise;
+    switch (sense) {
+    case 0: raise = !after; break;              // low level (taken as the edge into it)
+    case 1: raise = (before != after); break;   // any edge
+    case 2: raise = (before && !after); break;  // falling edge
+    default: raise = (!before && after); break; // rising edge
+    }
+    if (raise) {
+        _raise(vector, EIMSK & _BV(enable_bit));
+    }
+}
+
+
+//
+// Flags and PLL
+//
+
+volatile uint8_t *hostsim_flags(hostsim_flags_t flags) {
+    static volatile uint8_t value;
+
+    if (flags == HOSTSIM_EIFR) {
+        value = (_pending & 0x0f)
+            | ((_pending >> HOSTSIM_INT6) & 1) << 6
+            | ((_pending >> HOSTSIM_INT7) & 1) << 7;
+    } else {
+        value = ((_pending >> HOSTSIM_TIMER1_OVF) & 1) << TOV1
+            | ((_pending >> HOSTSIM_TIMER1_COMPA) & 1) << OCF1A
+            | ((_pending >> HOSTSIM_TIMER1_COMPB) & 1) << OCF1B;
+    }
+    return &value;
+}
+
+volatile uint8_t *hostsim_pllcsr(void) {
+    static volatile uint8_t pllcsr;
+
+    if (pllcsr & _BV(PLLE)) {
+        pllcsr |= _BV(PLOCK);
+    } else {
+        pllcsr &= ~_BV(PLOCK);
+    }
+    return &pllcsr;
+}
+
+
+//
+// USB endpoints
+//
+
+hostsim_control_in_t hostsim_control_in;
+
+// Bytes in the control IN packet being filled.
+static uint8_t _control_packet;
+
+static hostsim_endpoint_t *_endpoint(void) {
+    return &hostsim_endpoints[UENUM % HOSTSIM_ENDPOINTS];
+}
+
+uint8_t hostsim_endpoint_flags(uint8_t number) {
+    hostsim_endpoint_t *endpoint = &hostsim_endpoints[number];
+
+    endpoint->ueintx &= endpoint->registers[HOSTSIM_UEINTX];
+    endpoint->registers[HOSTSIM_UEINTX] = endpoint->ueintx;
+    return endpoint->ueintx;
+}
+
+void hostsim_endpoint_set_flags(uint8_t number, uint8_t flags) {
+    hostsim_endpoint_t *endpoint = &hostsim_endpoints[number];
+
+    endpoint->ueintx = hostsim_endpoint_flags(number) | flags;
+    endpoint->registers[HOSTSIM_UEINTX] = endpoint->ueintx;
+}
+
+static void _clear_flags(uint8_t number, uint8_t flags) {
+    hostsim_endpoint_t *endpoint = &hostsim_endpoints[number];
+
+    endpoint->ueintx = hostsim_endpoint_flags(number) & ~flags;
+    endpoint->registers[HOSTSIM_UEINTX] = endpoint->ueintx;
+}
+
+// An IN endpoint's bank is committed once the firmware clears FIFOCON.
+static void _check_commit(uint8_t number) {
+    hostsim_endpoint_t *endpoint = &hostsim_endpoints[number];
+
+    if (number == 0 || endpoint->committed || (hostsim_endpoint_flags(number) & _BV(FIFOCON))) {
+        return;
+    }
+    if (!(endpoint->registers[HOSTSIM_UECONX] & _BV(EPEN))) {
+        return;
+    }
+    endpoint->committed = 1;
+    _clear_flags(number, _BV(TXINI) | _BV(RWAL));
+}
+
+void hostsim_endpoint_free(uint8_t number) {
+    hostsim_endpoint_t *endpoint = &hostsim_endpoints[number];
+
+    endpoint->committed = 0;
+    endpoint->length = 0;
+    endpoint->position = 0;
+    hostsim_endpoint_set_flags(number, _BV(TXINI) | _BV(RWAL) | _BV(FIFOCON));
+}
+
+volatile uint8_t *hostsim_endpoint_register(hostsim_endpoint_register_t reg) {
+    hostsim_endpoint_t *endpoint = _endpoint();
+    uint8_t number = endpoint - hostsim_endpoints;
+
+    if (reg == HOSTSIM_UEINTX) {
+        if (number == 0) {
+            // The host is always ready for the next control IN packet,
+            // and OUT data is there until it's been read.
+            uint8_t out = endpoint->position >= 8 && endpoint->position < endpoint->length;
+            if (!(hostsim_endpoint_flags(0) & _BV(TXINI))) {
+                // the last packet went, and the next starts empty
+                _control_packet = 0;
+            }
+            hostsim_endpoint_set_flags(0, _BV(TXINI));
+            if (out) {
+                hostsim_endpoint_set_flags(0, _BV(RXOUTI));
+            } else {
+                _clear_flags(0, _BV(RXOUTI));
+            }
+        } else {
+            _check_commit(number);
+            hostsim_endpoint_flags(number);
+        }
+    }
+    return (volatile uint8_t *)&endpoint->registers[reg];
+}
+
+// The next byte of a control IN packet, once the setup packet and any
+// OUT data have been read.
+static volatile uint8_t *_control_in_byte(void) {
+    static volatile uint8_t overflow;
+    uint8_t size = 8 << ((hostsim_endpoints[0].registers[HOSTSIM_UECFG1X] >> 4) & 3);
+
+    if (_control_packet >= size || hostsim_control_in.length >= sizeof(hostsim_control_in.data)) {
+        hostsim_control_in.overflows++;
+        return &overflow;
+    }
+    _control_packet++;
+    if (_control_packet > hostsim_control_in.largest_packet) {
+        hostsim_control_in.largest_packet = _control_packet;
+    }
+    return (volatile uint8_t *)&hostsim_control_in.data[hostsim_control_in.length++];
+}
+
+volatile uint8_t *hostsim_endpoint_fifo(void) {
+    static volatile uint8_t overflow;
+    hostsim_endpoint_t *endpoint = _endpoint();
+
+    if (UENUM == 0 && endpoint->position >= endpoint->length) {
+        return _control_in_byte();
+    }
+    if (endpoint->position >= HOSTSIM_FIFO_SIZE) {
+        return &overflow;
+    }
+    volatile uint8_t *byte = (volatile uint8_t *)&endpoint->fifo[endpoint->position++];
+    if (UENUM != 0 && endpoint->position > endpoint->length) {
+        endpoint->length = endpoint->position;
+    }
+    return byte;
+}
+
+static uint8_t _usb_gen_due(void) {
+    return (UDINT & UDIEN) != 0;
+}
+
+static uint8_t _usb_com_due(void) {
+    for (uint8_t i = 0; i < HOSTSIM_ENDPOINTS; i++) {
+        uint8_t const *registers = hostsim_endpoints[i].registers;
+        uint8_t ueintx = hostsim_endpoint_flags(i);
+        uint8_t ueienx = registers[HOSTSIM_UEIENX];
+        if ((ueienx & _BV(TXINE)) && (ueintx & _BV(TXINI)) && !hostsim_endpoints[i].committed) {
+            return 1;
+        }
+        if ((ueienx & _BV(RXSTPE)) && (ueintx & _BV(RXSTPI))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+//
+// Interrupts and time
+//
+
+static uint8_t _enabled(hostsim_vector_t vector) {
+    switch (vector) {
+    case HOSTSIM_INT0: case HOSTSIM_INT1: case HOSTSIM_INT2: case HOSTSIM_INT3:
+        return EIMSK & _BV(vector - HOSTSIM_INT0);
+    case HOSTSIM_INT6: return EIMSK & _BV(6);
+    case HOSTSIM_INT7: return EIMSK & _BV(7);
+    case HOSTSIM_USB_GEN: return _usb_gen_due();
+    case HOSTSIM_USB_COM: return _usb_com_due();
+    case HOSTSIM_TIMER1_COMPA: return TIMSK1 & _BV(OCIE1A);
+    case HOSTSIM_TIMER1_COMPB: return TIMSK1 & _BV(OCIE1B);
+    case HOSTSIM_TIMER1_OVF: return TIMSK1 & _BV(TOIE1);
+    default: return 0;
+    }
+}
+
+static int8_t _next_vector(void) {
+    for (uint8_t vector = 0; vector < HOSTSIM_VECTOR_COUNT; vector++) {
+        uint8_t due = (vector == HOSTSIM_USB_GEN || vector == HOSTSIM_USB_COM)
+            || (_pending & (1UL << vector));
+        if (!due) {
+            continue;
+        }
+        if (!_enabled(vector)) {
+            // see the note on flags in avr/io.h
+            _pending &= ~(1UL << vector);
+            continue;
+        }
+        return vector;
+    }
+    return -1;
+}
+
+static void _step_until(uint64_t when);
+
+static void _run_isr(hostsim_vector_t vector) {
+    if (_pending & (1UL << vector)) {
+        uint64_t wait = hostsim_cycles - _raised_at[vector];
+        if (wait > hostsim_isr_max_wait[vector]) {
+            hostsim_isr_max_wait[vector] = wait;
+        }
+    }
+    _pending &= ~(1UL << vector);
+    if (!_vectors[vector]) {
+        fprintf(stderr, "hostsim: interrupt %d has no ISR\n", vector);
+        abort();
+    }
+
+    SREG &= ~_BV(SREG_I);
+    _woken = 1;
+    hostsim_isr_calls[vector]++;
+    _vectors[vector]();
+    for (uint8_t i = 1; i < HOSTSIM_ENDPOINTS; i++) {
+        _check_commit(i);
+    }
+
+    // Anything that happens while the ISR runs waits for it to finish.
+    _step_until(hostsim_cycles + hostsim_isr_cycles[vector]);
+    SREG |= _BV(SREG_I);
+}
+
+void hostsim_interrupts(void) {
+    while ((SREG & _BV(SREG_I)) && hostsim_cycles <= _deadline) {
+        int8_t vector = _next_vector();
+        if (vector < 0) {
+            return;
+        }
+        _run_isr(vector);
+    }
+}
+
+static hostsim_device_t *_next_device(void) {
+    hostsim_device_t *next = NULL;
+    for (hostsim_device_t *device = _devices; device; device = device->link) {
+        if (!next || device->next < next->next) {
+            next = device;
+        }
+    }
+    return next;
+}
+
+// Run device events up to when, and any interrupts they raise.
+static void _step_until(uint64_t when) {
+    for (;;) {
+        hostsim_device_t *device = _next_device();
+        if (!device || device->next > when) {
+            break;
+        }
+        if (device->next > hostsim_cycles) {
+            hostsim_cycles = device->next;
+        }
+        device->event(device);
+        hostsim_interrupts();
+    }
+    if (when > hostsim_cycles) {
+        hostsim_cycles = when;
+    }
+}
+
+
+//
+// timer1
+//
+
+static void _timer1_event(hostsim_device_t *device);
+static hostsim_device_t _timer1 = { 0, _timer1_event, NULL };
+
+static uint16_t const _timer_prescale[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+
+static void _timer1_event(hostsim_device_t *device) {
+    uint16_t prescale = _timer_prescale[TCCR1B & 7];
+
+    if (prescale) {
+        TCNT1++;
+        if (TCNT1 == 0) {
+            _raise(HOSTSIM_TIMER1_OVF, TIMSK1 & _BV(TOIE1));
+        }
+        if (TCNT1 == OCR1A) {
+            _raise(HOSTSIM_TIMER1_COMPA, TIMSK1 & _BV(OCIE1A));
+        }
+        if (TCNT1 == OCR1B) {
+            _raise(HOSTSIM_TIMER1_COMPB, TIMSK1 & _BV(OCIE1B));
+        }
+    } else {
+        prescale = 1024; // stopped; look again later
+    }
+    device->next = (hostsim_cycles / prescale + 1) * prescale;
+}
+
+
+//
+// timer3, which only counts
+//
+
+static volatile uint16_t _tcnt3;
+static uint64_t _timer3_counted_to;
+
+volatile uint16_t *hostsim_tcnt3(void) {
+    uint16_t prescale = _timer_prescale[TCCR3B & 7];
+
+    if (prescale) {
+        uint64_t counts = (hostsim_cycles - _timer3_counted_to) / prescale;
+        _tcnt3 += counts;
+        _timer3_counted_to += counts * prescale;
+    } else {
+        _timer3_counted_to = hostsim_cycles;
+    }
+    return &_tcnt3;
+}
+
+
+//
+// The firmware
+//
+
+void hostsim_print_isr_report(void) {
+    printf("ISR cycles: %s\n\n", _isr_cycles_from);
+    printf("%-13s %10s %7s %14s\n", "vector", "calls", "cycles", "longest wait");
+    for (uint8_t vector = 0; vector < HOSTSIM_VECTOR_COUNT; vector++) {
+        if (!hostsim_isr_calls[vector]) {
+            continue;
+        }
+        printf("%-13s %10u %7u", _vector_names[vector], hostsim_isr_calls[vector],
+               hostsim_isr_cycles[vector]);
+        if (vector == HOSTSIM_USB_GEN || vector == HOSTSIM_USB_COM) {
+            printf(" %14s\n", "-");
+        } else {
+            printf(" %11.1f us\n", (double)hostsim_isr_max_wait[vector] / HOSTSIM_CYCLES_PER_US);
+        }
+    }
+    printf("%-13s %10s %7u\n", "cli", "-", hostsim_cli_cycles);
+}
+
+// Take ISR times from HOSTSIM_ISR_CYCLES, if it's set.
+static void _load_isr_cycles(void) {
+    char const *setting = getenv("HOSTSIM_ISR_CYCLES");
+    if (!setting) {
+        return;
+    }
+
+    char name[16];
+    unsigned cycles;
+    int length;
+    _isr_cycles_from = "from HOSTSIM_ISR_CYCLES";
+    while (sscanf(setting, " %15[a-z0-9_]=%u%n", name, &cycles, &length) == 2) {
+        uint8_t found = 0;
+        if (strcmp(name, "cli") == 0) {
+            hostsim_cli_cycles = cycles;
+            found = 1;
+        }
+        for (uint8_t i = 0; i < sizeof(_measured_isrs) / sizeof(_measured_isrs[0]); i++) {
+            if (strcmp(name, _measured_isrs[i].name) == 0) {
+                for (uint8_t j = 0; j < _measured_isrs[i].count; j++) {
+                    hostsim_isr_cycles[_measured_isrs[i].vectors[j]] = cycles;
+                }
+                found = 1;
+            }
+        }
+        if (!found) {
+            fprintf(stderr, "hostsim: HOSTSIM_ISR_CYCLES: no ISR called %s\n", name);
+            exit(1);
+        }
+        setting += length;
+        setting += strspn(setting, " ,");
+    }
+    if (*setting) {
+        fprintf(stderr, "hostsim: HOSTSIM_ISR_CYCLES: can't read \"%s\"\n", setting);
+        exit(1);
+    }
+}
+
+static void _firmware_entry(void) {
+    firmware_main();
+    fprintf(stderr, "hostsim: firmware_main returned\n");
+    exit(1);
+}
+
+void hostsim_boot(void) {
+    if (_booted) {
+        return;
+    }
+    if (!firmware_main) {
+        fprintf(stderr, "hostsim: no firmware_main linked in\n");
+        exit(1);
+    }
+    _booted = 1;
+    _load_isr_cycles();
+
+    _timer1.next = 1024;
+    hostsim_attach(&_timer1);
+
+    getcontext(&_firmware_context);
+    _firmware_context.uc_stack.ss_sp = malloc(FIRMWARE_STACK_SIZE);
+    _firmware_context.uc_stack.ss_size = FIRMWARE_STACK_SIZE;
+    _firmware_context.uc_link = NULL;
+    makecontext(&_firmware_context, _firmware_entry, 0);
+
+    swapcontext(&_world_context, &_firmware_context);
+}
+
+void hostsim_sleep(void) {
+    if (!_booted) {
+        fprintf(stderr, "hostsim: sleeping outside the firmware\n");
+        abort();
+    }
+    swapcontext(&_firmware_context, &_world_context);
+}
+
+void hostsim_run_until(uint64_t when) {
+    hostsim_boot();
+    _deadline = when;
+
+    for (;;) {
+        hostsim_interrupts();
+        if (_woken) {
+            // back to the main loop, which sleeps again once it has
+            // nothing left to do
+            _woken = 0;
+            swapcontext(&_world_context, &_firmware_context);
+            continue;
+        }
+
+        hostsim_device_t *device = _next_device();
+        if (!device || device->next > when) {
+            break;
+        }
+        _step_until(device->next);
+    }
+    if (when > hostsim_cycles) {
+        hostsim_cycles = when;
+    }
+    _deadline = HOSTSIM_NEVER;
+}
+
+void hostsim_run(uint64_t cycles) {
+    hostsim_run_until(hostsim_cycles + cycles);
+}
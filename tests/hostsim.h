@@ -0,0 +1,187 @@
+#ifndef HOSTSIM_H_
+#define HOSTSIM_H_
+
+#include <stdint.h>
+
+// Runs the firmware on the host, against a simulation of the parts of
+// the at90usb1286 it uses: the registers, external interrupts INT0-3, 6
+// and 7, timer1, timer3's count, and the USB controller's endpoints.
+// The firmware's main() (built as firmware_main) runs in a coroutine of
+// its own.
+//
+// Simulated time only moves while the firmware sleeps or an ISR runs.
+// Main loop code takes no time at all, and each ISR takes the cycles
+// given in hostsim_isr_cycles, during which further interrupts wait as
+// they would on the chip.  Interrupts that come faster than their ISRs
+// can finish keep the main loop from running until hostsim_run ends,
+// where a real main loop would crawl.  Devices outside the chip (the
+// keyboard model, the quadrature generator, the USB host) are
+// scheduled as hostsim_device_t events, and drive the pins with
+// hostsim_drive.
+//
+// Not simulated: sleep modes other than idle, the watchdog, USB
+// suspend, timer3's interrupts, and GET_DESCRIPTOR (the descriptor
+// table holds 16-bit pointers).  int is 32 bits here, not 16.
+
+// Time is counted in CPU cycles at 16 MHz.
+#define HOSTSIM_CYCLES_PER_US 16
+#define HOSTSIM_US(us) ((uint64_t)(us) * HOSTSIM_CYCLES_PER_US)
+#define HOSTSIM_MS(ms) HOSTSIM_US((uint64_t)(ms) * 1000)
+#define HOSTSIM_NEVER UINT64_MAX
+
+extern uint64_t hostsim_cycles;
+
+// The vectors that are simulated, in the chip's priority order.
+typedef enum {
+    HOSTSIM_INT0 = 0,
+    HOSTSIM_INT1,
+    HOSTSIM_INT2,
+    HOSTSIM_INT3,
+    HOSTSIM_INT6,
+    HOSTSIM_INT7,
+    HOSTSIM_USB_GEN,
+    HOSTSIM_USB_COM,
+    HOSTSIM_TIMER1_COMPA,
+    HOSTSIM_TIMER1_COMPB,
+    HOSTSIM_TIMER1_OVF,
+
+    HOSTSIM_VECTOR_COUNT
+} hostsim_vector_t;
+
+// How long each ISR is taken to run, entry and exit included.  The
+// defaults are guesses, not measurements, and so is anything a benchmark
+// says about blocking or lost edges while they're in use.  For real
+// numbers, put name=cycles pairs in the HOSTSIM_ISR_CYCLES environment
+// variable, either from `make isr-cycles`, which works out each ISR's
+// longest path from main.elf, or from the "isr max cycles:" line
+// hidtelemetry prints for a TRACE build running on the device.
+extern uint16_t hostsim_isr_cycles[HOSTSIM_VECTOR_COUNT];
+extern uint32_t hostsim_isr_calls[HOSTSIM_VECTOR_COUNT];
+
+// The longest any interrupt waited, from being raised until its ISR
+// started, because another ISR was running.  Not kept for the USB
+// vectors, which follow the USB registers rather than being raised.
+extern uint64_t hostsim_isr_max_wait[HOSTSIM_VECTOR_COUNT];
+
+// The longest the firmware runs with interrupts disabled outside an
+// ISR.  Main loop code takes no time here, so nothing waits on it; the
+// keyboard benchmark adds it to INT7's longest wait instead.  Also a
+// guess unless HOSTSIM_ISR_CYCLES sets it, as cli=cycles.
+extern uint16_t hostsim_cli_cycles;
+
+// Print a line per vector: calls, cycles per call and longest wait, and
+// where the cycles came from.
+void hostsim_print_isr_report(void);
+
+// Something outside the chip.  event is called when hostsim_cycles
+// reaches next, and should set next to the time of the following event,
+// or HOSTSIM_NEVER.
+typedef struct hostsim_device {
+    uint64_t next;
+    void (*event)(struct hostsim_device *device);
+
+    // private
+    struct hostsim_device *link;
+} hostsim_device_t;
+
+void hostsim_attach(hostsim_device_t *device);
+
+// Start firmware_main and run it until it first sleeps.  hostsim_run
+// does this itself if need be.
+void hostsim_boot(void);
+
+// Run the firmware and the devices for the given number of cycles.
+void hostsim_run(uint64_t cycles);
+void hostsim_run_until(uint64_t when);
+
+// The pins devices can drive, and what they see.
+typedef enum {
+    HOSTSIM_PORT_B = 0,
+    HOSTSIM_PORT_D,
+    HOSTSIM_PORT_E,
+
+    HOSTSIM_PORT_COUNT
+} hostsim_port_t;
+
+#define HOSTSIM_RELEASE (-1)
+
+// Drive a pin to level 0 or 1, or HOSTSIM_RELEASE it to the pull-up.  An
+// edge on an external interrupt pin raises the interrupt, if its sense
+// control asks for that edge.  If the firmware is driving the pin too, a
+// low from either side wins.
+void hostsim_drive(hostsim_port_t port, uint8_t bit, int8_t level);
+
+// The level on the wire.
+uint8_t hostsim_line(hostsim_port_t port, uint8_t bit);
+
+// The USB controller's endpoints, for usbhost.c.  The IN endpoints have a
+// single bank: it's free (TXINI, RWAL and FIFOCON set) until the firmware
+// clears FIFOCON, and then committed until the host takes it.
+#define HOSTSIM_ENDPOINTS 7
+#define HOSTSIM_FIFO_SIZE 64
+
+typedef enum {
+    HOSTSIM_UECONX = 0,
+    HOSTSIM_UECFG0X,
+    HOSTSIM_UECFG1X,
+    HOSTSIM_UEINTX,
+    HOSTSIM_UEIENX,
+
+    HOSTSIM_ENDPOINT_REGISTERS
+} hostsim_endpoint_register_t;
+
+typedef struct {
+    // What the firmware last read or wrote.  UEINTX is the exception:
+    // writing a 1 to its flags does nothing, so the flags themselves are
+    // kept in ueintx (see hostsim_endpoint_flags).
+    uint8_t registers[HOSTSIM_ENDPOINT_REGISTERS];
+    uint8_t ueintx;
+    uint8_t fifo[HOSTSIM_FIFO_SIZE];
+    uint8_t length;     // bytes in the FIFO
+    uint8_t position;   // the byte UEDATX reaches next
+    uint8_t committed;  // an IN packet is waiting for the host
+} hostsim_endpoint_t;
+
+extern hostsim_endpoint_t hostsim_endpoints[HOSTSIM_ENDPOINTS];
+
+// The data stage of control IN requests, as the host received it.  The
+// firmware fills endpoint 0 a packet at a time, handing each over by
+// clearing TXINI; bytes past the size set in UECFG1X don't fit in the
+// bank, so they're counted in overflows and never arrive.
+typedef struct {
+    uint8_t data[256];
+    uint16_t length;
+    uint8_t largest_packet;
+    uint16_t overflows;
+} hostsim_control_in_t;
+
+extern hostsim_control_in_t hostsim_control_in;
+
+// Free an IN endpoint's bank, as when the host has taken a packet.
+void hostsim_endpoint_free(uint8_t endpoint);
+
+// An endpoint's UEINTX flags, after any the firmware has cleared.
+uint8_t hostsim_endpoint_flags(uint8_t endpoint);
+
+// Set UEINTX flags, as the controller does.
+void hostsim_endpoint_set_flags(uint8_t endpoint, uint8_t flags);
+
+// Run any interrupts that are due, as the chip would between two
+// instructions.  Devices that change registers call this.
+void hostsim_interrupts(void);
+
+// Used by the stub headers in tests/avr.
+typedef enum {
+    HOSTSIM_EIFR = 0,
+    HOSTSIM_TIFR1,
+} hostsim_flags_t;
+
+volatile uint8_t *hostsim_pin(hostsim_port_t port);
+volatile uint8_t *hostsim_flags(hostsim_flags_t flags);
+volatile uint8_t *hostsim_pllcsr(void);
+volatile uint16_t *hostsim_tcnt3(void);
+volatile uint8_t *hostsim_endpoint_register(hostsim_endpoint_register_t reg);
+volatile uint8_t *hostsim_endpoint_fifo(void);
+void hostsim_sleep(void);
+
+#endif
@@ -0,0 +1,363 @@
+#include "kbmodel.h"
+#include "hostsim.h"
+
+#include "../src/kbcomm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+kbmodel_timing_t kbmodel_timing = {
+    .send_low_us = 160,
+    .send_high_us = 170,
+    .receive_low_us = 180,
+    .receive_high_us = 220,
+    .reply_delay_us = 100,
+    .inquiry_timeout_ms = 250,
+    .jitter_us = 0,
+};
+
+kbmodel_stats_t kbmodel_stats;
+
+#define CLOCK HOSTSIM_PORT_E, 7
+#define DATA HOSTSIM_PORT_B, 0
+
+// how often the keyboard looks at the data line while it's waiting
+#define POLL_US 40
+
+#define MODEL_NUMBER 0x0b
+#define TEST_ACK 0x7d
+#define CMD_TEST 0x36
+
+// Data held low this long while the keyboard is waiting to reply means
+// the host has given up on the reply and is sending a command.  (It
+// stays low for a moment after every command, until INT7 lets go.)
+#define HOST_GAVE_UP_US 1000
+
+typedef enum {
+    IDLE,               // waiting for the host to pull data low
+    RECEIVE_LOW,        // clocking in a command: clock goes low next
+    RECEIVE_HIGH,       // clock goes high next, and the bit is read
+    INQUIRY,            // waiting for a transition
+    REPLY,              // waiting to send, once data is high
+    SEND_LOW,           // sending: clock goes low next
+    SEND_HIGH,          // clock goes high next, then the next bit is set
+} _state_t;
+
+static _state_t _state;
+static uint8_t _byte;
+static uint8_t _bits;
+static uint64_t _deadline;
+static uint8_t _keypad_waiting;  // the prefix has gone; the key goes with the next Instant
+static uint8_t _sending_transition;
+static uint64_t _data_low_since;
+static uint8_t _clock;           // what the keyboard is driving the clock to
+static uint32_t _random = 1;
+
+static uint8_t _connected;
+static uint8_t _glitching;
+
+#define QUEUE_SIZE 256 // must be a power of two
+static uint16_t _queue[QUEUE_SIZE];
+static uint16_t _queue_head, _queue_tail;
+
+static void _event(hostsim_device_t *device);
+static hostsim_device_t _device = { HOSTSIM_NEVER, _event, NULL };
+
+static void _glitch_over(hostsim_device_t *device);
+static hostsim_device_t _glitch_device = { HOSTSIM_NEVER, _glitch_over, NULL };
+
+uint16_t kbmodel_queued(void) {
+    return (_queue_head - _queue_tail) & (QUEUE_SIZE - 1);
+}
+
+static void _enqueue(uint16_t transition) {
+    uint16_t next = (_queue_head + 1) & (QUEUE_SIZE - 1);
+    if (next == _queue_tail) {
+        // a test that types this far ahead should run the firmware first
+        fprintf(stderr, "kbmodel: too many transitions queued\n");
+        abort();
+    }
+    _queue[_queue_head] = transition;
+    _queue_head = next;
+}
+
+void kbmodel_press(uint16_t key) {
+    _enqueue(key & ~0x80);
+}
+
+void kbmodel_release(uint16_t key) {
+    _enqueue(key | 0x80);
+}
+
+static void _drive_clock(uint8_t level) {
+    _clock = level;
+    if (!_glitching) {
+        hostsim_drive(CLOCK, level);
+    }
+}
+
+static void _power_up(void) {
+    _drive_clock(1);
+    hostsim_drive(DATA, HOSTSIM_RELEASE);
+    _state = IDLE;
+    _keypad_waiting = 0;
+    _sending_transition = 0;
+    _data_low_since = HOSTSIM_NEVER;
+    _connected = 1;
+    _device.next = hostsim_cycles + HOSTSIM_US(POLL_US);
+}
+
+void kbmodel_attach(void) {
+    _power_up();
+    hostsim_attach(&_device);
+    hostsim_attach(&_glitch_device);
+}
+
+void kbmodel_disconnect(void) {
+    if (!_connected) {
+        return;
+    }
+    kbmodel_stats.disconnects++;
+    _connected = 0;
+    _device.next = HOSTSIM_NEVER;
+    _clock = 1;
+    if (!_glitching) {
+        hostsim_drive(CLOCK, HOSTSIM_RELEASE);
+    }
+    hostsim_drive(DATA, HOSTSIM_RELEASE);
+}
+
+void kbmodel_connect(void) {
+    if (_connected) {
+        return;
+    }
+    kbmodel_stats.dropped += kbmodel_queued();
+    _queue_tail = _queue_head;
+    _power_up();
+}
+
+void kbmodel_glitch(uint16_t us) {
+    if (_glitching || !hostsim_line(CLOCK)) {
+        return;
+    }
+    kbmodel_stats.glitches++;
+    _glitching = 1;
+    hostsim_drive(CLOCK, 0);
+    _glitch_device.next = hostsim_cycles + HOSTSIM_US(us);
+}
+
+static void _glitch_over(hostsim_device_t *device) {
+    _glitching = 0;
+    device->next = HOSTSIM_NEVER;
+    hostsim_drive(CLOCK, _connected ? _clock : HOSTSIM_RELEASE);
+}
+
+void kbmodel_scale_timing(uint16_t percent) {
+    kbmodel_timing.send_low_us = (uint32_t)kbmodel_timing.send_low_us * percent / 100;
+    kbmodel_timing.send_high_us = (uint32_t)kbmodel_timing.send_high_us * percent / 100;
+    kbmodel_timing.receive_low_us = (uint32_t)kbmodel_timing.receive_low_us * percent / 100;
+    kbmodel_timing.receive_high_us = (uint32_t)kbmodel_timing.receive_high_us * percent / 100;
+    kbmodel_timing.reply_delay_us = (uint32_t)kbmodel_timing.reply_delay_us * percent / 100;
+}
+
+void kbmodel_seed(uint32_t seed) {
+    // xorshift never leaves 0
+    _random = seed ? seed : 1;
+}
+
+static void _wait_us(uint32_t us) {
+    _device.next = hostsim_cycles + HOSTSIM_US(us);
+}
+
+// A clock phase of us microseconds, up to jitter_us shorter or longer.
+static void _wait_phase_us(uint16_t us) {
+    int32_t jitter = kbmodel_timing.jitter_us;
+
+    // xorshift, so a run is the same every time (see kbmodel_seed)
+    _random ^= _random << 13;
+    _random ^= _random >> 17;
+    _random ^= _random << 5;
+    jitter = (int32_t)(_random % (2 * jitter + 1)) - jitter;
+    _wait_us((us + jitter > 1) ? us + jitter : 1);
+}
+
+// Non-zero once the host has held data low for HOST_GAVE_UP_US.
+static uint8_t _host_sending(void) {
+    if (hostsim_line(DATA)) {
+        _data_low_since = HOSTSIM_NEVER;
+        return 0;
+    }
+    if (_data_low_since == HOSTSIM_NEVER) {
+        _data_low_since = hostsim_cycles;
+    }
+    return hostsim_cycles - _data_low_since >= HOSTSIM_US(HOST_GAVE_UP_US);
+}
+
+static void _start_receive(void) {
+    _state = RECEIVE_LOW;
+    _bits = 0;
+    _byte = 0;
+    _data_low_since = HOSTSIM_NEVER;
+    _wait_phase_us(kbmodel_timing.receive_high_us);
+}
+
+// The host sent a command rather than wait for the reply.  A transition
+// is only gone once it's been sent, so it goes back on the queue.
+static void _abandon_reply(void) {
+    kbmodel_stats.abandoned++;
+    if (_sending_transition) {
+        _queue_tail = (_queue_tail - 1) & (QUEUE_SIZE - 1);
+    }
+    _sending_transition = 0;
+    _keypad_waiting = 0;
+    _start_receive();
+}
+
+static void _reply(uint8_t byte) {
+    _byte = byte;
+    _state = REPLY;
+    _data_low_since = HOSTSIM_NEVER;
+    _wait_us(kbmodel_timing.reply_delay_us);
+}
+
+// Reply to Inquiry or Instant with the next transition, or the keypad
+// prefix if it's a keypad key.
+static void _reply_transition(void) {
+    uint16_t transition = _queue[_queue_tail];
+
+    if ((transition & KBMODEL_KEYPAD) && !_keypad_waiting) {
+        _keypad_waiting = 1;
+        _sending_transition = 0;
+        _reply(KB_REPLY_KEYPAD);
+        return;
+    }
+    _keypad_waiting = 0;
+    _queue_tail = (_queue_tail + 1) & (QUEUE_SIZE - 1);
+    _sending_transition = 1;
+    _reply(transition & 0xff);
+}
+
+static void _reply_null(void) {
+    _sending_transition = 0;
+    kbmodel_stats.nulls++;
+    _reply(KB_REPLY_NULL);
+}
+
+static void _command(uint8_t command) {
+    kbmodel_stats.commands++;
+
+    switch (command) {
+    case KB_CMD_TRANSITION:
+        if (kbmodel_queued()) {
+            _reply_transition();
+        } else {
+            _state = INQUIRY;
+            _data_low_since = HOSTSIM_NEVER;
+            _deadline = hostsim_cycles + HOSTSIM_MS(kbmodel_timing.inquiry_timeout_ms);
+            _wait_us(POLL_US);
+        }
+        break;
+    case KB_CMD_INSTANT:
+        if (kbmodel_queued()) {
+            _reply_transition();
+        } else {
+            _reply_null();
+        }
+        break;
+    case KB_CMD_MODEL:
+        // the keyboard resets itself first
+        _keypad_waiting = 0;
+        _sending_transition = 0;
+        _reply(MODEL_NUMBER);
+        break;
+    case CMD_TEST:
+        _sending_transition = 0;
+        _reply(TEST_ACK);
+        break;
+    default:
+        kbmodel_stats.unknown_commands++;
+        _state = IDLE;
+        _wait_us(POLL_US);
+        break;
+    }
+}
+
+static void _event(hostsim_device_t *device) {
+    switch (_state) {
+    case IDLE:
+        if (!hostsim_line(DATA)) {
+            _start_receive();
+        } else {
+            _wait_us(POLL_US);
+        }
+        break;
+
+    case RECEIVE_LOW:
+        _drive_clock(0);
+        _state = RECEIVE_HIGH;
+        _wait_phase_us(kbmodel_timing.receive_low_us);
+        break;
+
+    case RECEIVE_HIGH:
+        _drive_clock(1);
+        _byte = (_byte << 1) | hostsim_line(DATA);
+        if (++_bits < 8) {
+            _state = RECEIVE_LOW;
+            _wait_phase_us(kbmodel_timing.receive_high_us);
+        } else {
+            _command(_byte);
+        }
+        break;
+
+    case INQUIRY:
+        if (_host_sending()) {
+            _abandon_reply();
+        } else if (kbmodel_queued()) {
+            _reply_transition();
+        } else if (hostsim_cycles >= _deadline) {
+            _reply_null();
+        } else {
+            _wait_us(POLL_US);
+        }
+        break;
+
+    case REPLY:
+        if (_host_sending()) {
+            _abandon_reply();
+            break;
+        }
+        if (!hostsim_line(DATA)) {
+            // the host hasn't let go yet
+            _wait_us(POLL_US);
+            break;
+        }
+        _bits = 0;
+        hostsim_drive(DATA, (_byte & 0x80) ? HOSTSIM_RELEASE : 0);
+        _state = SEND_LOW;
+        _wait_phase_us(kbmodel_timing.send_high_us);
+        break;
+
+    case SEND_LOW:
+        _drive_clock(0);
+        _state = SEND_HIGH;
+        _wait_phase_us(kbmodel_timing.send_low_us);
+        break;
+
+    case SEND_HIGH:
+        _drive_clock(1);
+        if (++_bits < 8) {
+            hostsim_drive(DATA, ((_byte << _bits) & 0x80) ? HOSTSIM_RELEASE : 0);
+            _state = SEND_LOW;
+            _wait_phase_us(kbmodel_timing.send_high_us);
+            break;
+        }
+        hostsim_drive(DATA, HOSTSIM_RELEASE);
+        kbmodel_stats.replies++;
+        if (_sending_transition) {
+            kbmodel_stats.transitions++;
+        }
+        _state = IDLE;
+        _wait_us(POLL_US);
+        break;
+    }
+}
@@ -0,0 +1,79 @@
+#ifndef KBMODEL_H_
+#define KBMODEL_H_
+
+#include <stdint.h>
+
+// An M0110 keyboard for hostsim, driving the clock (PE7) and data (PB0)
+// lines bit by bit.  It answers Inquiry, Instant, Model and Test the way
+// the keyboard does: Inquiry waits up to 250 ms for a transition before
+// answering null, and a keypad key is sent as the keypad prefix followed
+// by the key itself, in reply to the Instant the host sends next.
+//
+// The keyboard always generates the clock.  To send a command the host
+// pulls data low and the keyboard clocks it in, reading each bit on the
+// rising edge; it replies once the host has released data again,
+// setting each bit before the falling edge.
+//
+// For the stress tests it can also jitter its clock, glitch the clock
+// line, and be unplugged and plugged back in.
+
+// Keys are M0110 transition bytes with bit 7 clear; or in KBMODEL_KEYPAD
+// for keys that come after the keypad prefix.
+#define KBMODEL_KEYPAD 0x100
+
+void kbmodel_attach(void);
+
+// Let go of both lines and stop answering, as if the cable were pulled.
+void kbmodel_disconnect(void);
+
+// Plug back in.  The keyboard starts from power-up: the transitions it
+// hadn't sent yet are lost (and counted in kbmodel_stats.dropped).
+void kbmodel_connect(void);
+
+// Pull the clock low for us microseconds, whatever the keyboard is
+// doing, as noise on the cable might.  Ignored while the clock is low
+// anyway.
+void kbmodel_glitch(uint16_t us);
+
+void kbmodel_press(uint16_t key);
+void kbmodel_release(uint16_t key);
+
+// Transitions waiting to be sent; up to 255 can wait.
+uint16_t kbmodel_queued(void);
+
+// Clock timing, in microseconds.  Change before kbmodel_attach.
+typedef struct {
+    uint16_t send_low_us;       // sending to the host
+    uint16_t send_high_us;
+    uint16_t receive_low_us;    // clocking in a command
+    uint16_t receive_high_us;
+    uint16_t reply_delay_us;    // from the end of a command to the reply
+    uint16_t inquiry_timeout_ms;
+    uint16_t jitter_us;         // each clock phase up to this much shorter or longer, at random
+} kbmodel_timing_t;
+
+extern kbmodel_timing_t kbmodel_timing;
+
+// Scale the clock phases and the reply delay to percent of what they
+// are now: under 100 for a keyboard that runs fast, over for a slow one.
+void kbmodel_scale_timing(uint16_t percent);
+
+// Start the jitter from a different place.  (A run with the same seed
+// is the same every time.)
+void kbmodel_seed(uint32_t seed);
+
+typedef struct {
+    uint32_t commands;          // bytes clocked in, whether or not understood
+    uint32_t unknown_commands;
+    uint32_t replies;           // bytes sent
+    uint32_t transitions;       // transitions sent (a keypad prefix and its key count once)
+    uint32_t nulls;
+    uint32_t abandoned;         // replies given up on because the host sent a command instead
+    uint32_t glitches;
+    uint32_t disconnects;
+    uint32_t dropped;           // transitions lost to a disconnect
+} kbmodel_stats_t;
+
+extern kbmodel_stats_t kbmodel_stats;
+
+#endif
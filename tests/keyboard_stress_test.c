@@ -0,0 +1,425 @@
+// The keyboard link under stress: a jittery clock, a keyboard faster or
+// slower than the usual one, glitches on the clock line, and the cable
+// pulled out and put back.  After each the keys the host sees down must
+// be the ones the keyboard has down: none stuck from before a reset, and
+// none made up from a garbled byte.
+//
+// keyboard_stress_test --bench types at random for a few minutes of
+// simulated time with all of that going on, and reports throughput,
+// stuck keys and how long the link took to recover.
+//
+// The typing, glitches and jitter are the same every run; set
+// KB_STRESS_SEED to another number to try a different run.
+
+#include "testutil.h"
+#include "hostsim.h"
+#include "usbhost.h"
+#include "kbmodel.h"
+
+#include "../src/usb_keyboard.h"
+#include "../src/keymap.h"
+#include "../src/telemetry.h"
+
+#define SCANCODE_A 0x01
+#define SCANCODE_S 0x03
+#define SCANCODE_SHIFT 0x71
+#define SCANCODE_OPTION 0x75
+#define SCANCODE_COMMAND 0x6f
+
+// kbcomm gives up on a byte after 500 ms, then sends Model until the
+// keyboard answers.
+#define LINK_TIMEOUT_MS 500
+
+// The keyboard's side: which keys it has down.
+static uint8_t _down[0x80];
+
+// The main map's keys, modifiers first.
+static uint8_t _keys[0x40];
+static uint8_t _key_count;
+#define MODIFIER_COUNT 3
+
+static uint32_t _random = 12345;
+
+static uint32_t _next_random(void) {
+    _random = _random * 1103515245 + 12345;
+    return _random >> 16;
+}
+
+// Calls to tm_link_recovered, with when each came, so the recovery
+// time is measured the way the device reports it.
+#define RECOVERIES 256
+static uint16_t _recovery_ms[RECOVERIES];
+static uint64_t _recovered_at[RECOVERIES];
+static uint16_t _recoveries;
+
+void __real_tm_link_recovered(uint16_t ms);
+
+void __wrap_tm_link_recovered(uint16_t ms) {
+    if (_recoveries < RECOVERIES) {
+        _recovery_ms[_recoveries] = ms;
+        _recovered_at[_recoveries] = hostsim_cycles;
+        _recoveries++;
+    }
+    __real_tm_link_recovered(ms);
+}
+
+static uint8_t _modifier(uint8_t scancode) {
+    switch (scancode) {
+    case SCANCODE_SHIFT: return MODIFIER_KEY_SHIFT;
+    case SCANCODE_OPTION: return MODIFIER_KEY_ALT;
+    case SCANCODE_COMMAND: return MODIFIER_KEY_GUI;
+    }
+    return 0;
+}
+
+static void _start(uint16_t jitter_us) {
+    _keys[_key_count++] = SCANCODE_SHIFT;
+    _keys[_key_count++] = SCANCODE_OPTION;
+    _keys[_key_count++] = SCANCODE_COMMAND;
+    for (uint8_t scancode = 0x01; scancode < 0x80; scancode += 2) {
+        uint8_t usage = keymap_lookup(AppleScancodeToUSBKey, scancode);
+        if (usage && usage < 128 && !_modifier(scancode)) {
+            _keys[_key_count++] = scancode;
+        }
+    }
+
+    kbmodel_timing.jitter_us = jitter_us;
+    usbhost_attach();
+    kbmodel_attach();
+    hostsim_run(HOSTSIM_MS(20));
+}
+
+static void _press(uint8_t scancode) {
+    kbmodel_press(scancode);
+    _down[scancode] = 1;
+}
+
+static void _release(uint8_t scancode) {
+    kbmodel_release(scancode);
+    _down[scancode] = 0;
+}
+
+static void _release_all(void) {
+    for (uint8_t i = 0; i < _key_count; i++) {
+        if (_down[_keys[i]]) {
+            _release(_keys[i]);
+        }
+    }
+}
+
+// Press or release a key at random, keeping no more than max down.
+static void _random_transition(uint8_t max) {
+    uint8_t held = 0;
+    for (uint8_t i = 0; i < _key_count; i++) {
+        held += _down[_keys[i]];
+    }
+
+    uint8_t scancode = _keys[_next_random() % _key_count];
+    if (_down[scancode]) {
+        _release(scancode);
+    } else if (held < max) {
+        _press(scancode);
+    } else {
+        _release_all();
+    }
+}
+
+// Until the keyboard has sent everything, and it's reached the host.
+static void _drain(void) {
+    while (kbmodel_queued()) {
+        hostsim_run(HOSTSIM_MS(1));
+    }
+    hostsim_run(HOSTSIM_MS(20));
+}
+
+// Keys the host has down that the keyboard doesn't, and the other way
+// round.
+typedef struct {
+    uint8_t stuck;
+    uint8_t missing;
+} _mismatch_t;
+
+static _mismatch_t _compare(void) {
+    _mismatch_t mismatch = { 0, 0 };
+    uint8_t modifiers = 0;
+
+    for (uint8_t i = 0; i < _key_count; i++) {
+        uint8_t scancode = _keys[i];
+        uint8_t host_down;
+        if (_modifier(scancode)) {
+            host_down = !!(usbhost_received.keyboard[0] & _modifier(scancode));
+            modifiers |= _modifier(scancode);
+        } else {
+            host_down = usbhost_key_down(keymap_lookup(AppleScancodeToUSBKey, scancode));
+        }
+        if (host_down && !_down[scancode]) {
+            mismatch.stuck++;
+        } else if (!host_down && _down[scancode]) {
+            mismatch.missing++;
+        }
+    }
+
+    // anything else down was never pressed at all
+    uint8_t host_keys = usbhost_keys_down();
+    for (uint8_t i = MODIFIER_COUNT; i < _key_count; i++) {
+        host_keys -= usbhost_key_down(keymap_lookup(AppleScancodeToUSBKey, _keys[i]));
+    }
+    mismatch.stuck += host_keys;
+    mismatch.stuck += __builtin_popcount(usbhost_received.keyboard[0] & ~modifiers);
+    return mismatch;
+}
+
+#define CHECK_HOST_MATCHES() do { \
+    _mismatch_t _mismatch = _compare(); \
+    CHECK_EQUAL(0, _mismatch.stuck); \
+    CHECK_EQUAL(0, _mismatch.missing); \
+} while (0)
+
+// Type at random, checking every so often: the link keeps up without a
+// reset, and nothing is lost.
+static void _type(uint16_t transitions) {
+    for (uint16_t i = 0; i < transitions; i++) {
+        _random_transition(6);
+        if (i % 50 == 49) {
+            _drain();
+            CHECK_HOST_MATCHES();
+        }
+    }
+    _release_all();
+    _drain();
+
+    CHECK_HOST_MATCHES();
+    CHECK_EQUAL(0, usbhost_keys_down());
+    CHECK_EQUAL(0, tm_counters[TM_COUNTER_LINK_RESETS]);
+    CHECK_EQUAL(0, tm_counters[TM_COUNTER_KB_GLITCHES]);
+    CHECK_EQUAL(0, kbmodel_stats.abandoned);
+}
+
+// Every clock phase up to 50 us shorter or longer than it should be.
+static void jittered_typing(void) {
+    _start(50);
+    _type(2000);
+}
+
+// A keyboard whose clock runs a fifth fast, sending a bit every 264 us
+// give or take 40: still far enough from a glitch.
+static void fast_keyboard(void) {
+    kbmodel_scale_timing(80);
+    _start(20);
+    _type(1000);
+}
+
+// And one a third slow, with a lot of jitter.
+static void slow_keyboard(void) {
+    kbmodel_scale_timing(130);
+    _start(50);
+    _type(1000);
+}
+
+// Keys held down when the cable comes out are released once the link
+// times out, and the keyboard is back soon after it's plugged in again.
+static void unplugged_with_keys_down(void) {
+    _start(0);
+
+    _press(SCANCODE_A);
+    _press(SCANCODE_SHIFT);
+    _drain();
+    CHECK(usbhost_key_down(KEY_A));
+    CHECK_EQUAL(MODIFIER_KEY_SHIFT, usbhost_received.keyboard[0]);
+
+    kbmodel_disconnect();
+    hostsim_run(HOSTSIM_MS(LINK_TIMEOUT_MS + 100));
+    CHECK_EQUAL(0, usbhost_keys_down());
+    CHECK_EQUAL(0, usbhost_received.keyboard[0]);
+    CHECK_EQUAL(1, tm_counters[TM_COUNTER_LINK_RESETS]);
+    CHECK_EQUAL(2, tm_counters[TM_COUNTER_KEYS_RELEASED]);
+
+    // still one outage, however long it lasts
+    hostsim_run(HOSTSIM_MS(3000));
+    CHECK_EQUAL(1, tm_counters[TM_COUNTER_LINK_RESETS]);
+    CHECK_EQUAL(0, _recoveries);
+
+    // the keyboard powers up with nothing down
+    _down[SCANCODE_A] = 0;
+    _down[SCANCODE_SHIFT] = 0;
+    uint64_t connected = hostsim_cycles;
+    kbmodel_connect();
+    _press(SCANCODE_S);
+    while (!usbhost_key_down(KEY_S)) {
+        CHECK(hostsim_cycles - connected < HOSTSIM_MS(2 * LINK_TIMEOUT_MS));
+        hostsim_run(HOSTSIM_MS(1));
+    }
+    CHECK_HOST_MATCHES();
+
+    // reported from the first failure to the keyboard answering
+    CHECK_EQUAL(1, _recoveries);
+    CHECK(_recovery_ms[0] >= 3000 + 100);
+    CHECK(_recovered_at[0] - connected < HOSTSIM_MS(LINK_TIMEOUT_MS + 50));
+}
+
+// A glitch on the clock line at any point in a byte, while keys go up
+// and down: once the keyboard has let go of everything, so has the
+// host.
+static void _glitches(void) {
+    for (uint16_t i = 0; i < 200; i++) {
+        _random_transition(4);
+        _random_transition(4);
+        hostsim_run(HOSTSIM_US(_next_random() % 5000));
+        kbmodel_glitch(1 + _next_random() % 20);
+        hostsim_run(HOSTSIM_MS(2 * LINK_TIMEOUT_MS));
+        _drain();
+        CHECK_EQUAL(0, _compare().stuck);
+    }
+    _release_all();
+    _drain();
+
+    CHECK(kbmodel_stats.glitches > 60);
+    CHECK_HOST_MATCHES();
+    CHECK_EQUAL(0, usbhost_keys_down());
+    CHECK_EQUAL(0, usbhost_received.keyboard[0]);
+}
+
+static void glitches_leave_nothing_stuck(void) {
+    _start(0);
+    _glitches();
+}
+
+static void glitches_on_fast_keyboard(void) {
+    kbmodel_scale_timing(80);
+    _start(20);
+    _glitches();
+}
+
+static test_t const _tests[] = {
+    TEST(jittered_typing),
+    TEST(fast_keyboard),
+    TEST(slow_keyboard),
+    TEST(unplugged_with_keys_down),
+    TEST(glitches_leave_nothing_stuck),
+    TEST(glitches_on_fast_keyboard),
+};
+
+#define BENCH_SECONDS 300
+#define BENCH_GLITCH_EVERY_MS 1500
+#define BENCH_UNPLUG_EVERY_MS 20000
+#define BENCH_UNPLUGGED_MS 800
+
+static void _bench(void) {
+    _start(50);
+
+    uint64_t end = hostsim_cycles + HOSTSIM_MS(BENCH_SECONDS * 1000UL);
+    uint64_t next_glitch = hostsim_cycles + HOSTSIM_MS(BENCH_GLITCH_EVERY_MS);
+    uint64_t next_unplug = hostsim_cycles + HOSTSIM_MS(BENCH_UNPLUG_EVERY_MS);
+    uint64_t replugged_at[RECOVERIES];
+    uint16_t replugs = 0;
+    uint32_t stuck = 0, missing = 0, checks = 0;
+    uint64_t cycles_before = hostsim_cycles;
+
+    while (hostsim_cycles < end) {
+        while (kbmodel_queued() < 8) {
+            _random_transition(6);
+        }
+        hostsim_run(HOSTSIM_MS(1));
+
+        if (hostsim_cycles >= next_glitch) {
+            kbmodel_glitch(1 + _next_random() % 20);
+            next_glitch += HOSTSIM_MS(BENCH_GLITCH_EVERY_MS / 2 + _next_random() % BENCH_GLITCH_EVERY_MS);
+        }
+
+        if (hostsim_cycles >= next_unplug) {
+            // check what the host has down first, and after the keyboard
+            // is back, since it has nothing down then
+            _drain();
+            _mismatch_t mismatch = _compare();
+            stuck += mismatch.stuck;
+            missing += mismatch.missing;
+            checks++;
+
+            kbmodel_disconnect();
+            hostsim_run(HOSTSIM_MS(BENCH_UNPLUGGED_MS));
+            memset(_down, 0, sizeof(_down));
+            kbmodel_connect();
+            if (replugs < RECOVERIES) {
+                replugged_at[replugs++] = hostsim_cycles;
+            }
+            next_unplug += HOSTSIM_MS(BENCH_UNPLUG_EVERY_MS);
+        }
+    }
+    _release_all();
+    _drain();
+    _mismatch_t mismatch = _compare();
+    stuck += mismatch.stuck;
+    missing += mismatch.missing;
+    checks++;
+
+    double seconds = (double)(hostsim_cycles - cycles_before) / HOSTSIM_US(1000000);
+
+    // Recovery from a glitch is the firmware's own figure.  After the
+    // cable's been out, it's from plugging it back in.
+    uint32_t glitch_max = 0, glitch_total = 0, glitch_count = 0;
+    uint32_t replug_max = 0, replug_total = 0, replug_count = 0;
+    for (uint16_t i = 0; i < _recoveries; i++) {
+        uint8_t after_replug = 0;
+        for (uint16_t j = 0; j < replugs; j++) {
+            if (_recovered_at[i] >= replugged_at[j] &&
+                _recovered_at[i] - replugged_at[j] < HOSTSIM_MS(_recovery_ms[i])) {
+                after_replug = 1;
+                uint32_t ms = (_recovered_at[i] - replugged_at[j]) / HOSTSIM_MS(1);
+                replug_total += ms;
+                replug_count++;
+                if (ms > replug_max) {
+                    replug_max = ms;
+                }
+            }
+        }
+        if (!after_replug) {
+            glitch_total += _recovery_ms[i];
+            glitch_count++;
+            if (_recovery_ms[i] > glitch_max) {
+                glitch_max = _recovery_ms[i];
+            }
+        }
+    }
+
+    printf("simulated time:         %.1f s\n", seconds);
+    printf("transitions sent:       %u\n", kbmodel_stats.transitions);
+    printf("transitions/s (sim):    %.1f\n", kbmodel_stats.transitions / seconds);
+    printf("transitions dropped:    %u (keyboard unplugged)\n", kbmodel_stats.dropped);
+    printf("glitches:               %u\n", kbmodel_stats.glitches);
+    printf("unplugged:              %u times\n", kbmodel_stats.disconnects);
+    printf("glitches caught:        %u\n", tm_counters[TM_COUNTER_KB_GLITCHES]);
+    printf("link resets:            %u\n", tm_counters[TM_COUNTER_LINK_RESETS]);
+    printf("keys released by reset: %u\n", tm_counters[TM_COUNTER_KEYS_RELEASED]);
+    printf("replies abandoned:      %u\n", kbmodel_stats.abandoned);
+    printf("stuck keys:             %u (in %u checks)\n", stuck, checks);
+    printf("missing keys:           %u\n", missing);
+    if (glitch_count) {
+        printf("recovery after glitch:  %u ms max, %u ms mean (%u)\n",
+               glitch_max, glitch_total / glitch_count, glitch_count);
+    }
+    if (replug_count) {
+        printf("recovery after replug:  %u ms max, %u ms mean (%u)\n",
+               replug_max, replug_total / replug_count, replug_count);
+    }
+
+    CHECK_EQUAL(0, stuck);
+    CHECK_EQUAL(0, usbhost_keys_down());
+    CHECK(_recoveries < RECOVERIES);
+    CHECK_EQUAL(kbmodel_stats.disconnects, replug_count);
+    CHECK(glitch_max < 3 * LINK_TIMEOUT_MS);
+    CHECK(replug_max < LINK_TIMEOUT_MS + 50);
+}
+
+int main(int argc, char **argv) {
+    char const *seed = getenv("KB_STRESS_SEED");
+    if (seed) {
+        _random = strtoul(seed, NULL, 0);
+        kbmodel_seed(_random);
+    }
+
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+        _bench();
+        return 0;
+    }
+    return test_run_all(_tests, sizeof(_tests) / sizeof(_tests[0]), argc, argv);
+}
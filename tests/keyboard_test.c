@@ -0,0 +1,330 @@
+// The keyboard path end to end: kbmodel clocks scancodes in bit by bit
+// through INT7_vect, kbcomm and kbglue turn them into key bits, and
+// usbhost reads the reports off the keyboard endpoint.
+//
+// keyboard_test --bench types as fast as the keyboard can send and
+// reports transitions per second, in simulated time and on this
+// machine, and how long each ISR kept the others waiting.
+
+#include "testutil.h"
+#include "hostsim.h"
+#include "usbhost.h"
+#include "kbmodel.h"
+
+#include "../src/usb_keyboard.h"
+#include "../src/keymap.h"
+#include "../src/telemetry.h"
+#include "../src/kbcomm.h"
+
+#include <time.h>
+
+#define SCANCODE_A 0x01
+#define SCANCODE_S 0x03
+#define SCANCODE_D 0x05
+#define SCANCODE_SHIFT 0x71
+#define SCANCODE_OPTION 0x75
+#define SCANCODE_COMMAND 0x6f
+
+#define SCANCODE_KEYPAD_PERIOD 0x03
+#define SCANCODE_KEYPAD_RIGHT 0x05 // keypad * with shift
+
+// must match usb_keyboard.c
+#define KEYBOARD_INTERFACE 0
+#define HID_SET_PROTOCOL 0x0B
+
+static void _start(void) {
+    usbhost_attach();
+    kbmodel_attach();
+    // Model, then into the inquiry loop
+    hostsim_run(HOSTSIM_MS(20));
+}
+
+// Long enough for a queued transition to reach the host.
+static void _settle(void) {
+    hostsim_run(HOSTSIM_MS(20));
+}
+
+// Until the keyboard has sent everything, and it's reached the host.
+static void _drain(void) {
+    while (kbmodel_queued()) {
+        hostsim_run(HOSTSIM_MS(1));
+    }
+    _settle();
+}
+
+static uint8_t _key_bit(uint8_t usage) {
+    return (keyboard_key_bits[usage >> 3] >> (usage & 7)) & 1;
+}
+
+static void starts_with_model_then_inquiry(void) {
+    _start();
+
+    CHECK(kbmodel_stats.commands >= 2);
+    CHECK_EQUAL(0, kbmodel_stats.unknown_commands);
+    CHECK(kb_busy());
+    // a command and its reply, every bit an interrupt, plus the rising
+    // edge that ends each byte
+    CHECK(hostsim_isr_calls[HOSTSIM_INT7] >= 2 * 9);
+    CHECK(usb_configured());
+}
+
+static void press_and_release(void) {
+    _start();
+
+    kbmodel_press(SCANCODE_A);
+    _settle();
+    CHECK(_key_bit(KEY_A));
+    CHECK(usbhost_key_down(KEY_A));
+    CHECK_EQUAL(1, usbhost_keys_down());
+
+    kbmodel_release(SCANCODE_A);
+    _settle();
+    CHECK(!_key_bit(KEY_A));
+    CHECK_EQUAL(0, usbhost_keys_down());
+    CHECK_EQUAL(2, kbmodel_stats.transitions);
+}
+
+static void several_keys_down(void) {
+    _start();
+
+    kbmodel_press(SCANCODE_A);
+    kbmodel_press(SCANCODE_S);
+    kbmodel_press(SCANCODE_D);
+    _settle();
+    CHECK(_key_bit(KEY_A) && _key_bit(KEY_S) && _key_bit(KEY_D));
+    CHECK_EQUAL(3, usbhost_keys_down());
+
+    kbmodel_release(SCANCODE_S);
+    _settle();
+    CHECK(_key_bit(KEY_A) && !_key_bit(KEY_S) && _key_bit(KEY_D));
+    CHECK(usbhost_key_down(KEY_A) && !usbhost_key_down(KEY_S) && usbhost_key_down(KEY_D));
+}
+
+static void modifiers(void) {
+    _start();
+
+    kbmodel_press(SCANCODE_SHIFT);
+    kbmodel_press(SCANCODE_OPTION);
+    kbmodel_press(SCANCODE_COMMAND);
+    _settle();
+    CHECK_EQUAL(MODIFIER_KEY_SHIFT | MODIFIER_KEY_ALT | MODIFIER_KEY_GUI, keyboard_modifier_keys);
+    CHECK_EQUAL(MODIFIER_KEY_SHIFT | MODIFIER_KEY_ALT | MODIFIER_KEY_GUI, usbhost_received.keyboard[0]);
+    // modifiers aren't keys
+    CHECK_EQUAL(0, usbhost_keys_down());
+
+    kbmodel_release(SCANCODE_OPTION);
+    _settle();
+    CHECK_EQUAL(MODIFIER_KEY_SHIFT | MODIFIER_KEY_GUI, keyboard_modifier_keys);
+    CHECK_EQUAL(MODIFIER_KEY_SHIFT | MODIFIER_KEY_GUI, usbhost_received.keyboard[0]);
+}
+
+static void keypad(void) {
+    _start();
+
+    kbmodel_press(KBMODEL_KEYPAD | SCANCODE_KEYPAD_PERIOD);
+    _settle();
+    CHECK(_key_bit(KEYPAD_PERIOD));
+    CHECK(usbhost_key_down(KEYPAD_PERIOD));
+    // the keypad prefix isn't a key
+    CHECK(!_key_bit(keymap_lookup(AppleScancodeToUSBKey, SCANCODE_KEYPAD_PERIOD)));
+
+    kbmodel_release(KBMODEL_KEYPAD | SCANCODE_KEYPAD_PERIOD);
+    _settle();
+    CHECK_EQUAL(0, usbhost_keys_down());
+}
+
+static void shifted_keypad(void) {
+    _start();
+
+    kbmodel_press(SCANCODE_SHIFT);
+    kbmodel_press(KBMODEL_KEYPAD | SCANCODE_KEYPAD_RIGHT);
+    _settle();
+    CHECK(_key_bit(KEYPAD_ASTERIX));
+    CHECK(!_key_bit(KEY_RIGHT));
+    // shift is taken off for the shifted keypad key, then put back
+    CHECK_EQUAL(MODIFIER_KEY_SHIFT, keyboard_modifier_keys);
+
+    // released from the shifted map even though shift is up by then
+    kbmodel_release(SCANCODE_SHIFT);
+    kbmodel_release(KBMODEL_KEYPAD | SCANCODE_KEYPAD_RIGHT);
+    _settle();
+    CHECK_EQUAL(0, keyboard_modifier_keys);
+    CHECK_EQUAL(0, usbhost_keys_down());
+}
+
+static void even_scancodes_ignored(void) {
+    _start();
+
+    kbmodel_press(0x02);
+    _settle();
+    CHECK_EQUAL(0, usbhost_keys_down());
+    CHECK_EQUAL(1, tm_counters[TM_COUNTER_UNKNOWN_SCANCODES]);
+}
+
+// Every key on the keyboard, pressed and released in overlapping
+// pairs, faster than the scancode queue can be drained.
+static void scancode_stream(void) {
+    _start();
+
+    uint32_t sent = 0;
+    for (uint8_t scancode = 0x01; scancode < 0x80; scancode += 2) {
+        uint8_t usage = keymap_lookup(AppleScancodeToUSBKey, scancode);
+        if (!usage) {
+            continue;
+        }
+        kbmodel_press(scancode);
+        if (scancode > 0x01) {
+            kbmodel_release(scancode - 2);
+        }
+        sent += 2;
+        while (kbmodel_queued() > 32) {
+            hostsim_run(HOSTSIM_MS(1));
+        }
+    }
+    for (uint8_t scancode = 0x01; scancode < 0x80; scancode += 2) {
+        kbmodel_release(scancode);
+    }
+    while (kbmodel_queued()) {
+        hostsim_run(HOSTSIM_MS(1));
+    }
+    _settle();
+
+    CHECK(kbmodel_stats.transitions >= sent);
+    CHECK_EQUAL(0, keyboard_modifier_keys);
+    CHECK_EQUAL(0, usbhost_keys_down());
+    CHECK_EQUAL(0, usbhost_received.keyboard[0]);
+    CHECK_EQUAL(0, tm_counters[TM_COUNTER_LINK_RESETS]);
+}
+
+// A host that selects the boot protocol gets the 8-byte report: the
+// keys themselves while there are six or fewer, ErrorRollOver in every
+// slot once there are more.
+static void boot_protocol_rollover(void) {
+    uint8_t scancodes[7];
+    uint8_t usages[7];
+
+    _start();
+    usbhost_control(0x21, HID_SET_PROTOCOL, 0, KEYBOARD_INTERFACE, NULL, 0);
+
+    for (uint8_t i = 0; i < 7; i++) {
+        scancodes[i] = 0x01 + 2 * i;
+        usages[i] = keymap_lookup(AppleScancodeToUSBKey, scancodes[i]);
+        CHECK(usages[i] > KEY_ERROR_ROLLOVER);
+    }
+
+    kbmodel_press(SCANCODE_SHIFT);
+    for (uint8_t i = 0; i < 6; i++) {
+        kbmodel_press(scancodes[i]);
+    }
+    _drain();
+    CHECK(usbhost_received.keyboard_boot_reports > 0);
+    CHECK_EQUAL(0, usbhost_received.keyboard_reports);
+    CHECK_EQUAL(MODIFIER_KEY_SHIFT, usbhost_received.keyboard_boot[0]);
+    CHECK_EQUAL(0, usbhost_received.keyboard_boot[1]);
+    for (uint8_t i = 0; i < 6; i++) {
+        uint8_t found = 0;
+        for (uint8_t j = 2; j < USBHOST_KEYBOARD_BOOT_REPORT_SIZE; j++) {
+            found |= (usbhost_received.keyboard_boot[j] == usages[i]);
+        }
+        CHECK(found);
+    }
+
+    kbmodel_press(scancodes[6]);
+    _drain();
+    CHECK_EQUAL(MODIFIER_KEY_SHIFT, usbhost_received.keyboard_boot[0]);
+    CHECK_EQUAL(0, usbhost_received.keyboard_boot[1]);
+    for (uint8_t j = 2; j < USBHOST_KEYBOARD_BOOT_REPORT_SIZE; j++) {
+        CHECK_EQUAL(KEY_ERROR_ROLLOVER, usbhost_received.keyboard_boot[j]);
+    }
+
+    // back to the keys once one is let go
+    kbmodel_release(scancodes[0]);
+    _drain();
+    for (uint8_t j = 2; j < USBHOST_KEYBOARD_BOOT_REPORT_SIZE; j++) {
+        CHECK(usbhost_received.keyboard_boot[j] != KEY_ERROR_ROLLOVER);
+        CHECK(usbhost_received.keyboard_boot[j] != usages[0]);
+    }
+
+    for (uint8_t i = 1; i < 7; i++) {
+        kbmodel_release(scancodes[i]);
+    }
+    kbmodel_release(SCANCODE_SHIFT);
+    _drain();
+    CHECK_EQUAL(0, usbhost_received.keyboard_reports);
+    for (uint8_t j = 0; j < USBHOST_KEYBOARD_BOOT_REPORT_SIZE; j++) {
+        CHECK_EQUAL(0, usbhost_received.keyboard_boot[j]);
+    }
+}
+
+static test_t const _tests[] = {
+    TEST(starts_with_model_then_inquiry),
+    TEST(press_and_release),
+    TEST(several_keys_down),
+    TEST(modifiers),
+    TEST(keypad),
+    TEST(shifted_keypad),
+    TEST(even_scancodes_ignored),
+    TEST(scancode_stream),
+    TEST(boot_protocol_rollover),
+};
+
+#define BENCH_TRANSITIONS 20000
+
+static void _bench(void) {
+    _start();
+    uint32_t transitions_before = kbmodel_stats.transitions;
+    uint64_t cycles_before = hostsim_cycles;
+    clock_t clock_before = clock();
+
+    for (uint32_t i = 0; i < BENCH_TRANSITIONS / 2; i++) {
+        kbmodel_press(SCANCODE_A);
+        kbmodel_release(SCANCODE_A);
+        while (kbmodel_queued() > 16) {
+            hostsim_run(HOSTSIM_MS(1));
+        }
+    }
+    while (kbmodel_queued()) {
+        hostsim_run(HOSTSIM_MS(1));
+    }
+    _settle();
+
+    double seconds = (double)(hostsim_cycles - cycles_before) / HOSTSIM_US(1000000);
+    double host_seconds = (double)(clock() - clock_before) / CLOCKS_PER_SEC;
+    uint32_t transitions = kbmodel_stats.transitions - transitions_before;
+
+    printf("transitions:           %u\n", transitions);
+    printf("simulated time:        %.3f s\n", seconds);
+    printf("transitions/s (sim):   %.1f\n", transitions / seconds);
+    printf("transitions/s (host):  %.0f\n", transitions / host_seconds);
+    printf("keyboard reports:      %u\n", usbhost_received.keyboard_reports);
+#ifdef KB_ISR_INQUIRY_LOOP
+    printf("scancode queue stalls: %u\n", kb_scancode_stalls());
+#endif
+    printf("\n");
+    hostsim_print_isr_report();
+
+    // INT7 reads (or sets) each bit at a clock edge, so it has to run
+    // well within the shortest time the clock holds still.
+    uint16_t shortest_phase_us = kbmodel_timing.send_low_us;
+    if (kbmodel_timing.receive_low_us < shortest_phase_us) {
+        shortest_phase_us = kbmodel_timing.receive_low_us;
+    }
+    // The main loop's cli sections don't take any time here, so the
+    // longest of them is added on.
+    double int7_wait_us = (double)(hostsim_isr_max_wait[HOSTSIM_INT7] + hostsim_cli_cycles) /
+                          HOSTSIM_CYCLES_PER_US;
+    printf("\nINT7 waited up to %.1f us, with the longest cli section; the keyboard clock holds still for %u us\n",
+           int7_wait_us, shortest_phase_us);
+
+    CHECK_EQUAL(BENCH_TRANSITIONS, transitions);
+    CHECK_EQUAL(0, usbhost_keys_down());
+    CHECK(int7_wait_us < shortest_phase_us / 2);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+        _bench();
+        return 0;
+    }
+    return test_run_all(_tests, sizeof(_tests) / sizeof(_tests[0]), argc, argv);
+}
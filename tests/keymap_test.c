@@ -0,0 +1,509 @@
+// keymap_lookup against the keymaps as they were before they moved to
+// flash: full 128-entry tables, indexed by the whole scancode.  Every
+// scancode, odd or even, must look up the same usage in each map.
+
+#include "testutil.h"
+
+#include "../src/keymap.h"
+#include "../src/usb_keyboard.h"
+
+static uint8_t const OriginalAppleScancodeToUSBKey[128] = {
+    0,
+    KEY_A,
+    0,
+    KEY_S,
+    0,
+    KEY_D,
+    0,
+    KEY_F,
+    0,
+    KEY_H,
+    0,
+    KEY_G,
+    0,
+    KEY_Z,
+    0,
+    KEY_X,
+
+    // 0x10
+
+    0,
+    KEY_C,
+    0,
+    KEY_V,
+    0,
+    0,
+    0,
+    KEY_B,
+    0,
+    KEY_Q,
+    0,
+    KEY_W,
+    0,
+    KEY_E,
+    0,
+    KEY_R,
+    
+    // 0x20
+
+    0,
+    KEY_Y,
+    0,
+    KEY_T,
+    0,
+    KEY_1,
+    0,
+    KEY_2,
+    0,
+    KEY_3,
+    0,
+    KEY_4,
+    0,
+    KEY_6,
+    0,
+    KEY_5,
+    
+    // 0x30
+
+    0,
+    KEY_EQUAL,
+    0,
+    KEY_9,
+    0,
+    KEY_7,
+    0,
+    KEY_MINUS,
+    0,
+    KEY_8,
+    0,
+    KEY_0,
+    0,
+    KEY_RIGHT_BRACE,
+    0,
+    KEY_O,
+    
+    // 0x40
+
+    0,
+    KEY_U,
+    0,
+    KEY_LEFT_BRACE,
+    0,
+    KEY_I,
+    0,
+    KEY_P,
+    0,
+    KEY_ENTER,
+    0,
+    KEY_L,
+    0,
+    KEY_J,
+    0,
+    KEY_QUOTE,
+    
+    // 0x50
+
+    0,
+    KEY_K,
+    0,
+    KEY_SEMICOLON,
+    0,
+    KEY_BACKSLASH,
+    0,
+    KEY_COMMA,
+    0,
+    KEY_SLASH,
+    0,
+    KEY_N,
+    0,
+    KEY_M,
+    0,
+    KEY_PERIOD,
+    
+    // 0x60
+
+    0,
+    KEY_TAB,
+    0,
+    KEY_SPACE,
+    0,
+    KEY_TILDE,
+    0,
+    KEY_BACKSPACE,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0, // command
+    
+    // 0x70
+
+    0,
+    0, // shift
+    0,
+    KEY_CAPS_LOCK,
+    0,
+    0, // option
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,    
+};
+
+static uint8_t const OriginalAppleKeypadScancodeToUSBKey[128] = {
+    0,
+    0,
+    0,
+    KEYPAD_PERIOD,
+    0,
+    KEY_RIGHT,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    KEY_LEFT,
+    0,
+    KEY_NUM_LOCK,
+
+    // 0x10
+    
+    0,
+    KEY_DOWN,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    KEYPAD_ENTER,
+    0,
+    KEY_UP,
+    0,
+    KEYPAD_MINUS,
+    0,
+    0,
+
+    // 0x20
+    
+    0,
+    0,
+    0,
+    0,
+    0,
+    KEYPAD_0,
+    0,
+    KEYPAD_1,
+    0,
+    KEYPAD_2,
+    0,
+    KEYPAD_3,
+    0,
+    KEYPAD_4,
+    0,
+    KEYPAD_5,
+
+    // 0x30
+    
+    0,
+    KEYPAD_6,
+    0,
+    KEYPAD_7,
+    0,
+    0,
+    0,
+    KEYPAD_8,
+    0,
+    KEYPAD_9,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+
+    // 0x40
+    
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+
+    // 0x50
+    
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+
+    // 0x60
+    
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+
+    // 0x70
+    
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+};
+
+static uint8_t const OriginalAppleShiftedKeypadScancodeToUSBKey[128] = {
+    // 0x00
+    
+    0,
+    0,
+    0,
+    0,
+    0,
+    KEYPAD_ASTERIX,
+    0,
+    0,
+    0,
+    0,
+    0,
+    KEYPAD_PLUS,
+    0,
+    0,
+    0,
+    0,
+
+    // 0x10
+    
+    0,
+    KEY_EQUAL,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    KEYPAD_SLASH,
+    0,
+    0,
+    0,
+    0,
+
+    // 0x20
+    
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+
+    // 0x30
+    
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+
+    // 0x40
+    
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+
+    // 0x50
+    
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+
+    // 0x60
+    
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+
+    // 0x70
+    
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+    0,
+
+};
+
+typedef struct {
+    char const *name;
+    uint8_t const *original;
+    uint8_t const *keymap;
+} _keymap_pair_t;
+
+static _keymap_pair_t const _keymaps[] = {
+    { "main", OriginalAppleScancodeToUSBKey, AppleScancodeToUSBKey },
+    { "keypad", OriginalAppleKeypadScancodeToUSBKey, AppleKeypadScancodeToUSBKey },
+    { "shifted keypad", OriginalAppleShiftedKeypadScancodeToUSBKey, AppleShiftedKeypadScancodeToUSBKey },
+};
+
+static void lookup_matches_original_tables(void) {
+    for (uint8_t i = 0; i < sizeof(_keymaps) / sizeof(_keymaps[0]); i++) {
+        for (uint16_t scancode = 0; scancode < 128; scancode++) {
+            uint8_t expected = _keymaps[i].original[scancode];
+            uint8_t actual = keymap_lookup(_keymaps[i].keymap, scancode);
+            if (expected != actual) {
+                fprintf(stderr, "%s keymap, scancode 0x%02x: expected %u, got %u\n",
+                        _keymaps[i].name, scancode, expected, actual);
+                exit(1);
+            }
+        }
+    }
+}
+
+// The compaction relies on this.
+static void even_scancodes_unmapped(void) {
+    for (uint8_t i = 0; i < sizeof(_keymaps) / sizeof(_keymaps[0]); i++) {
+        for (uint8_t scancode = 0; scancode < 128; scancode += 2) {
+            CHECK_EQUAL(0, _keymaps[i].original[scancode]);
+        }
+    }
+}
+
+static test_t const _tests[] = {
+    TEST(lookup_matches_original_tables),
+    TEST(even_scancodes_unmapped),
+};
+
+TEST_MAIN(_tests)
@@ -0,0 +1,79 @@
+// Media reports: every usb_media_send is a report the host gets, in
+// order, however soon the next one follows.
+
+#include "testutil.h"
+#include "hostsim.h"
+#include "usbhost.h"
+
+#include "../src/usb_keyboard.h"
+
+#define MEDIA_ENDPOINT 4
+#define KEY_VOLUME_UP 0xe9
+#define KEY_PLAYPAUSE 0xcd
+
+#define HISTORY 16
+static uint16_t _seen[HISTORY];
+static uint8_t _seen_count;
+
+static void _record(uint8_t endpoint, uint8_t const *report, uint8_t length) {
+    if (endpoint == MEDIA_ENDPOINT && _seen_count < HISTORY) {
+        _seen[_seen_count++] = report[0] | (report[1] << 8);
+    }
+}
+
+static void _start(void) {
+    usbhost_report_hook = _record;
+    usbhost_attach();
+    hostsim_run(HOSTSIM_MS(5));
+}
+
+static void press_then_release(void) {
+    _start();
+
+    CHECK_EQUAL(0, usb_media_press(KEY_VOLUME_UP));
+    hostsim_run(HOSTSIM_MS(5));
+
+    CHECK_EQUAL(2, _seen_count);
+    CHECK_EQUAL(KEY_VOLUME_UP, _seen[0]);
+    CHECK_EQUAL(0, _seen[1]);
+    CHECK_EQUAL(0, usb_media_tx_stats.overruns);
+}
+
+static void presses_in_a_row(void) {
+    _start();
+
+    usb_media_press(KEY_VOLUME_UP);
+    usb_media_press(KEY_PLAYPAUSE);
+    hostsim_run(HOSTSIM_MS(10));
+
+    CHECK_EQUAL(4, _seen_count);
+    CHECK_EQUAL(KEY_VOLUME_UP, _seen[0]);
+    CHECK_EQUAL(0, _seen[1]);
+    CHECK_EQUAL(KEY_PLAYPAUSE, _seen[2]);
+    CHECK_EQUAL(0, _seen[3]);
+}
+
+// More than the queue holds: the newest report is replaced, so the
+// host still ends up with the current state.
+static void overrun_keeps_latest(void) {
+    _start();
+
+    for (uint16_t key = 1; key <= 10; key++) {
+        media_keys[0] = key;
+        usb_media_send();
+    }
+    hostsim_run(HOSTSIM_MS(10));
+
+    CHECK(usb_media_tx_stats.overruns > 0);
+    CHECK(_seen_count < 10);
+    CHECK_EQUAL(10, _seen[_seen_count - 1]);
+    CHECK_EQUAL(10, usbhost_received.media[0]);
+}
+
+static test_t const _tests[] = {
+    TEST(press_then_release),
+    TEST(presses_in_a_row),
+    TEST(overrun_keeps_latest),
+};
+
+TEST_MAIN(_tests)
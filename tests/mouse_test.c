@@ -0,0 +1,281 @@
+// The mouse path end to end: quadgen drives the phase pins, the INT0-3
+// ISRs decode the edges into counts, the main loop takes them and
+// accelerates them, and usbhost adds up the reports.  What reaches
+// ma_apply must be the generator's position exactly, and what leaves
+// it must be what the host got.
+//
+// mouse_test --bench sweeps the edge rate up from a slow hand to far
+// past what the mouse can do, and reports the counts lost and the
+// report rate at each, then runs an accelerating profile with bounce
+// and phase noise.
+
+#include "testutil.h"
+#include "hostsim.h"
+#include "usbhost.h"
+#include "quadgen.h"
+
+#include "../src/mouseaccel.h"
+#include "../src/telemetry.h"
+
+// What went through ma_apply, per axis.  mg_mouse_motion applies X
+// first, so the first axis seen is X.
+typedef struct {
+    ma_axis_t *axis;
+    int32_t counts;
+    int32_t movement;
+} _applied_t;
+
+static _applied_t _applied_x, _applied_y;
+
+int16_t __real_ma_apply(ma_axis_t *axis, int16_t counts, uint32_t now);
+
+int16_t __wrap_ma_apply(ma_axis_t *axis, int16_t counts, uint32_t now) {
+    if (!_applied_x.axis) {
+        _applied_x.axis = axis;
+    }
+    _applied_t *applied = (axis == _applied_x.axis) ? &_applied_x : &_applied_y;
+    int16_t movement = __real_ma_apply(axis, counts, now);
+    applied->counts += counts;
+    applied->movement += movement;
+    return movement;
+}
+
+static int32_t _rate_x, _rate_y;
+static int32_t _steady_x(uint32_t ms) { return _rate_x; }
+static int32_t _steady_y(uint32_t ms) { return _rate_y; }
+
+// Sweeps back and forth, up to 8000 counts/s and back to rest every
+// half second.
+static int32_t _swing(uint32_t ms) {
+    int32_t phase = ms % 1000;
+    int32_t speed = (phase < 250) ? phase * 32 : (phase < 500) ? (500 - phase) * 32 : 0;
+    return (ms % 2000 < 1000) ? speed : -speed;
+}
+
+static void _start(void) {
+    quadgen_attach();
+    usbhost_attach();
+    hostsim_run(HOSTSIM_MS(5));
+}
+
+// Run for ms, then stop and let the last counts reach the host.  Run a
+// millisecond at a time, so that at edge rates the ISRs can't keep up
+// with the main loop still gets a look in.
+static void _move(uint32_t ms) {
+    quadgen_start();
+    for (uint32_t i = 0; i < ms; i++) {
+        hostsim_run(HOSTSIM_MS(1));
+    }
+    quadgen_stop();
+    hostsim_run(HOSTSIM_MS(10));
+}
+
+#define CHECK_NOTHING_LOST() do { \
+    CHECK_EQUAL(quadgen_x.position, _applied_x.counts); \
+    CHECK_EQUAL(quadgen_y.position, _applied_y.counts); \
+    CHECK_EQUAL(_applied_x.movement, usbhost_received.mouse_x); \
+    CHECK_EQUAL(_applied_y.movement, usbhost_received.mouse_y); \
+    CHECK_EQUAL(0, tm_counters[TM_COUNTER_QUADRATURE_ERRORS]); \
+} while (0)
+
+// Y wired the other way round comes out the same way as X.
+static void diagonal(void) {
+    _start();
+    _rate_x = 2000;
+    _rate_y = 2000;
+    quadgen_x.rate = _steady_x;
+    quadgen_y.rate = _steady_y;
+    _move(500);
+
+    CHECK(quadgen_x.position >= 999);
+    CHECK_NOTHING_LOST();
+    CHECK(usbhost_received.mouse_x > 0);
+    CHECK_EQUAL(usbhost_received.mouse_x, usbhost_received.mouse_y);
+}
+
+static void back_and_forth(void) {
+    _start();
+    quadgen_x.rate = _swing;
+    _rate_y = -300;
+    quadgen_y.rate = _steady_y;
+    _move(4000);
+
+    CHECK(quadgen_x.edges > 4000);
+    CHECK(quadgen_y.position < -1000);
+    CHECK_NOTHING_LOST();
+}
+
+// Each edge chatters three times over 15 us; the ISRs read the pins
+// rather than count edges, so it all cancels out.
+static void bounce_cancels_out(void) {
+    _start();
+    quadgen_x.rate = _swing;
+    quadgen_x.bounces = 3;
+    quadgen_x.bounce_us = 5;
+    quadgen_y.rate = _swing;
+    quadgen_y.bounces = 3;
+    quadgen_y.bounce_us = 5;
+    _move(2000);
+
+    CHECK(quadgen_x.edges > 2000);
+    CHECK_NOTHING_LOST();
+}
+
+// The two phases' edges as much as a third of the way towards each
+// other.
+static void phase_noise(void) {
+    _start();
+    _rate_x = 3000;
+    quadgen_x.rate = _steady_x;
+    quadgen_x.phase_noise_us = 110;
+    _rate_y = -3000;
+    quadgen_y.rate = _steady_y;
+    quadgen_y.phase_noise_us = 110;
+    _move(1000);
+
+    CHECK(quadgen_x.edges >= 2999);
+    CHECK_NOTHING_LOST();
+}
+
+// Counts are coalesced into one report per frame, however fast they
+// come.
+static void one_report_per_frame(void) {
+    _start();
+    _rate_x = 20000;
+    quadgen_x.rate = _steady_x;
+    uint32_t frames = usbhost_received.frames;
+    _move(1000);
+
+    frames = usbhost_received.frames - frames;
+    CHECK(usbhost_received.mouse_reports <= frames);
+    CHECK(usbhost_received.mouse_reports >= 990);
+    CHECK_NOTHING_LOST();
+}
+
+static test_t const _tests[] = {
+    TEST(diagonal),
+    TEST(back_and_forth),
+    TEST(bounce_cancels_out),
+    TEST(phase_noise),
+    TEST(one_report_per_frame),
+};
+
+// Edges per second on each axis.  A Mac Plus mouse moved as fast as a
+// hand can manages a few thousand.
+static int32_t const _bench_rates[] = {
+    500, 2000, 5000, 10000, 20000, 40000, 80000, 160000,
+};
+
+// Below this many edges/s nothing at all may be lost.  Above it an axis
+// can change twice before its ISR reads the pins; far enough above it
+// the ISRs take all the CPU, and the start of frame interrupt never gets
+// to send a report.  Where that happens rests entirely on the ISR
+// cycles, which are guesses unless HOSTSIM_ISR_CYCLES is set (see
+// hostsim.h), so the report ends with the ones used.
+#define BENCH_LOSSLESS_RATE 20000
+
+#define BENCH_MS 1000
+
+typedef struct {
+    uint32_t edges;
+    int32_t lost;       // counts short of the ground truth, both axes
+    uint32_t errors;    // edges the ISRs saw both phases change
+    uint32_t reports;
+    int32_t report_lost; // movement that didn't reach the host
+} _bench_result_t;
+
+// Run one workload in a child of its own, from power-up.
+static _bench_result_t _bench_run(int32_t (*rate_x)(uint32_t ms), int32_t (*rate_y)(uint32_t ms),
+                                  uint8_t bounces, uint16_t phase_noise_us) {
+    int fds[2];
+    _bench_result_t result;
+
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        exit(1);
+    }
+    fflush(stdout);
+    if (fork() == 0) {
+        _start();
+        quadgen_x.rate = rate_x;
+        quadgen_y.rate = rate_y;
+        quadgen_x.bounces = quadgen_y.bounces = bounces;
+        quadgen_x.bounce_us = quadgen_y.bounce_us = 5;
+        quadgen_x.phase_noise_us = quadgen_y.phase_noise_us = phase_noise_us;
+        _move(BENCH_MS);
+
+        result.edges = quadgen_x.edges + quadgen_y.edges;
+        result.lost = labs(quadgen_x.position - _applied_x.counts) +
+                      labs(quadgen_y.position - _applied_y.counts);
+        result.errors = tm_counters[TM_COUNTER_QUADRATURE_ERRORS];
+        result.reports = usbhost_received.mouse_reports;
+        result.report_lost = labs(_applied_x.movement - usbhost_received.mouse_x) +
+                             labs(_applied_y.movement - usbhost_received.mouse_y);
+        if (write(fds[1], &result, sizeof(result)) != sizeof(result)) {
+            exit(1);
+        }
+        exit(0);
+    }
+    close(fds[1]);
+    if (read(fds[0], &result, sizeof(result)) != sizeof(result)) {
+        fprintf(stderr, "bench run failed\n");
+        exit(1);
+    }
+    close(fds[0]);
+    wait(NULL);
+    return result;
+}
+
+static void _print_result(char const *name, _bench_result_t result) {
+    printf("%-14s %8u %8d %6.2f%% %7u %9u %8d\n", name, result.edges, result.lost,
+           100.0 * result.lost / result.edges, result.errors,
+           result.reports * 1000 / BENCH_MS, result.report_lost);
+}
+
+static void _bench(void) {
+    printf("%-14s %8s %8s %7s %7s %9s %8s\n",
+           "edges/s/axis", "edges", "lost", "loss", "errors", "reports/s", "unsent");
+
+    for (uint8_t i = 0; i < sizeof(_bench_rates) / sizeof(_bench_rates[0]); i++) {
+        _rate_x = _bench_rates[i];
+        _rate_y = -_bench_rates[i] * 3 / 4;
+        _bench_result_t result = _bench_run(_steady_x, _steady_y, 0, 0);
+
+        char name[16];
+        snprintf(name, sizeof(name), "%d", _bench_rates[i]);
+        _print_result(name, result);
+
+        if (_bench_rates[i] <= BENCH_LOSSLESS_RATE) {
+            CHECK_EQUAL(0, result.lost);
+            CHECK_EQUAL(0, result.report_lost);
+        }
+    }
+
+    _bench_result_t result = _bench_run(_swing, _swing, 3, 40);
+    _print_result("swing+noise", result);
+
+    // the cycles of the quadrature ISRs, and the rest that kept them
+    // waiting; a child, for the same reason as _bench_run
+    fflush(stdout);
+    if (fork() == 0) {
+        _start();
+        _rate_x = _rate_y = BENCH_LOSSLESS_RATE;
+        quadgen_x.rate = _steady_x;
+        quadgen_y.rate = _steady_y;
+        _move(100);
+        printf("\n");
+        hostsim_print_isr_report();
+        exit(0);
+    }
+    wait(NULL);
+    CHECK_EQUAL(0, result.lost);
+    CHECK_EQUAL(0, result.report_lost);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+        _bench();
+        return 0;
+    }
+    return test_run_all(_tests, sizeof(_tests) / sizeof(_tests[0]), argc, argv);
+}
@@ -0,0 +1,149 @@
+// ma_apply fed synthetic velocity profiles: counts arrive at a given
+// rate, sampled every so often as the main loop would take them, and
+// the total pointer movement is checked against the gain curve.
+
+#include "testutil.h"
+
+#include "../src/mouseaccel.h"
+#include "../src/timevalues.h"
+
+// Where timer1_read32 starts; not zero, so the first movement doesn't
+// look like it came straight after another.
+#define START_COUNTS 100000UL
+
+typedef struct {
+    int32_t counts;     // quadrature counts fed in
+    int32_t movement;   // what came out
+} _result_t;
+
+// rate(ms) is the speed in counts per second, ms milliseconds after
+// START_COUNTS.  Samples are taken every period timer1 counts, and hold
+// whole counts; the fractions carry over, as the quadrature ISRs'
+// counts do.
+static _result_t _profile(ma_axis_t *axis, uint32_t *now, int32_t (*rate)(uint32_t ms),
+                          uint32_t duration_ms, uint16_t period) {
+    _result_t result = { 0, 0 };
+    int64_t owed = 0; // counts * 1000000 us not yet delivered
+
+    uint32_t end = *now + TV_MILLIS_TO_TIMER1_COUNTS(duration_ms);
+    while (*now < end) {
+        *now += period;
+        uint32_t ms = TV_TIMER1_COUNTS_TO_MILLIS(*now - START_COUNTS);
+        owed += (int64_t)rate(ms) * TV_TIMER1_COUNTS_TO_MICROS(period);
+
+        int16_t counts = owed / 1000000;
+        owed -= (int64_t)counts * 1000000;
+        if (counts == 0) {
+            continue;
+        }
+
+        int16_t movement = ma_apply(axis, counts, *now);
+        result.counts += counts;
+        result.movement += movement;
+    }
+    return result;
+}
+
+static int32_t _slow(uint32_t ms) { return 100; }
+static int32_t _fast(uint32_t ms) { return 5000; }
+static int32_t _backwards(uint32_t ms) { return -5000; }
+static int32_t _half_count_per_ms(uint32_t ms) { return 500; }
+
+// From rest to 8000 counts/s over a second.
+static int32_t _ramp(uint32_t ms) { return (ms > 1000) ? 8000 : ms * 8; }
+
+// Below 0.25 counts per ms the gain is exactly 4.
+static void slow_movement_gains_four(void) {
+    ma_axis_t axis = { 0 };
+    uint32_t now = START_COUNTS;
+
+    _result_t result = _profile(&axis, &now, _slow, 2000, 16);
+    CHECK_EQUAL(200, result.counts);
+    CHECK_EQUAL(4 * 200, result.movement);
+}
+
+// From 3 counts per ms up, exactly 16, either way, once the velocity
+// has caught up.
+static void fast_movement_gains_sixteen(void) {
+    ma_axis_t axis = { 0 };
+    uint32_t now = START_COUNTS;
+
+    _result_t result = _profile(&axis, &now, _fast, 100, 16);
+    CHECK(result.movement > 15 * result.counts);
+    CHECK(result.movement < 16 * result.counts);
+
+    result = _profile(&axis, &now, _fast, 1000, 16);
+    CHECK(result.counts > 4900);
+    CHECK_EQUAL(16 * result.counts, result.movement);
+
+    result = _profile(&axis, &now, _backwards, 1000, 16);
+    CHECK(result.counts < -4900);
+    CHECK_EQUAL(16 * result.counts, result.movement);
+}
+
+// One count at a time at 0.5 counts per ms, where the gain isn't a
+// whole number: the fractions have to add up rather than be dropped.
+static void fractions_carry(void) {
+    ma_axis_t axis = { 0 };
+    uint32_t now = START_COUNTS;
+
+    _result_t result = _profile(&axis, &now, _half_count_per_ms, 2000, 4);
+    CHECK(result.counts >= 999 && result.counts <= 1001);
+    // gain is between 4.25 and 4.5 here; truncating each sample would
+    // give 4
+    CHECK(result.movement * 100 >= result.counts * 425);
+    CHECK(result.movement * 100 <= result.counts * 450 + 100);
+}
+
+// Speeding up never lowers the gain, and the total lies between the
+// slowest and fastest.
+static void ramp_follows_curve(void) {
+    ma_axis_t axis = { 0 };
+    uint32_t now = START_COUNTS;
+    uint16_t last_gain = 0;
+    int32_t counts = 0, movement = 0;
+
+    for (uint32_t step = 0; step < 20; step++) {
+        _result_t result = _profile(&axis, &now, _ramp, 50, 16);
+        counts += result.counts;
+        movement += result.movement;
+
+        uint16_t gain = result.counts ? (int32_t)result.movement * 256 / result.counts : 0;
+        // within a count's worth of the remainder carried between steps
+        CHECK(gain + 256 / result.counts + 1 >= last_gain);
+        last_gain = gain;
+    }
+    CHECK(movement > 4 * counts);
+    CHECK(movement < 16 * counts);
+    CHECK(last_gain >= 15 * 256);
+}
+
+// A pause just longer than timer1's 16-bit count (4.19 s) must still be
+// a pause, not a burst of speed.
+static void pause_across_timer1_wrap(void) {
+    ma_axis_t axis = { 0 };
+    uint32_t now = START_COUNTS;
+
+    _profile(&axis, &now, _slow, 500, 16);
+
+    now += 0x10000UL + 4;
+    CHECK_EQUAL(4 * 3, ma_apply(&axis, 3, now));
+}
+
+static void no_counts_no_movement(void) {
+    ma_axis_t axis = { 0 };
+
+    CHECK_EQUAL(0, ma_apply(&axis, 0, START_COUNTS));
+    CHECK_EQUAL(0, axis.velocity);
+}
+
+static test_t const _tests[] = {
+    TEST(slow_movement_gains_four),
+    TEST(fast_movement_gains_sixteen),
+    TEST(fractions_carry),
+    TEST(ramp_follows_curve),
+    TEST(pause_across_timer1_wrap),
+    TEST(no_counts_no_movement),
+};
+
+TEST_MAIN(_tests)
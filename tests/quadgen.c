@@ -0,0 +1,123 @@
+#include "quadgen.h"
+#include "hostsim.h"
+
+#include <stdlib.h>
+
+#define PINS HOSTSIM_PORT_D
+
+quadgen_axis_t quadgen_x, quadgen_y;
+
+// One step on from each state, going 0 -> 1 -> 3 -> 2 -> 0 as main.c
+// counts positive, or the other way.
+static uint8_t const _forward[4] = { 1, 3, 0, 2 };
+static uint8_t const _backward[4] = { 2, 0, 3, 1 };
+
+static uint64_t _started;
+static uint32_t _random = 1;
+
+static void _event(hostsim_device_t *device);
+static hostsim_device_t _device_x = { HOSTSIM_NEVER, _event, NULL };
+static hostsim_device_t _device_y = { HOSTSIM_NEVER, _event, NULL };
+
+static quadgen_axis_t *_axis(hostsim_device_t *device) {
+    return (device == &_device_x) ? &quadgen_x : &quadgen_y;
+}
+
+static void _drive_state(quadgen_axis_t *axis) {
+    hostsim_drive(PINS, axis->first_pin, axis->state & 1);
+    hostsim_drive(PINS, axis->first_pin + 1, (axis->state >> 1) & 1);
+}
+
+void quadgen_attach(void) {
+    quadgen_x.first_pin = 0;
+    quadgen_x.wiring = 1;
+    quadgen_y.first_pin = 2;
+    quadgen_y.wiring = -1;
+
+    quadgen_x.state = quadgen_y.state = 3;
+    _drive_state(&quadgen_x);
+    _drive_state(&quadgen_y);
+    hostsim_attach(&_device_x);
+    hostsim_attach(&_device_y);
+}
+
+static void _start(quadgen_axis_t *axis, hostsim_device_t *device) {
+    if (!axis->rate) {
+        return;
+    }
+    axis->nominal = axis->edge_at = hostsim_cycles + 1;
+    device->next = axis->edge_at;
+}
+
+void quadgen_start(void) {
+    _started = hostsim_cycles;
+    _start(&quadgen_x, &_device_x);
+    _start(&quadgen_y, &_device_y);
+}
+
+static void _stop(quadgen_axis_t *axis, hostsim_device_t *device) {
+    // leave it where the last edge settled
+    axis->bouncing = 0;
+    _drive_state(axis);
+    device->next = HOSTSIM_NEVER;
+}
+
+void quadgen_stop(void) {
+    _stop(&quadgen_x, &_device_x);
+    _stop(&quadgen_y, &_device_y);
+}
+
+// -range to +range, at random (but the same every run).
+static int32_t _noise(uint32_t range) {
+    _random ^= _random << 13;
+    _random ^= _random >> 17;
+    _random ^= _random << 5;
+    return (int32_t)(_random % (2 * range + 1)) - (int32_t)range;
+}
+
+static void _event(hostsim_device_t *device) {
+    quadgen_axis_t *axis = _axis(device);
+
+    if (axis->bouncing) {
+        hostsim_drive(PINS, axis->bounce_pin, !hostsim_line(PINS, axis->bounce_pin));
+        axis->bouncing--;
+        device->next = hostsim_cycles + HOSTSIM_US(axis->bounce_us);
+        if (!axis->bouncing && device->next < axis->edge_at) {
+            device->next = axis->edge_at;
+        }
+        return;
+    }
+
+    int32_t rate = axis->rate((hostsim_cycles - _started) / HOSTSIM_MS(1));
+    if (rate == 0) {
+        // standing still; look again in a while
+        axis->nominal = axis->edge_at = hostsim_cycles + HOSTSIM_MS(1);
+        device->next = axis->edge_at;
+        return;
+    }
+
+    int8_t direction = (rate > 0) ? 1 : -1;
+    uint8_t next = (direction == axis->wiring) ? _forward[axis->state] : _backward[axis->state];
+    uint8_t pin = axis->first_pin + ((axis->state ^ next) >> 1);
+    axis->state = next;
+    _drive_state(axis);
+    axis->position += direction;
+    axis->edges++;
+
+    axis->nominal += HOSTSIM_US(1000000) / labs(rate);
+    axis->edge_at = axis->nominal;
+    if (axis->phase_noise_us) {
+        axis->edge_at += _noise(HOSTSIM_US(axis->phase_noise_us));
+    }
+    if (axis->edge_at <= hostsim_cycles) {
+        axis->edge_at = hostsim_cycles + 1;
+    }
+
+    if (axis->bounces) {
+        axis->bouncing = 2 * axis->bounces;
+        axis->bounce_pin = pin;
+        device->next = hostsim_cycles + HOSTSIM_US(axis->bounce_us);
+    } else {
+        device->next = axis->edge_at;
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef QUADGEN_H_
+#define QUADGEN_H_
+
+#include <stdint.h>
+
+// The Mac Plus mouse for hostsim: a quadrature signal on PD0-1 for X
+// and PD2-3 for Y, one count per edge, at a rate that can change over
+// time.  Each edge can come early or late (phase noise), and chatter
+// back and forth a few times before it settles (bounce).  The Y phases
+// are wired the other way round, as on the real mouse, so a positive
+// position is always what the host should see.
+//
+// position and edges are the ground truth to compare with what came
+// out of the firmware.
+
+typedef struct {
+    // Set before quadgen_start.
+    int32_t (*rate)(uint32_t ms);   // counts/s, ms after quadgen_start; negative goes back
+    uint16_t phase_noise_us;        // each edge early or late by up to this
+    uint8_t bounces;                // times each edge goes back and forth before it settles
+    uint16_t bounce_us;             // between those
+
+    int32_t position;               // counts moved so far
+    uint32_t edges;                 // edges that counted, not bounces
+
+    // private
+    uint8_t first_pin;
+    int8_t wiring;
+    uint8_t state;
+    uint8_t bouncing;               // toggles of the bouncing phase still to come
+    uint8_t bounce_pin;
+    uint64_t nominal;               // when the next edge is due, without noise
+    uint64_t edge_at;               // and with it
+} quadgen_axis_t;
+
+extern quadgen_axis_t quadgen_x, quadgen_y;
+
+// Hold both axes still, with both phases high as the pull-ups leave
+// them.
+void quadgen_attach(void);
+
+// Start moving, at each axis's rate.  An axis without one stays still.
+void quadgen_start(void);
+
+// Stop both axes where they are.
+void quadgen_stop(void);
+
+#endif
@@ -0,0 +1,60 @@
+// Raw HID reports read with GET_REPORT on endpoint 0.  A report is
+// bigger than endpoint 0's bank, so it has to go in packets, and no
+// more of it than the host asked for.
+
+#include "testutil.h"
+#include "hostsim.h"
+#include "usbhost.h"
+
+#include "../src/usb_keyboard.h"
+
+// must match usb_keyboard.c
+#define RAWHID_INTERFACE 3
+#define ENDPOINT0_SIZE 32
+#define HID_GET_REPORT 0x01
+
+static uint8_t _report[USB_RAWHID_REPORT_SIZE];
+
+static void _start(void) {
+    usbhost_attach();
+    hostsim_run(HOSTSIM_MS(5));
+
+    for (uint8_t i = 0; i < USB_RAWHID_REPORT_SIZE; i++) {
+        _report[i] = 0x80 + i;
+    }
+    CHECK_EQUAL(0, usb_rawhid_send(_report));
+}
+
+static void _get_report(uint8_t length) {
+    usbhost_control(0xA1, HID_GET_REPORT, 0x0100, RAWHID_INTERFACE, NULL, length);
+}
+
+static void whole_report_in_packets(void) {
+    _start();
+    _get_report(USB_RAWHID_REPORT_SIZE);
+
+    CHECK_EQUAL(USB_RAWHID_REPORT_SIZE, hostsim_control_in.length);
+    CHECK_EQUAL(ENDPOINT0_SIZE, hostsim_control_in.largest_packet);
+    CHECK_EQUAL(0, hostsim_control_in.overflows);
+    CHECK(memcmp(_report, hostsim_control_in.data, USB_RAWHID_REPORT_SIZE) == 0);
+}
+
+static void no_more_than_asked_for(void) {
+    _start();
+    _get_report(20);
+
+    CHECK_EQUAL(20, hostsim_control_in.length);
+    CHECK_EQUAL(0, hostsim_control_in.overflows);
+    CHECK(memcmp(_report, hostsim_control_in.data, 20) == 0);
+
+    _get_report(255);
+    CHECK_EQUAL(USB_RAWHID_REPORT_SIZE, hostsim_control_in.length);
+    CHECK_EQUAL(0, hostsim_control_in.overflows);
+}
+
+static test_t const _tests[] = {
+    TEST(whole_report_in_packets),
+    TEST(no_more_than_asked_for),
+};
+
+TEST_MAIN(_tests)
@@ -0,0 +1,77 @@
+#ifndef TESTUTIL_H_
+#define TESTUTIL_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Just enough of a test runner.  The firmware keeps its state in
+// statics that can't be reset, so each test runs in a child process of
+// its own, starting from power-up.
+
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+        exit(1); \
+    } \
+} while (0)
+
+#define CHECK_EQUAL(expected, actual) do { \
+    long long _expected = (long long)(expected), _actual = (long long)(actual); \
+    if (_expected != _actual) { \
+        fprintf(stderr, "%s:%d: check failed: %s == %s (expected %lld, got %lld)\n", \
+                __FILE__, __LINE__, #expected, #actual, _expected, _actual); \
+        exit(1); \
+    } \
+} while (0)
+
+typedef struct {
+    char const *name;
+    void (*run)(void);
+} test_t;
+
+#define TEST(name) { #name, name }
+
+// Runs each test (or just the one named on the command line), and
+// returns the exit status for main.
+static inline int test_run_all(test_t const *tests, int count, int argc, char **argv) {
+    int failed = 0, ran = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (argc > 1 && strcmp(argv[1], tests[i].name) != 0) {
+            continue;
+        }
+        ran++;
+        fflush(stdout);
+        fflush(stderr);
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            tests[i].run();
+            exit(0);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            printf("PASS %s\n", tests[i].name);
+        } else {
+            printf("FAIL %s\n", tests[i].name);
+            failed++;
+        }
+    }
+
+    if (!ran) {
+        fprintf(stderr, "no test called %s\n", argv[1]);
+        return 1;
+    }
+    return failed ? 1 : 0;
+}
+
+#define TEST_MAIN(tests) \
+    int main(int argc, char **argv) { \
+        return test_run_all(tests, sizeof(tests) / sizeof(tests[0]), argc, argv); \
+    }
+
+#endif
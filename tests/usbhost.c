@@ -0,0 +1,142 @@
+#include "usbhost.h"
+#include "hostsim.h"
+
+#include <string.h>
+
+#include <avr/io.h>
+
+// must match usb_keyboard.c
+#define MOUSE_ENDPOINT 2
+#define KEYBOARD_ENDPOINT 3
+#define MEDIA_ENDPOINT 4
+#define RAWHID_ENDPOINT 5
+#define RAWHID_INTERVAL 8
+
+#define SET_CONFIGURATION 9
+
+usbhost_received_t usbhost_received;
+
+void (*usbhost_report_hook)(uint8_t endpoint, uint8_t const *report, uint8_t length);
+
+static void _frame(hostsim_device_t *device);
+static hostsim_device_t _frames = { HOSTSIM_NEVER, _frame, NULL };
+
+void usbhost_control(uint8_t request_type, uint8_t request, uint16_t value,
+                     uint16_t index, uint8_t const *data, uint8_t length) {
+    hostsim_endpoint_t *endpoint = &hostsim_endpoints[0];
+    uint8_t setup[8] = {
+        request_type, request,
+        value & 0xff, value >> 8,
+        index & 0xff, index >> 8,
+        length, 0,
+    };
+
+    memcpy(endpoint->fifo, setup, sizeof(setup));
+    endpoint->length = sizeof(setup);
+    if (data) {
+        memcpy(endpoint->fifo + sizeof(setup), data, length);
+        endpoint->length += length;
+    }
+    endpoint->position = 0;
+    memset(&hostsim_control_in, 0, sizeof(hostsim_control_in));
+    hostsim_endpoint_set_flags(0, _BV(RXSTPI));
+    hostsim_interrupts();
+}
+
+void usbhost_attach(void) {
+    hostsim_boot();
+
+    UDINT |= _BV(EORSTI);
+    hostsim_interrupts();
+
+    usbhost_control(0x00, SET_CONFIGURATION, 1, 0, NULL, 0);
+    for (uint8_t i = 1; i < HOSTSIM_ENDPOINTS; i++) {
+        if (hostsim_endpoints[i].registers[HOSTSIM_UECONX] & _BV(EPEN)) {
+            hostsim_endpoint_free(i);
+        }
+    }
+    hostsim_interrupts();
+
+    _frames.next = hostsim_cycles + HOSTSIM_MS(1);
+    hostsim_attach(&_frames);
+}
+
+static int16_t _le16(uint8_t const *bytes) {
+    return (int16_t)(bytes[0] | (bytes[1] << 8));
+}
+
+// Take the packet waiting on an endpoint, if there is one.
+static void _poll(uint8_t number) {
+    hostsim_endpoint_t *endpoint = &hostsim_endpoints[number];
+    uint8_t const *packet = endpoint->fifo;
+
+    if (!endpoint->committed) {
+        return;
+    }
+
+    if (usbhost_report_hook) {
+        usbhost_report_hook(number, packet, endpoint->length);
+    }
+
+    switch (number) {
+    case KEYBOARD_ENDPOINT:
+        if (endpoint->length == USBHOST_KEYBOARD_REPORT_SIZE) {
+            memcpy(usbhost_received.keyboard, packet, USBHOST_KEYBOARD_REPORT_SIZE);
+            usbhost_received.keyboard_reports++;
+        } else if (endpoint->length == USBHOST_KEYBOARD_BOOT_REPORT_SIZE) {
+            memcpy(usbhost_received.keyboard_boot, packet, USBHOST_KEYBOARD_BOOT_REPORT_SIZE);
+            usbhost_received.keyboard_boot_reports++;
+        }
+        break;
+    case MOUSE_ENDPOINT:
+        if (endpoint->length == 7) {
+            usbhost_received.mouse_buttons = packet[0];
+            usbhost_received.mouse_x += _le16(&packet[1]);
+            usbhost_received.mouse_y += _le16(&packet[3]);
+            usbhost_received.mouse_reports++;
+        }
+        break;
+    case MEDIA_ENDPOINT:
+        if (endpoint->length == 8) {
+            for (uint8_t i = 0; i < 4; i++) {
+                usbhost_received.media[i] = (uint16_t)_le16(&packet[i * 2]);
+            }
+            usbhost_received.media_reports++;
+        }
+        break;
+    case RAWHID_ENDPOINT:
+        usbhost_received.rawhid_reports++;
+        break;
+    }
+
+    hostsim_endpoint_free(number);
+}
+
+static void _frame(hostsim_device_t *device) {
+    usbhost_received.frames++;
+
+    _poll(MOUSE_ENDPOINT);
+    _poll(KEYBOARD_ENDPOINT);
+    _poll(MEDIA_ENDPOINT);
+    if (usbhost_received.frames % RAWHID_INTERVAL == 0) {
+        _poll(RAWHID_ENDPOINT);
+    }
+
+    UDINT |= _BV(SOFI);
+    device->next += HOSTSIM_MS(1);
+}
+
+uint8_t usbhost_key_down(uint8_t usage) {
+    if (usage >= 128) {
+        return 0;
+    }
+    return (usbhost_received.keyboard[1 + (usage >> 3)] >> (usage & 7)) & 1;
+}
+
+uint8_t usbhost_keys_down(void) {
+    uint8_t count = 0;
+    for (uint8_t usage = 0; usage < 128; usage++) {
+        count += usbhost_key_down(usage);
+    }
+    return count;
+}
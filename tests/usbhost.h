@@ -0,0 +1,54 @@
+#ifndef USBHOST_H_
+#define USBHOST_H_
+
+#include <stdint.h>
+
+// A USB host for hostsim: resets and configures the device, then runs
+// 1 ms frames, polling each IN endpoint at its bInterval and keeping
+// what it receives.
+
+// Reset the bus and select configuration 1.
+void usbhost_attach(void);
+
+// A control request, with an OUT data stage if data is given.  length
+// goes in wLength either way; an IN request's data stage ends up in
+// hostsim_control_in.  Runs USB_COM_vect straight away.
+void usbhost_control(uint8_t request_type, uint8_t request, uint16_t value,
+                     uint16_t index, uint8_t const *data, uint8_t length);
+
+// What has arrived, in the report protocol.
+#define USBHOST_KEYBOARD_REPORT_SIZE 17 // modifiers, then one bit per usage 0-127
+#define USBHOST_KEYBOARD_BOOT_REPORT_SIZE 8
+
+typedef struct {
+    uint32_t frames;
+
+    uint32_t keyboard_reports;
+    uint8_t keyboard[USBHOST_KEYBOARD_REPORT_SIZE];  // the last one
+
+    // and in the boot protocol: modifiers, a reserved byte, six usages
+    uint32_t keyboard_boot_reports;
+    uint8_t keyboard_boot[USBHOST_KEYBOARD_BOOT_REPORT_SIZE];
+
+    uint32_t media_reports;
+    uint16_t media[4];
+
+    uint32_t mouse_reports;
+    uint8_t mouse_buttons;
+    int32_t mouse_x, mouse_y;   // all the motion reported so far
+
+    uint32_t rawhid_reports;
+} usbhost_received_t;
+
+extern usbhost_received_t usbhost_received;
+
+// If set, called with every report the host takes, on any endpoint.
+extern void (*usbhost_report_hook)(uint8_t endpoint, uint8_t const *report, uint8_t length);
+
+// Non-zero if the last keyboard report has usage down.
+uint8_t usbhost_key_down(uint8_t usage);
+
+// Number of usages down in the last keyboard report.
+uint8_t usbhost_keys_down(void);
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef TESTS_UTIL_DELAY_H_
+#define TESTS_UTIL_DELAY_H_
+
+// Stand-in for avr-libc's <util/delay.h>.  Busy waits take no simulated
+// time.
+
+#define _delay_us(us)
+#define _delay_ms(ms)
+
+#endif
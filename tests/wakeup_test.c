@@ -0,0 +1,117 @@
+// What wakes the CPU from sleep, counted the way the firmware counts it
+// for telemetry (TM_COUNTER_WAKEUPS, from tm_idle).  With the keyboard
+// in its inquiry loop and nothing moving, the start of frame interrupt
+// must stay off unless an idle rate needs it.
+//
+// wakeup_test --bench prints the wakeup rate with the host's idle rate
+// left at the HID default, set to 0, and with the mouse moving.
+
+#include "testutil.h"
+#include "hostsim.h"
+#include "usbhost.h"
+#include "kbmodel.h"
+#include "quadgen.h"
+
+#include "../src/telemetry.h"
+
+// must match usb_keyboard.c
+#define KEYBOARD_INTERFACE 0
+#define HID_SET_IDLE 0x0A
+
+static void _start(void) {
+    usbhost_attach();
+    kbmodel_attach();
+    quadgen_attach();
+    hostsim_run(HOSTSIM_MS(20));
+}
+
+// Set an interface's idle rate, in 4 ms units, as hosts do for
+// keyboards once they're configured.
+static void _set_idle(uint8_t interface, uint8_t rate) {
+    usbhost_control(0x21, HID_SET_IDLE, rate << 8, interface, NULL, 0);
+}
+
+// Wakeups per second, over ms.
+static uint32_t _wakeup_rate(uint32_t ms) {
+    uint16_t before = tm_counters[TM_COUNTER_WAKEUPS];
+    hostsim_run(HOSTSIM_MS(ms));
+    return (uint16_t)(tm_counters[TM_COUNTER_WAKEUPS] - before) * 1000 / ms;
+}
+
+static int32_t _steady(uint32_t ms) {
+    return 2000;
+}
+
+// The keyboard's 500 ms default idle rate needs every frame counted.
+static void default_idle_counts_frames(void) {
+    _start();
+
+    CHECK(_wakeup_rate(1000) >= 1000);
+}
+
+// With every idle rate 0 only the keyboard link and the software timers
+// are left.
+static void no_idle_no_frames(void) {
+    _start();
+    _set_idle(KEYBOARD_INTERFACE, 0);
+
+    uint32_t frames = usbhost_received.frames;
+    uint32_t rate = _wakeup_rate(1000);
+    CHECK(usbhost_received.frames - frames >= 1000);
+    CHECK(rate < 200);
+}
+
+// Mouse motion turns the frames back on until it's been sent.
+static void frames_only_while_moving(void) {
+    _start();
+    _set_idle(KEYBOARD_INTERFACE, 0);
+
+    quadgen_x.rate = _steady;
+    quadgen_start();
+    uint32_t moving = _wakeup_rate(500);
+    quadgen_stop();
+    hostsim_run(HOSTSIM_MS(10));
+    uint32_t stopped = _wakeup_rate(1000);
+
+    CHECK(usbhost_received.mouse_x > 0);
+    CHECK(moving >= 1000);
+    CHECK(stopped < 200);
+}
+
+static test_t const _tests[] = {
+    TEST(default_idle_counts_frames),
+    TEST(no_idle_no_frames),
+    TEST(frames_only_while_moving),
+};
+
+// Run one case in a child of its own, from power-up, and print its
+// wakeup rate.
+static void _bench_case(char const *name, uint8_t keyboard_idle, uint8_t moving) {
+    fflush(stdout);
+    if (fork() == 0) {
+        _start();
+        _set_idle(KEYBOARD_INTERFACE, keyboard_idle);
+        if (moving) {
+            quadgen_x.rate = _steady;
+            quadgen_start();
+        }
+        printf("%-26s %8u\n", name, _wakeup_rate(2000));
+        exit(0);
+    }
+    wait(NULL);
+}
+
+static void _bench(void) {
+    printf("%-26s %8s\n", "", "wakeups/s");
+    _bench_case("keyboard idle 500 ms", 125, 0);
+    _bench_case("keyboard idle 0", 0, 0);
+    _bench_case("keyboard idle 0, moving", 0, 1);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+        _bench();
+        return 0;
+    }
+    return test_run_all(_tests, sizeof(_tests) / sizeof(_tests[0]), argc, argv);
+}
@@ -0,0 +1,257 @@
+// Prints the telemetry records the adapter sends on its raw HID interface.
+//
+// Build and run on Linux:
+//
+//   cc -std=gnu99 -Wall -o hidtelemetry hidtelemetry.c
+//   ./hidtelemetry [/dev/hidrawN]
+//
+// With no argument, it looks through /dev/hidraw* for the adapter's
+// telemetry interface.  You'll need read access to the device node (run
+// as root, or add a udev rule).
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <linux/hidraw.h>
+
+#include "../src/telemetry.h"
+
+// must match usb_keyboard.c
+#define VENDOR_ID 0x16C0
+#define PRODUCT_ID 0x047C
+
+static char const *const TxNames[4] = { "kbd", "media", "mouse", "tm" };
+
+static char const *const CounterNames[TM_COUNTER_COUNT] = {
+    "quad_err",
+    "unknown_sc",
+    "transitions",
+    "link_resets",
+    "keys_released",
+    "mouse_edges",
+    "mouse_reports",
+    "usb_configured",
+    "wakeups",
+    "usb_suspends",
+    "kb_glitches",
+};
+
+static char const *const HistogramNames[TRACE_HISTOGRAM_COUNT] = {
+    "key->report",
+    "motion->report",
+};
+
+static char const *const EventNames[] = {
+    [TRACE_KB_SENT] = "kb_sent",
+    [TRACE_KB_RECEIVED] = "kb_received",
+    [TRACE_KB_POSTISR] = "kb_postisr",
+    [TRACE_KEY_PROCESSED] = "key_processed",
+    [TRACE_KEYBOARD_QUEUED] = "keyboard_queued",
+    [TRACE_KEYBOARD_SENT] = "keyboard_sent",
+    [TRACE_QUADRATURE] = "quadrature",
+    [TRACE_MOUSE_QUEUED] = "mouse_queued",
+    [TRACE_MOUSE_SENT] = "mouse_sent",
+};
+
+static char const *const IsrNames[TRACE_ISR_COUNT] = {
+    "usb_gen",
+    "usb_com",
+    "int7",
+    "timer1_compb",
+    "quad_x",
+    "quad_y",
+    "timer1_compa",
+};
+
+// timer1 counts are 64 us
+#define MICROS_PER_COUNT 64
+
+// The adapter has several HID interfaces; the telemetry one is the only
+// one whose report descriptor starts with the vendor usage page 0xFFAB.
+static int _is_telemetry(int fd) {
+    struct hidraw_devinfo info;
+    struct hidraw_report_descriptor desc;
+    int size;
+
+    if (ioctl(fd, HIDIOCGRAWINFO, &info) < 0) return 0;
+    if ((uint16_t)info.vendor != VENDOR_ID || (uint16_t)info.product != PRODUCT_ID) return 0;
+
+    if (ioctl(fd, HIDIOCGRDESCSIZE, &size) < 0 || size < 3) return 0;
+    desc.size = size;
+    if (ioctl(fd, HIDIOCGRDESC, &desc) < 0) return 0;
+    return desc.value[0] == 0x06 && desc.value[1] == 0xAB && desc.value[2] == 0xFF;
+}
+
+static int _open_telemetry(void) {
+    DIR *dir = opendir("/dev");
+    struct dirent *entry;
+    char path[300];
+    int fd = -1;
+
+    if (!dir) return -1;
+    while (fd < 0 && (entry = readdir(dir))) {
+        if (strncmp(entry->d_name, "hidraw", 6) != 0) continue;
+        snprintf(path, sizeof(path), "/dev/%s", entry->d_name);
+        fd = open(path, O_RDONLY);
+        if (fd >= 0 && !_is_telemetry(fd)) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    closedir(dir);
+    if (fd >= 0) fprintf(stderr, "reading %s\n", path);
+    return fd;
+}
+
+static void _print_counters(tm_counters_record_t const *record) {
+    static int have_last = 0;
+    static tm_counters_record_t last;
+
+    printf("#%3u t=%.3fs turnaround=%uus max=%uus kbd_latency=%uus stalls=%u leds=0x%02x",
+           record->sequence, (double)record->timestamp * MICROS_PER_COUNT / 1e6,
+           record->kb_turnaround_us, record->kb_max_turnaround_us,
+           record->keyboard_latency_us, record->scancode_stalls, record->host_leds);
+    for (int i = 0; i < 4; i++) {
+        printf(" %s=%u/%u", TxNames[i], record->tx[i].drops, record->tx[i].overruns);
+    }
+    for (int i = 0; i < TM_COUNTER_COUNT; i++) {
+        printf(" %s=%u", CounterNames[i], record->counters[i]);
+    }
+    if (record->counters[TM_COUNTER_UNKNOWN_SCANCODES]) {
+        printf(" last_unknown=0x%02x", record->last_unknown_scancode);
+    }
+    if (record->counters[TM_COUNTER_LINK_RESETS]) {
+        printf(" last_recovery=%ums", record->last_recovery_ms);
+    }
+    printf(" configured_at=%ums", record->configured_ms);
+    if (record->first_key_ms) {
+        printf(" first_key_at=%ums", record->first_key_ms);
+    }
+
+    // The differences between consecutive records give rates.
+    if (have_last && (uint8_t)(record->sequence - last.sequence) == 1) {
+        uint32_t elapsed = record->timestamp - last.timestamp;
+        uint16_t delta[TM_COUNTER_COUNT];
+        for (int i = 0; i < TM_COUNTER_COUNT; i++) {
+            delta[i] = record->counters[i] - last.counters[i];
+        }
+        if (elapsed) {
+            double seconds = (double)elapsed * MICROS_PER_COUNT / 1e6;
+            uint32_t idle = record->idle_counts - last.idle_counts;
+            printf(" transitions/s=%.1f edges/s=%.0f reports/s=%.0f wakeups/s=%.0f idle=%.1f%%",
+                   delta[TM_COUNTER_KEY_TRANSITIONS] / seconds,
+                   delta[TM_COUNTER_MOUSE_EDGES] / seconds,
+                   delta[TM_COUNTER_MOUSE_REPORTS] / seconds,
+                   delta[TM_COUNTER_WAKEUPS] / seconds,
+                   100.0 * idle / elapsed);
+        }
+        // An illegal quadrature transition means both phases changed
+        // between two interrupts, so at least two edges were missed.
+        uint32_t missed = 2u * delta[TM_COUNTER_QUADRATURE_ERRORS];
+        if (delta[TM_COUNTER_MOUSE_EDGES] + missed) {
+            printf(" mouse_loss=%.2f%%", 100.0 * missed / (delta[TM_COUNTER_MOUSE_EDGES] + missed));
+        }
+    }
+    last = *record;
+    have_last = 1;
+    printf("\n");
+}
+
+// Bucket n holds latencies below 2^n timer1 counts; print its upper bound.
+static void _print_histogram(tm_histogram_record_t const *record) {
+    if (record->histogram >= TRACE_HISTOGRAM_COUNT) return;
+
+    printf("%s:", HistogramNames[record->histogram]);
+    for (int i = 0; i < TRACE_HISTOGRAM_BUCKETS; i++) {
+        uint16_t count = record->buckets[i];
+        if (!count) continue;
+        if (i == TRACE_HISTOGRAM_BUCKETS - 1) {
+            printf(" >=%luus:%u", (unsigned long)(1ul << (i - 1)) * MICROS_PER_COUNT, count);
+        } else {
+            printf(" <%luus:%u", (unsigned long)(1ul << i) * MICROS_PER_COUNT, count);
+        }
+    }
+    printf("\n");
+}
+
+// The CPU runs at 16 MHz.
+static void _print_isr_cycles(tm_isr_cycles_record_t const *record) {
+    uint16_t worst = 0;
+
+    printf("isr max cycles:");
+    for (int i = 0; i < TRACE_ISR_COUNT; i++) {
+        uint16_t cycles = record->max_cycles[i];
+        printf(" %s=%u", IsrNames[i], cycles);
+        if (cycles > worst) worst = cycles;
+    }
+    printf(" (longest %.1fus)\n", worst / 16.0);
+}
+
+static void _print_trace(tm_trace_record_t const *record) {
+    if (record->lost) {
+        printf("trace: %u records lost so far\n", record->lost);
+    }
+    for (int i = 0; i < record->count && i < TM_TRACE_RECORDS; i++) {
+        trace_record_t const *entry = &record->records[i];
+        char const *name = NULL;
+        if (entry->event < sizeof(EventNames) / sizeof(EventNames[0])) {
+            name = EventNames[entry->event];
+        }
+        printf("  t=%5u %-16s 0x%02x\n", entry->timestamp, name ? name : "?", entry->payload);
+    }
+}
+
+int main(int argc, char **argv) {
+    uint8_t report[64];
+    int fd;
+
+    fd = (argc > 1) ? open(argv[1], O_RDONLY) : _open_telemetry();
+    if (fd < 0) {
+        fprintf(stderr, "no telemetry device found\n");
+        return 1;
+    }
+
+    for (;;) {
+        ssize_t n = read(fd, report, sizeof(report));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("read");
+            return 1;
+        }
+        if (n == 0) continue;
+
+        switch (report[0]) {
+        case TM_RECORD_COUNTERS:
+            if ((size_t)n >= sizeof(tm_counters_record_t)) {
+                _print_counters((tm_counters_record_t const *)report);
+            }
+            break;
+        case TM_RECORD_HISTOGRAM:
+            if ((size_t)n >= sizeof(tm_histogram_record_t)) {
+                _print_histogram((tm_histogram_record_t const *)report);
+            }
+            break;
+        case TM_RECORD_ISR_CYCLES:
+            if ((size_t)n >= sizeof(tm_isr_cycles_record_t)) {
+                _print_isr_cycles((tm_isr_cycles_record_t const *)report);
+            }
+            break;
+        case TM_RECORD_TRACE:
+            if ((size_t)n >= sizeof(tm_trace_record_t)) {
+                _print_trace((tm_trace_record_t const *)report);
+            }
+            break;
+        default:
+            printf("unknown record type 0x%02x (%zd bytes)\n", report[0], n);
+            break;
+        }
+        fflush(stdout);
+    }
+}
@@ -0,0 +1,501 @@
+// Works out how long each ISR can take, in CPU cycles, from the
+// firmware's disassembly, for hostsim's HOSTSIM_ISR_CYCLES.  Also finds
+// the longest stretch the firmware runs with interrupts disabled.
+//
+// Build and run on the host:
+//
+//   cc -std=gnu99 -Wall -o isrcycles isrcycles.c
+//   avr-objdump -d main.elf | ./isrcycles [-v]
+//
+// or just `make isr-cycles` in src.  It prints name=cycles pairs,
+// including cli=cycles for the longest cli section; -v first lists
+// what it found for each vector.
+//
+// Each ISR is walked from its vector to every reti it can reach, adding
+// up the cycles the datasheet gives each instruction and taking the
+// longest path, branches and skips taken whichever way costs more.
+// Calls are walked the same way, to their longest ret.  A cli section
+// runs from cli to the sei, the restore of SREG or the ret that ends it.
+//
+// It's a bound, not a measurement, and only as good as what it can
+// see.  A loop is counted once round, and -v lists the loops it found so
+// their real counts can be checked by hand.  Indirect jumps and calls
+// (switch tables, function pointers) can't be followed, and are listed
+// too, under the first ISR or cli section that reaches them.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// at90usb1286: 128K of flash, so the PC is 16 bits
+#define FLASH_WORDS 0x10000
+
+// The CPU finishes the instruction it's in, takes 5 cycles to push the
+// PC and get to the vector, then jumps to the ISR.
+#define INTERRUPT_RESPONSE_CYCLES 5
+#define VECTOR_JMP_CYCLES 3
+
+// SREG's I/O address, for `out 0x3f, rN`
+#define SREG_IO "0x3f"
+
+#define NO_TARGET 0xffffffffUL
+
+typedef struct {
+    uint32_t addr;          // byte address
+    uint8_t size;           // bytes
+    char mnemonic[8];
+    char operands[32];
+    uint32_t target;        // for jumps, branches and calls
+} instruction_t;
+
+typedef struct {
+    uint32_t addr;
+    char name[48];
+} label_t;
+
+static instruction_t *Instructions;
+static int InstructionCount;
+static int *AddrIndex;      // word address -> instruction, or -1
+
+static label_t *Labels;
+static int LabelCount;
+
+static int Verbose;
+
+// hostsim's names for the ISRs, and the avr-libc vector numbers they
+// cover: INT1 and INT3 share INT0's and INT2's ISRs.
+static struct {
+    char const *name;
+    int vectors[2];
+    int count;
+} const Isrs[] = {
+    { "usb_gen", { 10 }, 1 },
+    { "usb_com", { 11 }, 1 },
+    { "int7", { 8 }, 1 },
+    { "timer1_compb", { 18 }, 1 },
+    { "quad_x", { 1, 2 }, 2 },
+    { "quad_y", { 3, 4 }, 2 },
+    { "timer1_compa", { 17 }, 1 },
+    { "int6", { 7 }, 1 },
+    { "timer1_ovf", { 20 }, 1 },
+};
+
+static char const *_label_for(uint32_t addr, uint32_t *offset) {
+    int low = 0, high = LabelCount - 1, found = -1;
+
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        if (Labels[mid].addr <= addr) {
+            found = mid;
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+    if (found < 0) {
+        *offset = addr;
+        return "?";
+    }
+    *offset = addr - Labels[found].addr;
+    return Labels[found].name;
+}
+
+static void _print_addr(uint32_t addr) {
+    uint32_t offset;
+    char const *name = _label_for(addr, &offset);
+    printf("0x%04x <%s+0x%x>", addr, name, offset);
+}
+
+//
+// Reading the disassembly
+//
+
+static void _add_label(uint32_t addr, char const *name) {
+    static int allocated;
+    if (LabelCount == allocated) {
+        allocated = allocated ? 2 * allocated : 256;
+        Labels = realloc(Labels, allocated * sizeof(*Labels));
+    }
+    Labels[LabelCount].addr = addr;
+    snprintf(Labels[LabelCount].name, sizeof(Labels[LabelCount].name), "%s", name);
+    LabelCount++;
+}
+
+static instruction_t *_add_instruction(void) {
+    static int allocated;
+    if (InstructionCount == allocated) {
+        allocated = allocated ? 2 * allocated : 4096;
+        Instructions = realloc(Instructions, allocated * sizeof(*Instructions));
+    }
+    instruction_t *instruction = &Instructions[InstructionCount++];
+    memset(instruction, 0, sizeof(*instruction));
+    instruction->target = NO_TARGET;
+    return instruction;
+}
+
+// "00000abc <name>:"
+static int _read_label(char const *line) {
+    unsigned long addr;
+    char name[64];
+    if (sscanf(line, "%lx <%63[^>]>:", &addr, name) != 2) {
+        return 0;
+    }
+    _add_label(addr, name);
+    return 1;
+}
+
+// " abc:\t0c 94 56 00 \tjmp\t0xac\t; 0xac <__ctors_end>"
+static int _read_instruction(char const *line) {
+    unsigned long addr;
+    int used;
+    if (sscanf(line, " %lx:%n", &addr, &used) != 1 || line[used] != '\t') {
+        return 0;
+    }
+
+    char const *fields[4] = { 0 };
+    int count = 0;
+    for (char const *p = line + used; *p && count < 4; p++) {
+        if (*p == '\t') {
+            fields[count++] = p + 1;
+        }
+    }
+    if (count < 2) {
+        // data, or a word objdump couldn't decode
+        return 0;
+    }
+
+    instruction_t *instruction = _add_instruction();
+    instruction->addr = addr;
+    for (char const *p = fields[0]; p < fields[1]; p++) {
+        if (p[0] != ' ' && p[0] != '\t' && (p == fields[0] || p[-1] == ' ')) {
+            instruction->size++;
+        }
+    }
+    sscanf(fields[1], "%7s", instruction->mnemonic);
+    if (count > 2) {
+        size_t length = strcspn(fields[2], "\t;\n");
+        if (length >= sizeof(instruction->operands)) {
+            length = sizeof(instruction->operands) - 1;
+        }
+        memcpy(instruction->operands, fields[2], length);
+    }
+
+    // Relative targets are given in the comment; jmp and call have them
+    // as the operand.
+    char const *comment = strchr(fields[1], ';');
+    unsigned long target;
+    if (comment && sscanf(comment, "; 0x%lx", &target) == 1) {
+        instruction->target = target;
+    } else if (sscanf(instruction->operands, "0x%lx", &target) == 1) {
+        instruction->target = target;
+    }
+    return 1;
+}
+
+static void _read_disassembly(FILE *file) {
+    char line[512];
+    while (fgets(line, sizeof(line), file)) {
+        if (!_read_label(line)) {
+            _read_instruction(line);
+        }
+    }
+
+    AddrIndex = malloc(FLASH_WORDS * sizeof(*AddrIndex));
+    for (int i = 0; i < FLASH_WORDS; i++) {
+        AddrIndex[i] = -1;
+    }
+    for (int i = 0; i < InstructionCount; i++) {
+        if (Instructions[i].addr / 2 < FLASH_WORDS) {
+            AddrIndex[Instructions[i].addr / 2] = i;
+        }
+    }
+}
+
+static int _index_at(uint32_t addr) {
+    if (addr == NO_TARGET || addr / 2 >= FLASH_WORDS) {
+        return -1;
+    }
+    return AddrIndex[addr / 2];
+}
+
+//
+// Cycles
+//
+
+static int _is(instruction_t const *instruction, char const *const *mnemonics) {
+    for (; *mnemonics; mnemonics++) {
+        if (strcmp(instruction->mnemonic, *mnemonics) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static char const *const TwoCycles[] = {
+    "adiw", "sbiw", "mul", "muls", "mulsu", "fmul", "fmuls", "fmulsu",
+    "ld", "ldd", "st", "std", "lds", "sts", "push", "pop", "cbi", "sbi",
+    "rjmp", "ijmp", "eijmp", NULL,
+};
+static char const *const ThreeCycles[] = {
+    "lpm", "elpm", "rcall", "icall", "eicall", "jmp", NULL,
+};
+static char const *const FourCycles[] = { "call", "ret", "reti", NULL };
+
+static char const *const Skips[] = { "cpse", "sbrc", "sbrs", "sbic", "sbis", NULL };
+static char const *const Calls[] = { "call", "rcall", NULL };
+static char const *const Jumps[] = { "jmp", "rjmp", NULL };
+static char const *const Indirect[] = { "ijmp", "eijmp", "icall", "eicall", NULL };
+static char const *const Returns[] = { "ret", "reti", NULL };
+
+// Cycles for the instruction itself, not counting a branch taken or a
+// skip.
+static int _cycles(instruction_t const *instruction) {
+    if (_is(instruction, FourCycles)) return 4;
+    if (_is(instruction, ThreeCycles)) return 3;
+    if (_is(instruction, TwoCycles)) return 2;
+    return 1;
+}
+
+static int _is_branch(instruction_t const *instruction) {
+    return strncmp(instruction->mnemonic, "br", 2) == 0 && strcmp(instruction->mnemonic, "break") != 0;
+}
+
+// Whether an instruction ends a cli section.
+static int _enables_interrupts(instruction_t const *instruction) {
+    return strcmp(instruction->mnemonic, "sei") == 0 ||
+           (strcmp(instruction->mnemonic, "out") == 0 &&
+            strncmp(instruction->operands, SREG_IO ",", strlen(SREG_IO) + 1) == 0);
+}
+
+//
+// Walking
+//
+
+// Walks either a function, to its ret or reti, or a cli section.
+typedef enum { WALK_FUNCTION, WALK_CLI, WALK_COUNT } walk_t;
+
+enum { UNVISITED, VISITING, DONE };
+
+typedef struct {
+    uint8_t *state;
+    uint32_t *cycles;       // longest from here to the end
+} walk_memo_t;
+
+static walk_memo_t Memo[WALK_COUNT];
+
+// Things found along the way, reported once each.
+#define NOTE_MAX 256
+static struct {
+    uint32_t addr;
+    char const *what;
+} Notes[NOTE_MAX];
+static int NoteCount;
+
+static void _note(uint32_t addr, char const *what) {
+    for (int i = 0; i < NoteCount; i++) {
+        if (Notes[i].addr == addr && Notes[i].what == what) {
+            return;
+        }
+    }
+    if (NoteCount < NOTE_MAX) {
+        Notes[NoteCount].addr = addr;
+        Notes[NoteCount].what = what;
+        NoteCount++;
+    }
+}
+
+static char const NoteLoop[] = "loop, counted once round";
+static char const NoteIndirect[] = "indirect jump or call, not followed";
+static char const NoteRecursion[] = "recursive call, not followed";
+static char const NoteLost[] = "runs off the end of the code";
+static char const NoteReturnsDisabled[] = "returns with interrupts disabled";
+
+static uint32_t _walk(walk_t walk, int index);
+
+static uint32_t _function_cycles(uint32_t addr, uint32_t from) {
+    int index = _index_at(addr);
+    if (index < 0) {
+        _note(from, NoteLost);
+        return 0;
+    }
+    if (Memo[WALK_FUNCTION].state[index] == VISITING) {
+        _note(from, NoteRecursion);
+        return 0;
+    }
+    return _walk(WALK_FUNCTION, index);
+}
+
+// The longer of going on from next or not.
+static uint32_t _longer(uint32_t a, uint32_t b) {
+    return a > b ? a : b;
+}
+
+// Longest from the instruction at index to the end of the walk.
+static uint32_t _successor(walk_t walk, int index, uint32_t from) {
+    if (index < 0) {
+        _note(from, NoteLost);
+        return 0;
+    }
+    if (Memo[walk].state[index] == VISITING) {
+        _note(Instructions[index].addr, NoteLoop);
+        return 0;
+    }
+    return _walk(walk, index);
+}
+
+static uint32_t _walk(walk_t walk, int index) {
+    if (Memo[walk].state[index] == DONE) {
+        return Memo[walk].cycles[index];
+    }
+    Memo[walk].state[index] = VISITING;
+
+    instruction_t const *instruction = &Instructions[index];
+    uint32_t cycles = _cycles(instruction);
+    uint32_t next = instruction->addr + instruction->size;
+    uint32_t rest;
+
+    if (walk == WALK_CLI && _enables_interrupts(instruction)) {
+        rest = 0;
+    } else if (_is(instruction, Returns)) {
+        if (walk == WALK_CLI && strcmp(instruction->mnemonic, "ret") == 0) {
+            _note(instruction->addr, NoteReturnsDisabled);
+        }
+        rest = 0;
+    } else if (_is(instruction, Indirect)) {
+        _note(instruction->addr, NoteIndirect);
+        rest = strstr(instruction->mnemonic, "call")
+            ? _successor(walk, _index_at(next), instruction->addr) : 0;
+    } else if (_is(instruction, Calls)) {
+        rest = _function_cycles(instruction->target, instruction->addr) +
+               _successor(walk, _index_at(next), instruction->addr);
+    } else if (_is(instruction, Jumps)) {
+        rest = _successor(walk, _index_at(instruction->target), instruction->addr);
+    } else if (_is_branch(instruction)) {
+        rest = _longer(_successor(walk, _index_at(next), instruction->addr),
+                       1 + _successor(walk, _index_at(instruction->target), instruction->addr));
+    } else if (_is(instruction, Skips)) {
+        int skipped = _index_at(next);
+        uint32_t over = skipped < 0 ? 0 : Instructions[skipped].size / 2;
+        rest = _successor(walk, skipped, instruction->addr);
+        if (skipped >= 0) {
+            rest = _longer(rest, over + _successor(walk, _index_at(next + Instructions[skipped].size),
+                                                   instruction->addr));
+        }
+    } else {
+        rest = _successor(walk, _index_at(next), instruction->addr);
+    }
+
+    Memo[walk].state[index] = DONE;
+    Memo[walk].cycles[index] = cycles + rest;
+    return cycles + rest;
+}
+
+// Where a vector's jmp in the table goes, or NO_TARGET if it's unused.
+static uint32_t _vector_target(int vector) {
+    int index = _index_at(vector * 4);
+    if (index < 0 || !_is(&Instructions[index], Jumps)) {
+        return NO_TARGET;
+    }
+    uint32_t offset;
+    if (strcmp(_label_for(Instructions[index].target, &offset), "__bad_interrupt") == 0) {
+        return NO_TARGET;
+    }
+    return Instructions[index].target;
+}
+
+// Notes made since first, in address order.
+static void _print_notes(int first) {
+    for (int i = first; i < NoteCount; i++) {
+        printf("    ");
+        _print_addr(Notes[i].addr);
+        printf(": %s\n", Notes[i].what);
+    }
+}
+
+static uint32_t _isr_cycles(int isr) {
+    uint32_t longest = 0;
+    for (int i = 0; i < Isrs[isr].count; i++) {
+        uint32_t addr = _vector_target(Isrs[isr].vectors[i]);
+        if (addr == NO_TARGET) {
+            continue;
+        }
+        int notes = NoteCount;
+        uint32_t cycles = INTERRUPT_RESPONSE_CYCLES + VECTOR_JMP_CYCLES +
+                          _function_cycles(addr, Isrs[isr].vectors[i] * 4);
+        if (Verbose) {
+            printf("%-13s vector %2d at ", Isrs[isr].name, Isrs[isr].vectors[i]);
+            _print_addr(addr);
+            printf(": %u cycles\n", cycles);
+            _print_notes(notes);
+        }
+        longest = _longer(longest, cycles);
+    }
+    return longest;
+}
+
+// The longest cli section anywhere.
+static uint32_t _cli_cycles(void) {
+    uint32_t longest = 0;
+    int longest_index = -1;
+
+    for (int i = 0; i < InstructionCount; i++) {
+        if (strcmp(Instructions[i].mnemonic, "cli") != 0) {
+            continue;
+        }
+        int notes = NoteCount;
+        uint32_t cycles = _walk(WALK_CLI, i);
+        if (Verbose) {
+            printf("cli at ");
+            _print_addr(Instructions[i].addr);
+            printf(": %u cycles\n", cycles);
+            _print_notes(notes);
+        }
+        if (cycles > longest) {
+            longest = cycles;
+            longest_index = i;
+        }
+    }
+    if (Verbose && longest_index >= 0) {
+        printf("longest cli section at ");
+        _print_addr(Instructions[longest_index].addr);
+        printf(": %u cycles\n", longest);
+    }
+    return longest;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "-v") == 0) {
+        Verbose = 1;
+    } else if (argc > 1) {
+        fprintf(stderr, "usage: avr-objdump -d main.elf | %s [-v]\n", argv[0]);
+        return 1;
+    }
+
+    _read_disassembly(stdin);
+    if (!InstructionCount) {
+        fprintf(stderr, "isrcycles: no instructions on stdin\n");
+        return 1;
+    }
+    for (int walk = 0; walk < WALK_COUNT; walk++) {
+        Memo[walk].state = calloc(InstructionCount, 1);
+        Memo[walk].cycles = calloc(InstructionCount, sizeof(uint32_t));
+    }
+
+    uint32_t cycles[sizeof(Isrs) / sizeof(Isrs[0])];
+    for (unsigned i = 0; i < sizeof(Isrs) / sizeof(Isrs[0]); i++) {
+        cycles[i] = _isr_cycles(i);
+    }
+    uint32_t cli = _cli_cycles();
+    if (Verbose) {
+        printf("\n");
+    }
+
+    for (unsigned i = 0; i < sizeof(Isrs) / sizeof(Isrs[0]); i++) {
+        if (cycles[i]) {
+            printf("%s=%u ", Isrs[i].name, cycles[i]);
+        }
+    }
+    printf("cli=%u\n", cli);
+    return 0;
+}